@@ -0,0 +1,85 @@
+#pragma once
+
+#include "bmpr.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace bench
+{
+    // Side lengths of the square images the whole-image benchmarks run on
+    inline constexpr std::int64_t kSides[] = {64, 256, 1024, 4096, 16384};
+
+    // Pool shared by the parallel runs, one thread per hardware thread
+    inline bmpr::Executor &Pool()
+    {
+        static bmpr::Executor pool;
+        return pool;
+    }
+
+    // Returns the executor for the threads argument: 1 runs on the calling thread, 0 on the pool
+    inline bmpr::Executor &ExecutorFor(std::int64_t threads)
+    {
+        return threads == 1 ? bmpr::Executor::Serial() : Pool();
+    }
+
+    // Registers side x threads arguments for every side up to max_side, single-threaded and parallel
+    inline void Sizes(benchmark::internal::Benchmark *b, std::int64_t max_side)
+    {
+        b->ArgNames({"side", "threads"});
+        for (const std::int64_t side : kSides)
+            if (side <= max_side)
+                for (const std::int64_t threads : {1, 0})
+                    b->Args({side, threads});
+        b->Unit(benchmark::kMicrosecond)->UseRealTime();
+    }
+
+    inline void AllSizes(benchmark::internal::Benchmark *b) { Sizes(b, 16384); }
+
+    // Resampling keeps a copy of the image, the largest size doesn't fit in memory twice on most machines
+    inline void MediumSizes(benchmark::internal::Benchmark *b) { Sizes(b, 4096); }
+
+    // Reports pixels/s and, through bytes_per_second, MB/s for pixels of bytes_per_pixel handled every iteration
+    inline void Report(benchmark::State &state, std::int64_t pixels, std::int64_t bytes_per_pixel = 3)
+    {
+        state.counters["pixels_per_second"] = benchmark::Counter(static_cast<double>(pixels), benchmark::Counter::kIsIterationInvariantRate);
+        state.SetBytesProcessed(state.iterations() * pixels * bytes_per_pixel);
+    }
+
+    // Returns a side x side image with a few shapes on a gray background, so encoders don't see a single color
+    template <typename ImageT = bmpr::Image>
+    ImageT TestImage(std::int64_t side)
+    {
+        const auto s = static_cast<std::int32_t>(side);
+        ImageT image(static_cast<std::size_t>(side), static_cast<std::size_t>(side), bmpr::Uninitialized);
+        image.Clear(bmpr::Color::GRAY, Pool());
+        image.DrawCircle(s / 2, s / 2, s / 3, bmpr::Color::BLUE);
+        image.DrawRectangle(s / 8, s / 8, s / 4, s / 2, bmpr::Color::ORANGE);
+        image.DrawLine(0, 0, s - 1, s - 1, std::max(1, s / 64), bmpr::Color::WHITE);
+        return image;
+    }
+
+    // Random shape parameters inside a side x side image
+    struct Shape
+    {
+        std::int32_t x1, y1, x2, y2, r;
+        bmpr::ColorRGBA color;
+    };
+
+    // Returns count shapes from a fixed seed, so every run draws the same ones
+    inline std::vector<Shape> RandomShapes(std::int64_t count, std::int32_t side)
+    {
+        std::mt19937 rng(1234);
+        std::uniform_int_distribution<std::int32_t> coord(0, side - 1), radius(1, side / 16), channel(0, 255);
+        std::vector<Shape> shapes(static_cast<std::size_t>(count));
+        for (Shape &shape : shapes)
+        {
+            shape = {coord(rng), coord(rng), coord(rng), coord(rng), radius(rng), {}};
+            shape.color = bmpr::ColorRGBA(static_cast<std::uint8_t>(channel(rng)), static_cast<std::uint8_t>(channel(rng)), static_cast<std::uint8_t>(channel(rng)));
+        }
+        return shapes;
+    }
+}
@@ -0,0 +1,295 @@
+// Drawing functions over a sweep of shape counts. The single-threaded runs draw straight into the image,
+// the parallel ones record a CommandBuffer and submit it to the pool, recording included
+#include "bench_common.hpp"
+
+namespace
+{
+    // Side of the image the shapes are drawn into
+    constexpr std::int32_t kCanvas = 1024;
+
+    void ShapeCounts(benchmark::internal::Benchmark *b)
+    {
+        b->ArgNames({"shapes", "threads"});
+        for (std::int64_t count = 1; count <= 4096; count *= 8)
+            for (const std::int64_t threads : {1, 0})
+                b->Args({count, threads});
+        b->Unit(benchmark::kMicrosecond)->UseRealTime();
+    }
+
+    // Calls draw(target, shape) for every shape on either the image or a command buffer, and reports shapes/s
+    template <typename Draw>
+    void RunShapes(benchmark::State &state, Draw &&draw)
+    {
+        const std::vector<bench::Shape> shapes = bench::RandomShapes(state.range(0), kCanvas);
+        const bool parallel = state.range(1) != 1;
+        bmpr::Image image(kCanvas, kCanvas);
+        bmpr::CommandBuffer commands;
+        commands.Reserve(shapes.size());
+
+        for (auto _ : state)
+        {
+            if (parallel)
+            {
+                commands.Reset();
+                for (const bench::Shape &shape : shapes)
+                    draw(commands, shape);
+                commands.Submit(image, bench::Pool());
+            }
+            else
+                for (const bench::Shape &shape : shapes)
+                    draw(image, shape);
+            benchmark::ClobberMemory();
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+
+    // Returns the number of pixels of image that aren't black
+    std::int64_t Painted(const bmpr::Image &image)
+    {
+        std::int64_t painted = 0;
+        for (std::int32_t y = 0; y < image.Height(); ++y)
+            for (const bmpr::Color &c : image.Row(y))
+                painted += c.r != 0 || c.g != 0 || c.b != 0;
+        return painted;
+    }
+
+    // Shapes at the ends of the coordinate range, or with negative or huge sizes, must clip to the image and never wrap
+    // around into it. Returns false if any of them painted a pixel they don't cover
+    bool ClipsExtremeShapes()
+    {
+        bmpr::Image image(50, 40);
+        image.DrawRectangle(INT32_MIN, INT32_MIN, -100000, -100000, bmpr::Color::RED);
+        image.DrawRectangle(INT32_MIN, INT32_MIN, INT32_MAX, INT32_MAX, bmpr::Color::RED);
+        image.DrawRectangle(INT32_MAX, INT32_MAX, INT32_MAX, INT32_MAX, bmpr::Color::RED);
+        image.DrawRectangle(10, 10, -5, -5, bmpr::Color::RED);
+        image.DrawRectangle(10, 10, INT32_MIN, INT32_MIN, bmpr::Color::RED);
+        for (const std::int32_t at : {INT32_MIN, INT32_MAX})
+            for (const std::int32_t r : {INT32_MIN, -5, 0, 10, 1 << 30})
+            {
+                image.DrawCircle(at, at, r, bmpr::Color::RED);
+                image.DrawCircleInverted(at, at, r, bmpr::Color::RED);
+                image.DrawCircleLine(at, at, r, bmpr::Color::RED);
+            }
+        // Off the image, so it returns at once instead of walking its 2^31 pixel radius
+        image.DrawCircleLine(INT32_MIN, INT32_MIN, INT32_MAX, bmpr::Color::RED);
+        if (Painted(image) != 0)
+            return false;
+
+        // A row and a circle larger than the image cover all of it
+        image.DrawRectangle(-10, 5, INT32_MAX, 1, bmpr::Color::RED);
+        if (Painted(image) != 50)
+            return false;
+        image.DrawCircle(25, 20, INT32_MAX, bmpr::Color::RED);
+        return Painted(image) == 50 * 40;
+    }
+
+    void BM_SetSafe(benchmark::State &state)
+    {
+        // Half the points land outside the image
+        RunShapes(state, [](auto &target, const bench::Shape &s)
+                  { target.SetSafe(s.x1 * 2 - kCanvas / 2, s.y1 * 2 - kCanvas / 2, s.color); });
+    }
+
+    void BM_Set(benchmark::State &state)
+    {
+        const std::vector<bench::Shape> shapes = bench::RandomShapes(state.range(0), kCanvas);
+        bmpr::Image image(kCanvas, kCanvas);
+        for (auto _ : state)
+        {
+            for (const bench::Shape &shape : shapes)
+                image.Set(shape.x1, shape.y1, shape.color);
+            benchmark::ClobberMemory();
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+
+    void BM_Get(benchmark::State &state)
+    {
+        const std::vector<bench::Shape> shapes = bench::RandomShapes(state.range(0), kCanvas);
+        const bmpr::Image image = bench::TestImage(kCanvas);
+        for (auto _ : state)
+        {
+            std::uint32_t sum = 0;
+            for (const bench::Shape &shape : shapes)
+                sum += image.Get(shape.x1, shape.y1).g;
+            benchmark::DoNotOptimize(sum);
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+
+    void BM_DrawLine(benchmark::State &state)
+    {
+        RunShapes(state, [](auto &target, const bench::Shape &s)
+                  { target.DrawLine(s.x1, s.y1, s.x2, s.y2, s.color); });
+    }
+
+    void BM_DrawThickLine(benchmark::State &state)
+    {
+        RunShapes(state, [](auto &target, const bench::Shape &s)
+                  { target.DrawLine(s.x1, s.y1, s.x2, s.y2, 8, s.color, bmpr::LineCap::Round); });
+    }
+
+    void BM_DrawLineAA(benchmark::State &state)
+    {
+        RunShapes(state, [](auto &target, const bench::Shape &s)
+                  { target.DrawLineAA(s.x1 + 0.25f, s.y1 + 0.5f, s.x2 + 0.75f, s.y2, s.color); });
+    }
+
+    void BM_DrawQuadraticBezierCurve(benchmark::State &state)
+    {
+        RunShapes(state, [](auto &target, const bench::Shape &s)
+                  { target.DrawQuadraticBezierCurve({s.x1, s.y1}, {s.x2, s.y1}, {s.x2, s.y2}, s.color); });
+    }
+
+    void BM_DrawCubicBezierCurve(benchmark::State &state)
+    {
+        RunShapes(state, [](auto &target, const bench::Shape &s)
+                  { target.DrawCubicBezierCurve({s.x1, s.y1}, {s.x2, s.y1}, {s.x1, s.y2}, {s.x2, s.y2}, s.color); });
+    }
+
+    void BM_DrawCircle(benchmark::State &state)
+    {
+        RunShapes(state, [](auto &target, const bench::Shape &s)
+                  { target.DrawCircle(s.x1, s.y1, s.r, s.color); });
+    }
+
+    void BM_DrawCircleBlended(benchmark::State &state)
+    {
+        RunShapes(state, [](auto &target, const bench::Shape &s)
+                  { target.DrawCircle(s.x1, s.y1, s.r, bmpr::ColorRGBA(s.color.r, s.color.g, s.color.b, 128)); });
+    }
+
+    void BM_DrawCircleLine(benchmark::State &state)
+    {
+        if (!ClipsExtremeShapes())
+            state.SkipWithError("Shapes with extreme arguments drew outside their area");
+        RunShapes(state, [](auto &target, const bench::Shape &s)
+                  { target.DrawCircleLine(s.x1, s.y1, s.r, s.color); });
+    }
+
+    void BM_DrawCircleAA(benchmark::State &state)
+    {
+        RunShapes(state, [](auto &target, const bench::Shape &s)
+                  { target.DrawCircleAA(s.x1 + 0.5f, s.y1 + 0.25f, s.r + 0.5f, s.color); });
+    }
+
+    void BM_DrawCircleLineAA(benchmark::State &state)
+    {
+        RunShapes(state, [](auto &target, const bench::Shape &s)
+                  { target.DrawCircleLineAA(s.x1 + 0.5f, s.y1 + 0.25f, s.r + 0.5f, s.color); });
+    }
+
+    void BM_DrawCircleInverted(benchmark::State &state)
+    {
+        RunShapes(state, [](auto &target, const bench::Shape &s)
+                  { target.DrawCircleInverted(s.x1, s.y1, s.r, s.color); });
+    }
+
+    void BM_DrawRectangle(benchmark::State &state)
+    {
+        if (!ClipsExtremeShapes())
+            state.SkipWithError("Shapes with extreme arguments drew outside their area");
+        RunShapes(state, [](auto &target, const bench::Shape &s)
+                  { target.DrawRectangle(std::min(s.x1, s.x2), std::min(s.y1, s.y2), s.r * 4, s.r * 2, s.color); });
+    }
+
+    void BM_DrawRectangleLine(benchmark::State &state)
+    {
+        RunShapes(state, [](auto &target, const bench::Shape &s)
+                  { target.DrawRectangleLine(std::min(s.x1, s.x2), std::min(s.y1, s.y2), s.r * 4, s.r * 2, s.color); });
+    }
+
+    void BM_DrawPolygon(benchmark::State &state)
+    {
+        RunShapes(state, [](auto &target, const bench::Shape &s)
+                  {
+                      const bmpr::Vector2 star[] = {{s.x1, s.y1 - s.r * 2}, {s.x1 + s.r, s.y1 + s.r * 2}, {s.x1 - s.r * 2, s.y1 - s.r / 2}, {s.x1 + s.r * 2, s.y1 - s.r / 2}, {s.x1 - s.r, s.y1 + s.r * 2}};
+                      target.DrawPolygon(star, s.color); });
+    }
+
+    void BM_DrawTriangles(benchmark::State &state)
+    {
+        RunShapes(state, [](auto &target, const bench::Shape &s)
+                  {
+                      const bmpr::Vector2 quad[] = {{s.x1, s.y1}, {s.x2, s.y1}, {s.x2, s.y2}, {s.x1, s.y1}, {s.x2, s.y2}, {s.x1, s.y2}};
+                      target.DrawTriangles(quad, s.color); });
+    }
+
+    // A chart label per shape, at sizes from crisp multiples of the font to anti-aliased ones in between
+    void BM_DrawText(benchmark::State &state)
+    {
+        RunShapes(state, [](auto &target, const bench::Shape &s)
+                  { target.DrawText(s.x1, s.y1, "Q3 revenue: 42%", 8 + s.r % 17, s.color); });
+    }
+
+    // Blends a 64x64 sprite per shape
+    void BM_Composite(benchmark::State &state)
+    {
+        const std::vector<bench::Shape> shapes = bench::RandomShapes(state.range(0), kCanvas);
+        bmpr::Image image(kCanvas, kCanvas);
+        bmpr::Image sprite = bench::TestImage(64);
+        for (auto _ : state)
+        {
+            for (const bench::Shape &shape : shapes)
+                image.Composite(sprite, shape.x1, shape.y1, bmpr::BlendMode::Over, 160);
+            benchmark::ClobberMemory();
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+
+    // Blends a 64x64 ImageRGBA layer per shape, a circle on a transparent background
+    void BM_CompositeLayer(benchmark::State &state)
+    {
+        const std::vector<bench::Shape> shapes = bench::RandomShapes(state.range(0), kCanvas);
+        bmpr::Image image(kCanvas, kCanvas);
+        bmpr::ImageRGBA layer(64, 64);
+        layer.DrawRectangle(0, 0, 64, 64, bmpr::ColorRGBA(0, 0, 0, 0), bmpr::BlendMode::Replace);
+        layer.DrawCircle(32, 32, 24, bmpr::Color::RED);
+
+        // Transparent pixels must leave the image as it is
+        image.Clear(bmpr::Color::WHITE);
+        image.Composite(layer, 0, 0);
+        const bmpr::Color corner = image.Get(0, 0);
+        if (corner.r != 255 || corner.g != 255 || corner.b != 255)
+            state.SkipWithError("Transparent layer pixels changed the image");
+
+        for (auto _ : state)
+        {
+            for (const bench::Shape &shape : shapes)
+                image.Composite(layer, shape.x1, shape.y1, bmpr::BlendMode::Over, 160);
+            benchmark::ClobberMemory();
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+
+    // Single-threaded only: Set, Get and Composite have no command buffer version
+    void SerialShapeCounts(benchmark::internal::Benchmark *b)
+    {
+        b->ArgNames({"shapes", "threads"});
+        for (std::int64_t count = 1; count <= 4096; count *= 8)
+            b->Args({count, 1});
+        b->Unit(benchmark::kMicrosecond)->UseRealTime();
+    }
+}
+
+BENCHMARK(BM_Set)->Apply(SerialShapeCounts);
+BENCHMARK(BM_Get)->Apply(SerialShapeCounts);
+BENCHMARK(BM_SetSafe)->Apply(ShapeCounts);
+BENCHMARK(BM_DrawLine)->Apply(ShapeCounts);
+BENCHMARK(BM_DrawThickLine)->Apply(ShapeCounts);
+BENCHMARK(BM_DrawLineAA)->Apply(ShapeCounts);
+BENCHMARK(BM_DrawQuadraticBezierCurve)->Apply(ShapeCounts);
+BENCHMARK(BM_DrawCubicBezierCurve)->Apply(ShapeCounts);
+BENCHMARK(BM_DrawCircle)->Apply(ShapeCounts);
+BENCHMARK(BM_DrawCircleBlended)->Apply(ShapeCounts);
+BENCHMARK(BM_DrawCircleLine)->Apply(ShapeCounts);
+BENCHMARK(BM_DrawCircleAA)->Apply(ShapeCounts);
+BENCHMARK(BM_DrawCircleLineAA)->Apply(ShapeCounts);
+BENCHMARK(BM_DrawCircleInverted)->Apply(ShapeCounts);
+BENCHMARK(BM_DrawRectangle)->Apply(ShapeCounts);
+BENCHMARK(BM_DrawRectangleLine)->Apply(ShapeCounts);
+BENCHMARK(BM_DrawPolygon)->Apply(ShapeCounts);
+BENCHMARK(BM_DrawTriangles)->Apply(ShapeCounts);
+BENCHMARK(BM_DrawText)->Apply(ShapeCounts);
+BENCHMARK(BM_Composite)->Apply(SerialShapeCounts);
+BENCHMARK(BM_CompositeLayer)->Apply(SerialShapeCounts);
@@ -0,0 +1,191 @@
+// Whole-image operations at every size, on the calling thread and on the pool
+#include "bench_common.hpp"
+
+namespace
+{
+    // Runs op(image, executor) on one test image per run and reports the pixels it touches
+    template <typename ImageT = bmpr::Image, typename Op>
+    void RunWholeImage(benchmark::State &state, Op &&op, std::int64_t bytes_per_pixel = 3)
+    {
+        const std::int64_t side = state.range(0);
+        bmpr::Executor &executor = bench::ExecutorFor(state.range(1));
+        ImageT image = bench::TestImage<ImageT>(side);
+        for (auto _ : state)
+        {
+            op(image, executor);
+            benchmark::ClobberMemory();
+        }
+        bench::Report(state, side * side, bytes_per_pixel);
+    }
+
+    void BM_Clear(benchmark::State &state)
+    {
+        RunWholeImage(state, [](bmpr::Image &image, bmpr::Executor &executor)
+                      { image.Clear(bmpr::Color::PASTEL_BLUE, executor); });
+    }
+
+    void BM_Invert(benchmark::State &state)
+    {
+        RunWholeImage(state, [](bmpr::Image &image, bmpr::Executor &executor)
+                      { image.Invert(executor); });
+    }
+
+    void BM_FillRandom(benchmark::State &state)
+    {
+        RunWholeImage(state, [](bmpr::Image &image, bmpr::Executor &executor)
+                      { image.FillRandom(1234, executor); });
+    }
+
+    void BM_FlipHorizontally(benchmark::State &state)
+    {
+        RunWholeImage(state, [](bmpr::Image &image, bmpr::Executor &executor)
+                      { image.FlipHorizontally(executor); });
+    }
+
+    void BM_FlipVertically(benchmark::State &state)
+    {
+        RunWholeImage(state, [](bmpr::Image &image, bmpr::Executor &executor)
+                      { image.FlipVertically(executor); });
+    }
+
+    void BM_Rotate180(benchmark::State &state)
+    {
+        RunWholeImage(state, [](bmpr::Image &image, bmpr::Executor &executor)
+                      { image.Rotate180(executor); });
+    }
+
+    void BM_Transpose(benchmark::State &state)
+    {
+        RunWholeImage(state, [](bmpr::Image &image, bmpr::Executor &executor)
+                      { image.Transpose(executor); });
+    }
+
+    void BM_Rotate90(benchmark::State &state)
+    {
+        RunWholeImage(state, [](bmpr::Image &image, bmpr::Executor &executor)
+                      { image.Rotate90(executor); });
+    }
+
+    void BM_Rotate270(benchmark::State &state)
+    {
+        RunWholeImage(state, [](bmpr::Image &image, bmpr::Executor &executor)
+                      { image.Rotate270(executor); });
+    }
+
+    void BM_RotateBilinear(benchmark::State &state)
+    {
+        RunWholeImage(state, [](bmpr::Image &image, bmpr::Executor &executor)
+                      { image.Rotate(30.0f, bmpr::Filter::Bilinear, executor); });
+    }
+
+    void BM_RotateNearest(benchmark::State &state)
+    {
+        RunWholeImage(state, [](bmpr::Image &image, bmpr::Executor &executor)
+                      { image.Rotate(30.0f, bmpr::Filter::Nearest, executor); });
+    }
+
+    void BM_TransformScale(benchmark::State &state)
+    {
+        RunWholeImage(state, [](bmpr::Image &image, bmpr::Executor &executor)
+                      { image.Transform(bmpr::Affine::Scale(0.75, 1.25), bmpr::Filter::Bilinear, executor); });
+    }
+
+    // Resizes a copy of the image, made every run from a buffer it reuses, reporting the source pixels.
+    // Shrinking to an eighth of the side is the thumbnail case
+    template <bmpr::Filter F, int Numerator, int Denominator>
+    void BM_Resize(benchmark::State &state)
+    {
+        const std::int64_t side = state.range(0);
+        bmpr::Executor &executor = bench::ExecutorFor(state.range(1));
+        const bmpr::Image source = bench::TestImage(side);
+        const auto size = static_cast<std::size_t>(side * Numerator / Denominator);
+        bmpr::Image image = source;
+        for (auto _ : state)
+        {
+            image = source;
+            image.Resize(size, size, F, executor);
+            benchmark::ClobberMemory();
+        }
+        bench::Report(state, side * side);
+    }
+
+    void BM_BoxBlur(benchmark::State &state)
+    {
+        RunWholeImage(state, [](bmpr::Image &image, bmpr::Executor &executor)
+                      { image.BoxBlur(8, executor); });
+    }
+
+    // Sigma 2 takes the 13-tap kernel path, sigma 10 the three box blurs
+    void BM_GaussianBlurKernel(benchmark::State &state)
+    {
+        RunWholeImage(state, [](bmpr::Image &image, bmpr::Executor &executor)
+                      { image.GaussianBlur(2.0f, executor); });
+    }
+
+    void BM_GaussianBlurBoxes(benchmark::State &state)
+    {
+        RunWholeImage(state, [](bmpr::Image &image, bmpr::Executor &executor)
+                      { image.GaussianBlur(10.0f, executor); });
+    }
+
+    void BM_Reset(benchmark::State &state)
+    {
+        RunWholeImage(state, [](bmpr::Image &image, bmpr::Executor &)
+                      { image.Reset(static_cast<std::size_t>(image.Width()), static_cast<std::size_t>(image.Height())); });
+    }
+
+    // Inverts the four quadrants through views, the way tiles are handed out to threads
+    void BM_ViewInvert(benchmark::State &state)
+    {
+        RunWholeImage(state, [](bmpr::Image &image, bmpr::Executor &executor)
+                      {
+                          const std::int32_t w = image.Width() / 2, h = image.Height() / 2;
+                          for (const bmpr::Rect area : {bmpr::Rect{0, 0, w, h}, bmpr::Rect{w, 0, 2 * w, h}, bmpr::Rect{0, h, w, 2 * h}, bmpr::Rect{w, h, 2 * w, 2 * h}})
+                              image.View(area).Invert(executor); });
+    }
+
+    // The same operations on the other pixel layouts
+    template <typename ImageT, std::int64_t BytesPerPixel>
+    void BM_InvertLayout(benchmark::State &state)
+    {
+        RunWholeImage<ImageT>(state, [](ImageT &image, bmpr::Executor &executor)
+                              { image.Invert(executor); }, BytesPerPixel);
+    }
+
+    template <typename ImageT, std::int64_t BytesPerPixel>
+    void BM_ClearLayout(benchmark::State &state)
+    {
+        RunWholeImage<ImageT>(state, [](ImageT &image, bmpr::Executor &executor)
+                              { image.Clear(bmpr::Color::PASTEL_GREEN, executor); }, BytesPerPixel);
+    }
+}
+
+BENCHMARK(BM_Clear)->Apply(bench::AllSizes);
+BENCHMARK(BM_Invert)->Apply(bench::AllSizes);
+BENCHMARK(BM_FillRandom)->Apply(bench::AllSizes);
+BENCHMARK(BM_FlipHorizontally)->Apply(bench::AllSizes);
+BENCHMARK(BM_FlipVertically)->Apply(bench::AllSizes);
+BENCHMARK(BM_Rotate180)->Apply(bench::AllSizes);
+BENCHMARK(BM_Transpose)->Apply(bench::AllSizes);
+BENCHMARK(BM_Rotate90)->Apply(bench::AllSizes);
+BENCHMARK(BM_Rotate270)->Apply(bench::AllSizes);
+BENCHMARK(BM_RotateBilinear)->Apply(bench::MediumSizes);
+BENCHMARK(BM_RotateNearest)->Apply(bench::MediumSizes);
+BENCHMARK(BM_TransformScale)->Apply(bench::MediumSizes);
+BENCHMARK_TEMPLATE(BM_Resize, bmpr::Filter::Bilinear, 1, 8)->Apply(bench::MediumSizes);
+BENCHMARK_TEMPLATE(BM_Resize, bmpr::Filter::Box, 1, 8)->Apply(bench::MediumSizes);
+BENCHMARK_TEMPLATE(BM_Resize, bmpr::Filter::Lanczos, 1, 8)->Apply(bench::MediumSizes);
+BENCHMARK_TEMPLATE(BM_Resize, bmpr::Filter::Lanczos, 2, 1)->Apply(bench::MediumSizes);
+BENCHMARK(BM_BoxBlur)->Apply(bench::MediumSizes);
+BENCHMARK(BM_GaussianBlurKernel)->Apply(bench::MediumSizes);
+BENCHMARK(BM_GaussianBlurBoxes)->Apply(bench::MediumSizes);
+BENCHMARK(BM_Reset)->Apply(bench::AllSizes);
+BENCHMARK(BM_ViewInvert)->Apply(bench::AllSizes);
+BENCHMARK_TEMPLATE(BM_InvertLayout, bmpr::ImageRGBX, 4)->Apply(bench::AllSizes);
+BENCHMARK_TEMPLATE(BM_InvertLayout, bmpr::ImagePlanar, 3)->Apply(bench::AllSizes);
+BENCHMARK_TEMPLATE(BM_InvertLayout, bmpr::ImageRGBA, 4)->Apply(bench::AllSizes);
+BENCHMARK_TEMPLATE(BM_InvertLayout, bmpr::ImageGray, 1)->Apply(bench::AllSizes);
+BENCHMARK_TEMPLATE(BM_ClearLayout, bmpr::ImageRGBX, 4)->Apply(bench::AllSizes);
+BENCHMARK_TEMPLATE(BM_ClearLayout, bmpr::ImagePlanar, 3)->Apply(bench::AllSizes);
+BENCHMARK_TEMPLATE(BM_ClearLayout, bmpr::ImageRGBA, 4)->Apply(bench::AllSizes);
+BENCHMARK_TEMPLATE(BM_ClearLayout, bmpr::ImageGray, 1)->Apply(bench::AllSizes);
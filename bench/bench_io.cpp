@@ -0,0 +1,202 @@
+// Encoding and decoding at every size, on the calling thread and on the pool
+#include "bench_common.hpp"
+
+#include <filesystem>
+#include <optional>
+#include <string>
+
+namespace
+{
+    std::string TempPath(const char *name)
+    {
+        return (std::filesystem::temp_directory_path() / name).string();
+    }
+
+    // Headers of files too large for the 32-bit size fields must zero them instead of wrapping, without any pixels needed.
+    // Returns false if a 100000 x 100000 header, about 30 GB, or a small one holds the wrong sizes
+    bool HeaderSizesFit()
+    {
+        const bmpr::Header huge = bmpr::detail::MakeHeader(100000, 100000);
+        const bmpr::Header huge_gray = bmpr::detail::MakeHeader(100000, 100000, bmpr::Encoding::Gray8);
+        const bmpr::Header small = bmpr::detail::MakeHeader(3, 2);
+        return huge.file_size == 0 && huge.img_size == 0 && huge_gray.file_size == 0 && huge_gray.img_size == 0 &&
+               small.img_size == 2 * 12 && small.file_size == sizeof(bmpr::Header) + 2 * 12;
+    }
+
+    // Every indexed encoding must read back as the pixels it was saved from. Returns false if a 2-color or a 4-color image
+    // of odd width doesn't come back the same from memory, or from a file Save wrote
+    bool IndexedRoundTrips()
+    {
+        bmpr::Image two(45, 23);
+        two.DrawCircle(22, 11, 9, bmpr::Color::WHITE);
+        bmpr::Image four = bench::TestImage(45);
+        const auto same = [](const bmpr::Image &image, const std::optional<bmpr::Image> &decoded)
+        {
+            if (!decoded || decoded->Width() != image.Width() || decoded->Height() != image.Height())
+                return false;
+            for (std::int32_t y = 0; y < image.Height(); ++y)
+                for (std::int32_t x = 0; x < image.Width(); ++x)
+                {
+                    const bmpr::Color a = image.Get(x, y), b = decoded->Get(x, y);
+                    if (a.r != b.r || a.g != b.g || a.b != b.b)
+                        return false;
+                }
+            return true;
+        };
+
+        using bmpr::Encoding;
+        std::vector<std::uint8_t> buffer;
+        for (const Encoding encoding : {Encoding::Palette1, Encoding::Palette4, Encoding::Palette8, Encoding::RLE4, Encoding::RLE8})
+            if (!two.SaveToBuffer(buffer, encoding) || !same(two, bmpr::Image::FromMemory(buffer.data(), buffer.size())))
+                return false;
+        for (const Encoding encoding : {Encoding::Palette4, Encoding::Palette8, Encoding::RLE4, Encoding::RLE8, Encoding::Smallest})
+            if (!four.SaveToBuffer(buffer, encoding) || !same(four, bmpr::Image::FromMemory(buffer.data(), buffer.size())))
+                return false;
+
+        const std::string path = TempPath("bmpr_bench_rle.bmp");
+        const bool loaded = four.Save(path, Encoding::RLE4) && same(four, bmpr::Image::Load(path));
+        std::filesystem::remove(path);
+        return loaded;
+    }
+
+    void BM_SaveTo(benchmark::State &state)
+    {
+        if (!HeaderSizesFit())
+            state.SkipWithError("Header sizes over 4 GiB wrapped");
+        const std::int64_t side = state.range(0);
+        bmpr::Executor &executor = bench::ExecutorFor(state.range(1));
+        bmpr::Image image = bench::TestImage(side);
+        std::vector<std::uint8_t> buffer(image.EncodedSize());
+        for (auto _ : state)
+            benchmark::DoNotOptimize(image.SaveTo(buffer, executor));
+        bench::Report(state, side * side);
+    }
+
+    void BM_SaveToBuffer(benchmark::State &state)
+    {
+        const std::int64_t side = state.range(0);
+        bmpr::Executor &executor = bench::ExecutorFor(state.range(1));
+        bmpr::Image image = bench::TestImage(side);
+        for (auto _ : state)
+        {
+            // A fresh buffer every time, as when serving a new response
+            std::vector<std::uint8_t> buffer;
+            benchmark::DoNotOptimize(image.SaveToBuffer(buffer, executor));
+        }
+        bench::Report(state, side * side);
+    }
+
+    // Saving right after a lazy flip only changes the order rows and pixels are written in
+    void BM_SaveToFlipped(benchmark::State &state)
+    {
+        const std::int64_t side = state.range(0);
+        bmpr::Executor &executor = bench::ExecutorFor(state.range(1));
+        bmpr::Image image = bench::TestImage(side);
+        image.SetLazyOrientation(true);
+        image.Rotate180();
+        std::vector<std::uint8_t> buffer(image.EncodedSize());
+        for (auto _ : state)
+            benchmark::DoNotOptimize(image.SaveTo(buffer, executor));
+        bench::Report(state, side * side);
+    }
+
+    void BM_SaveFile(benchmark::State &state)
+    {
+        const std::int64_t side = state.range(0);
+        bmpr::Executor &executor = bench::ExecutorFor(state.range(1));
+        bmpr::Image image = bench::TestImage(side);
+        const std::string path = TempPath("bmpr_bench_save.bmp");
+        for (auto _ : state)
+            if (!image.Save(path, executor))
+                state.SkipWithError("Save failed");
+        std::filesystem::remove(path);
+        bench::Report(state, side * side);
+    }
+
+    void BM_SaveSmallest(benchmark::State &state)
+    {
+        const std::int64_t side = state.range(0);
+        bmpr::Executor &executor = bench::ExecutorFor(state.range(1));
+        bmpr::Image image = bench::TestImage(side);
+        std::vector<std::uint8_t> buffer;
+        for (auto _ : state)
+            benchmark::DoNotOptimize(image.SaveToBuffer(buffer, bmpr::Encoding::Smallest, executor));
+        state.counters["ratio"] = static_cast<double>(image.EncodedSize()) / static_cast<double>(buffer.size());
+        bench::Report(state, side * side);
+    }
+
+    // Rewrites the tile under one small rectangle drawn per frame
+    void BM_SaveDirty(benchmark::State &state)
+    {
+        const std::int64_t side = state.range(0);
+        bmpr::Image image = bench::TestImage(side);
+        std::vector<std::uint8_t> buffer;
+        image.SaveToBuffer(buffer);
+        image.SetDirtyTracking(true);
+        std::uint8_t shade = 0;
+        for (auto _ : state)
+        {
+            image.DrawRectangle(4, 4, 32, 16, bmpr::Color(shade++));
+            benchmark::DoNotOptimize(image.SaveDirty(buffer));
+        }
+        bench::Report(state, side * side);
+    }
+
+    void BM_FromMemory(benchmark::State &state)
+    {
+        if (!IndexedRoundTrips())
+            state.SkipWithError("Indexed encodings don't read back");
+        const std::int64_t side = state.range(0);
+        std::vector<std::uint8_t> buffer;
+        bench::TestImage(side).SaveToBuffer(buffer);
+        for (auto _ : state)
+            benchmark::DoNotOptimize(bmpr::Image::FromMemory(buffer.data(), buffer.size()));
+        bench::Report(state, side * side);
+    }
+
+    void BM_Load(benchmark::State &state)
+    {
+        const std::int64_t side = state.range(0);
+        const std::string path = TempPath("bmpr_bench_load.bmp");
+        bench::TestImage(side).Save(path);
+        for (auto _ : state)
+            benchmark::DoNotOptimize(bmpr::Image::Load(path));
+        std::filesystem::remove(path);
+        bench::Report(state, side * side);
+    }
+
+    // Converts 64 images of side x side from memory through a flip and an invert, reporting pixels/s over all of them
+    void BM_Batch(benchmark::State &state)
+    {
+        const std::int64_t side = state.range(0);
+        std::vector<std::uint8_t> encoded;
+        bench::TestImage(side).SaveToBuffer(encoded);
+        const std::vector<std::span<const std::uint8_t>> inputs(64, encoded);
+        std::vector<std::vector<std::uint8_t>> outputs(inputs.size());
+
+        bmpr::Batch batch(bench::ExecutorFor(state.range(1)));
+        batch.FlipVertically().Invert();
+        for (auto _ : state)
+            benchmark::DoNotOptimize(batch.Run(inputs, outputs));
+        bench::Report(state, side * side * static_cast<std::int64_t>(inputs.size()));
+    }
+
+    // Decoding has no executor, so these only run single-threaded
+    void SerialSizes(benchmark::internal::Benchmark *b)
+    {
+        b->ArgNames({"side", "threads"});
+        for (const std::int64_t side : bench::kSides)
+            b->Args({side, 1});
+        b->Unit(benchmark::kMicrosecond)->UseRealTime();
+    }
+}
+
+BENCHMARK(BM_SaveTo)->Apply(bench::AllSizes);
+BENCHMARK(BM_SaveToBuffer)->Apply(bench::AllSizes);
+BENCHMARK(BM_SaveToFlipped)->Apply(bench::AllSizes);
+BENCHMARK(BM_SaveFile)->Apply(bench::MediumSizes);
+BENCHMARK(BM_SaveSmallest)->Apply(bench::AllSizes);
+BENCHMARK(BM_Batch)->Apply(bench::MediumSizes);
+BENCHMARK(BM_SaveDirty)->Apply(SerialSizes);
+BENCHMARK(BM_FromMemory)->Apply(SerialSizes);
+BENCHMARK(BM_Load)->Apply(SerialSizes);
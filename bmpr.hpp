@@ -1,8 +1,69 @@
+#pragma once
+
 #include <vector>
 #include <sstream>
 #include <fstream>
 #include <algorithm>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <string_view>
+#include <memory>
+#include <cstring>
+#include <span>
+#include <optional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <type_traits>
+#include <initializer_list>
+#include <utility>
+#include <bit>
+#include <limits>
+#include <memory_resource>
+#include <random>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define BMPR_POSIX
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define BMPR_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#define BMPR_NEON
+#include <arm_neon.h>
+#endif
+
+// Lets a single function use an instruction set the rest of the translation unit isn't compiled for
+#if defined(BMPR_X86) && (defined(__GNUC__) || defined(__clang__))
+#define BMPR_TARGET(isa) __attribute__((target(isa)))
+#else
+#define BMPR_TARGET(isa)
+#endif
+
+// Counters and timing hooks, compiled out unless BMPR_ENABLE_STATS is defined before including the header
+#if defined(BMPR_ENABLE_STATS)
+#include <chrono>
+#define BMPR_STAT_ADD(counter, n) ::bmpr::detail::g_stats.counter.fetch_add(static_cast<std::uint64_t>(n), std::memory_order_relaxed)
+#define BMPR_TIME(operation) const ::bmpr::detail::ScopedTimer bmpr_timer_(::bmpr::Operation::operation)
+#else
+#define BMPR_STAT_ADD(counter, n) ((void)0)
+#define BMPR_TIME(operation) ((void)0)
+#endif
 
 namespace bmpr
 {
@@ -35,15 +96,74 @@ namespace bmpr
         Vector2(int32_t x, int32_t y) : x(x), y(y) {}
     };
 
+    // Small and fast pseudo-random generator (xoshiro256**). The same seed gives the same numbers on every platform.
+    // Usable with the <random> distributions and algorithms
+    class Rng
+    {
+    public:
+        using result_type = std::uint64_t;
+
+        // Expands seed into the generator state with SplitMix64
+        explicit Rng(std::uint64_t seed = 0) noexcept
+        {
+            for (std::uint64_t &word : m_state)
+                word = SplitMix64(seed);
+        }
+
+        // Returns the next 64 random bits
+        std::uint64_t Next() noexcept
+        {
+            const std::uint64_t result = std::rotl(m_state[1] * 5, 7) * 9;
+            const std::uint64_t t = m_state[1] << 17;
+            m_state[2] ^= m_state[0];
+            m_state[3] ^= m_state[1];
+            m_state[1] ^= m_state[2];
+            m_state[0] ^= m_state[3];
+            m_state[2] ^= t;
+            m_state[3] = std::rotl(m_state[3], 45);
+            return result;
+        }
+
+        std::uint64_t operator()() noexcept { return Next(); }
+        static constexpr std::uint64_t min() noexcept { return 0; }
+        static constexpr std::uint64_t max() noexcept { return UINT64_MAX; }
+
+        // Returns the generator of the calling thread, seeded differently for every thread and run
+        static Rng &ThreadLocal()
+        {
+            static thread_local Rng rng{(static_cast<std::uint64_t>(std::random_device{}()) << 32) ^ std::random_device{}()};
+            return rng;
+        }
+
+        // Advances state by one step of the SplitMix64 sequence and returns its output
+        static constexpr std::uint64_t SplitMix64(std::uint64_t &state) noexcept
+        {
+            std::uint64_t z = (state += 0x9e3779b97f4a7c15);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            return z ^ (z >> 31);
+        }
+
+    private:
+        std::uint64_t m_state[4];
+    };
+
     struct Color
     {
         uint8_t r, g, b;
         Color() : r(0), g(0), b(0) {}
         Color(uint8_t rgb) : r(rgb), g(rgb), b(rgb) {}
         Color(uint8_t r, uint8_t g, uint8_t b) : r(r), g(g), b(b) {}
+        // Returns a color from the generator of the calling thread, every channel value equally likely
         static Color Random()
         {
-            return {static_cast<uint8_t>(rand() % 255), static_cast<uint8_t>(rand() % 255), static_cast<uint8_t>(rand() % 255)};
+            return Random(Rng::ThreadLocal());
+        }
+        // Returns a color from rng
+        static Color Random(Rng &rng)
+        {
+            const std::uint64_t bits = rng.Next();
+            return {static_cast<uint8_t>(bits >> 56), static_cast<uint8_t>(bits >> 48), static_cast<uint8_t>(bits >> 40)};
         }
 
         // Color defines
@@ -68,436 +188,7514 @@ namespace bmpr
     };
 
     // Color defines
-    const Color Color::BLACK = {0};
-    const Color Color::WHITE = {255};
-    const Color Color::RED = {255, 0, 0};
-    const Color Color::GREEN = {0, 255, 0};
-    const Color Color::BLUE = {0, 0, 255};
-    const Color Color::YELLOW = {255, 255, 0};
-    const Color Color::CYAN = {0, 255, 255};
-    const Color Color::MAGENTA = {255, 0, 255};
-    const Color Color::ORANGE = {255, 165, 0};
-    const Color Color::PINK = {255, 192, 203};
-    const Color Color::PURPLE = {128, 0, 128};
-    const Color Color::BROWN = {139, 69, 19};
-    const Color Color::GRAY = {128, 128, 128};
-    const Color Color::LIGHT_GRAY = {192, 192, 192};
-    const Color Color::DARK_GRAY = {64, 64, 64};
-    const Color Color::PASTEL_YELLOW = {255, 255, 153};
-    const Color Color::PASTEL_GREEN = {153, 255, 153};
-    const Color Color::PASTEL_BLUE = {153, 204, 255};
-
-    class Image
+    inline const Color Color::BLACK = {0};
+    inline const Color Color::WHITE = {255};
+    inline const Color Color::RED = {255, 0, 0};
+    inline const Color Color::GREEN = {0, 255, 0};
+    inline const Color Color::BLUE = {0, 0, 255};
+    inline const Color Color::YELLOW = {255, 255, 0};
+    inline const Color Color::CYAN = {0, 255, 255};
+    inline const Color Color::MAGENTA = {255, 0, 255};
+    inline const Color Color::ORANGE = {255, 165, 0};
+    inline const Color Color::PINK = {255, 192, 203};
+    inline const Color Color::PURPLE = {128, 0, 128};
+    inline const Color Color::BROWN = {139, 69, 19};
+    inline const Color Color::GRAY = {128, 128, 128};
+    inline const Color Color::LIGHT_GRAY = {192, 192, 192};
+    inline const Color Color::DARK_GRAY = {64, 64, 64};
+    inline const Color Color::PASTEL_YELLOW = {255, 255, 153};
+    inline const Color Color::PASTEL_GREEN = {153, 255, 153};
+    inline const Color Color::PASTEL_BLUE = {153, 204, 255};
+
+    // A color padded to 4 bytes, so every pixel starts on a 4-byte boundary
+    struct alignas(4) ColorX
     {
-    public:
-        // Initialize an image with a width and height in pixels
-        Image(std::size_t width, std::size_t height);
-        // Set the color of a specific pixel
-        void Set(std::int32_t x, std::int32_t y, const Color &color);
-        // Set the color of a specific pixel only if it's valid
-        void SetSafe(std::int32_t x, std::int32_t y, const Color &color);
-        // Sets the whole image to the specific color
-        void Clear(const Color &color);
-        // Draws a line from x1;y1 to x2;y2
-        void DrawLine(std::int32_t x1, std::int32_t y1, std::int32_t x2, std::int32_t y2, Color color);
-        // Draws a line from x1;y1 to x2;y2 with a certain thickness
-        void DrawLine(std::int32_t x1, std::int32_t y1, std::int32_t x2, std::int32_t y2, int thickness, Color color);
-        // Draws a quadratic bezier curve
-        void DrawQuadraticBezierCurve(const Vector2 &start, const Vector2 &control, const Vector2 &end, float step_size, const Color &color);
-        void DrawQuadraticBezierCurve(const Vector2 &start, const Vector2 &control, const Vector2 &end, int num_points, const Color &color);
-        // Draws a filled circle at x;y as its center
-        void DrawCircle(std::int32_t x, std::int32_t y, std::int32_t r, Color color);
-        // Draws the circumference of a circle at x;y as its center
-        void DrawCircleLine(std::int32_t x, std::int32_t y, std::int32_t r, Color color);
-        // Draws a filled rectangle that contains the circle, with the circle not being drawn
-        void DrawCircleInverted(std::int32_t x, std::int32_t y, std::int32_t r, Color color);
-        // Draws a filled rectangle with the top-left most point at x;y
-        void DrawRectangle(std::int32_t x, std::int32_t y, std::int32_t w, std::int32_t h, Color color);
-        // Draws the perimeter of a rectangle witht the top-left most point at x;y
-        void DrawRectangleLine(std::int32_t x, std::int32_t y, std::int32_t w, std::int32_t h, Color color);
-        // Returns image width in pixels
-        std::int32_t Width() const noexcept;
-        // Returns image height in pixels
-        std::int32_t Height() const noexcept;
-        // Saves the image to file. NOTE: Include the .bmp extension
-        bool Save(const std::string &path);
-        // Rotates the image 180 degrees
-        void Rotate180();
-        // Flips the image horizontally
-        void FlipHorizontally();
-        // Flips the image vertically
-        void FlipVertically();
-        // Inverts the colors of the image
-        void Invert();
+        uint8_t r, g, b, x;
+        ColorX() : r(0), g(0), b(0), x(0) {}
+        ColorX(const Color &color) : r(color.r), g(color.g), b(color.b), x(0) {}
+        operator Color() const { return {r, g, b}; }
+    };
 
-        //
-        // DEBUG FUNCTIONS
-        //
-        // These will get removed or be implemented in the future.
-        // Rotates the image ???-wise by an angle in degrees
-        void DEBUGRotate(float angle);
-        // Bilinear color interpolation
-        Color DEBUGInterpolateColor(float x, float y);
+    static_assert(sizeof(Color) == 3, "Color must be tightly packed");
+    static_assert(sizeof(ColorX) == 4, "ColorX must be 4 bytes");
 
-    private:
-        std::vector<Color> m_data;
-        std::int32_t m_width = 0, m_height = 0;
+    // A color with straight (not premultiplied) alpha, 255 being opaque
+    struct ColorRGBA
+    {
+        uint8_t r, g, b, a;
+        ColorRGBA() : r(0), g(0), b(0), a(255) {}
+        ColorRGBA(uint8_t r, uint8_t g, uint8_t b, uint8_t a = 255) : r(r), g(g), b(b), a(a) {}
+        ColorRGBA(const Color &color, uint8_t a = 255) : r(color.r), g(color.g), b(color.b), a(a) {}
+        operator Color() const { return {r, g, b}; }
     };
-}
-
-// Implementations
-namespace bmpr
-{
-    Image::Image(std::size_t width, std::size_t height) : m_data(width * height), m_width{static_cast<std::int32_t>(width)}, m_height{static_cast<std::int32_t>(height)} {}
 
-    void Image::Set(std::int32_t x, std::int32_t y, const Color &color)
+    // An 8-bit gray level, for masks and other single-channel images. Colors convert to their luma
+    struct Gray
     {
-        m_data[static_cast<std::size_t>(y) * m_width + x] = color;
-    }
+        uint8_t v;
+        Gray() : v(0) {}
+        explicit Gray(uint8_t v) : v(v) {}
+        Gray(const Color &color) : v(static_cast<uint8_t>((77 * color.r + 150 * color.g + 29 * color.b + 128) >> 8)) {}
+        operator Color() const { return {v, v, v}; }
+    };
+
+    static_assert(sizeof(ColorRGBA) == 4, "ColorRGBA must be 4 bytes");
+    static_assert(sizeof(Gray) == 1, "Gray must be 1 byte");
 
-    void Image::SetSafe(std::int32_t x, std::int32_t y, const Color &color)
+    // Tag for constructors and Reset that leave the pixels uninitialized
+    struct UninitializedTag
     {
-        if (x >= 0 && x < m_width && y >= 0 && y < m_height)
-        {
-            std::size_t index = static_cast<std::size_t>(y) * m_width + x;
-            m_data[index] = color;
-        }
-    }
+        explicit UninitializedTag() = default;
+    };
+    inline constexpr UninitializedTag Uninitialized{};
 
-    void Image::DrawLine(std::int32_t x1, std::int32_t y1, std::int32_t x2, std::int32_t y2, Color color)
+    // Allocator returning memory aligned to Alignment bytes, so rows can be read with aligned vector loads.
+    // Memory comes from resource when one is given, from the global heap otherwise. Copies of a container, such as a
+    // copied image, allocate from the global heap like std::pmr::polymorphic_allocator, so they outlive the resource.
+    // Default-inserted elements are left uninitialized, containers fill them explicitly when needed.
+    template <typename T, std::size_t Alignment = 64>
+    struct AlignedAllocator
     {
-        int delta_x = abs(x2 - x1);
-        int delta_y = abs(y2 - y1);
-        int sign_x = (x1 < x2) ? 1 : -1;
-        int sign_y = (y1 < y2) ? 1 : -1;
+        using value_type = T;
 
-        int error = delta_x - delta_y;
+        template <typename U>
+        struct rebind
+        {
+            using other = AlignedAllocator<U, Alignment>;
+        };
 
-        int x = x1;
-        int y = y1;
+        AlignedAllocator() noexcept = default;
+        AlignedAllocator(std::pmr::memory_resource *resource) noexcept : m_resource{resource} {}
+        template <typename U>
+        AlignedAllocator(const AlignedAllocator<U, Alignment> &other) noexcept : m_resource{other.Resource()} {}
 
-        while (x != x2 || y != y2)
-        {
-            // Set the pixel color
-            SetSafe(x, y, color);
+        // Containers copied from one using this allocator get the global heap
+        AlignedAllocator select_on_container_copy_construction() const noexcept { return {}; }
 
-            int error2 = error * 2;
+        T *allocate(std::size_t n)
+        {
+            if (m_resource)
+                return static_cast<T *>(m_resource->allocate(n * sizeof(T), Alignment));
+            return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t{Alignment}));
+        }
 
-            if (error2 > -delta_y)
-            {
-                error -= delta_y;
-                x += sign_x;
-            }
+        void deallocate(T *p, std::size_t n) noexcept
+        {
+            if (m_resource)
+                m_resource->deallocate(p, n * sizeof(T), Alignment);
+            else
+                ::operator delete(p, std::align_val_t{Alignment});
+        }
 
-            if (error2 < delta_x)
-            {
-                error += delta_x;
-                y += sign_y;
-            }
+        template <typename U>
+        void construct(U *p) noexcept(std::is_nothrow_default_constructible_v<U>)
+        {
+            if constexpr (!std::is_trivially_copyable_v<U>)
+                ::new (static_cast<void *>(p)) U;
+        }
+        template <typename U, typename... Args>
+        void construct(U *p, Args &&...args)
+        {
+            ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...);
         }
-    }
 
-    void Image::DrawLine(std::int32_t x1, std::int32_t y1, std::int32_t x2, std::int32_t y2, int thickness, Color color)
-    {
-        // Check if the line thickness is less than 1
-        if (thickness < 1)
-            thickness = 1;
+        // Returns the memory resource, or nullptr for the global heap
+        std::pmr::memory_resource *Resource() const noexcept { return m_resource; }
 
-        int delta_x = abs(x2 - x1);
-        int delta_y = abs(y2 - y1);
-        int sign_x = (x1 < x2) ? 1 : -1;
-        int sign_y = (y1 < y2) ? 1 : -1;
+        template <typename U>
+        bool operator==(const AlignedAllocator<U, Alignment> &other) const noexcept { return m_resource == other.Resource(); }
+        template <typename U>
+        bool operator!=(const AlignedAllocator<U, Alignment> &other) const noexcept { return m_resource != other.Resource(); }
 
-        int error = delta_x - delta_y;
+    private:
+        std::pmr::memory_resource *m_resource = nullptr;
+    };
 
-        int x = x1;
-        int y = y1;
+    // Axis-aligned pixel rectangle covering [x0;x1) x [y0;y1)
+    struct Rect
+    {
+        std::int32_t x0 = 0, y0 = 0, x1 = 0, y1 = 0;
 
-        while (x != x2 || y != y2)
+        // Returns true if the rectangle covers no pixels
+        bool Empty() const noexcept { return x0 >= x1 || y0 >= y1; }
+        // Returns true if other lies completely inside the rectangle
+        bool Contains(const Rect &other) const noexcept
         {
-            // Set the pixel color for the current thickness
-            for (int i = 0; i < thickness; ++i)
-            {
-                for (int j = 0; j < thickness; ++j)
-                {
-                    SetSafe(x + i - thickness / 2, y + j - thickness / 2, color);
-                }
-            }
-
-            int error2 = error * 2;
+            return other.x0 >= x0 && other.y0 >= y0 && other.x1 <= x1 && other.y1 <= y1;
+        }
+        // Returns the overlap of both rectangles
+        Rect Intersect(const Rect &other) const noexcept
+        {
+            return {std::max(x0, other.x0), std::max(y0, other.y0), std::min(x1, other.x1), std::min(y1, other.y1)};
+        }
+    };
 
-            if (error2 > -delta_y)
-            {
-                error -= delta_y;
-                x += sign_x;
-            }
+    // How the ends of a thick line are drawn
+    enum class LineCap : std::uint8_t
+    {
+        // The stroke stops at the end points
+        Butt,
+        // The stroke extends half its thickness past the end points
+        Square,
+        // The stroke ends in half circles around the end points
+        Round
+    };
 
-            if (error2 < delta_x)
-            {
-                error += delta_x;
-                y += sign_y;
-            }
-        }
-    }
+    // Which pixels inside a self-intersecting or nested polygon outline are filled
+    enum class FillRule : std::uint8_t
+    {
+        // Pixels crossed by an odd number of edges on the way out
+        EvenOdd,
+        // Pixels the outline winds around at least once
+        NonZero
+    };
 
-    void Image::DrawQuadraticBezierCurve(const Vector2 &start, const Vector2 &control, const Vector2 &end, int num_points, const Color &color)
+    // How drawn colors combine with the pixels below them. Blending uses premultiplied alpha
+    enum class BlendMode : std::uint8_t
     {
-        for (int i = 0; i <= num_points; ++i)
-        {
-            float t = static_cast<float>(i) / static_cast<float>(num_points);
+        // The color overwrites the pixels, its alpha is ignored
+        Replace,
+        // The color is laid over the pixels (source-over)
+        Over,
+        // The color is added to the pixels, saturating at white
+        Add,
+        // The pixels are multiplied by the color, darkening them
+        Multiply,
+        // The inverted pixels are multiplied by the inverted color, lightening them
+        Screen
+    };
 
-            float x = pow(1 - t, 2) * start.x + 2 * t * (1 - t) * control.x + pow(t, 2) * end.x;
-            float y = pow(1 - t, 2) * start.y + 2 * t * (1 - t) * control.y + pow(t, 2) * end.y;
+    // How source pixels are sampled when an image is resampled
+    enum class Filter : std::uint8_t
+    {
+        // The source pixel the sample point falls in
+        Nearest,
+        // Weighted average of the 2x2 source pixels around the sample point
+        Bilinear,
+        // Average of the source pixels the destination pixel covers, the same as Nearest when enlarging
+        Box,
+        // Lanczos windowed sinc over 3 source pixels on either side, the sharpest. The overshoot near hard edges is clamped
+        Lanczos
+    };
 
-            // Set the pixel color for the calculated point
-            SetSafe(static_cast<int>(x), static_cast<int>(y), color);
-        }
-    }
-    void Image::DrawQuadraticBezierCurve(const Vector2 &start, const Vector2 &control, const Vector2 &end, float step_size, const Color &color)
+    // Pixel formats a BMP file can be saved in
+    enum class Encoding : std::uint8_t
     {
-        float t = 0.0;
+        // 24-bit BGR, what Save writes for images without alpha
+        BGR24,
+        // 32-bit BGRA, what Save writes for images with alpha. Images without alpha are saved opaque
+        BGRA32,
+        // 8-bit indices into a table of 256 grays, what Save writes for grayscale images. Color images are saved as their luma
+        Gray8,
+        // 1, 4 or 8 bits per pixel indexing a table of up to 2, 16 or 256 colors
+        Palette1,
+        Palette4,
+        Palette8,
+        // Run-length encoded 4 or 8-bit indices (BI_RLE4, BI_RLE8)
+        RLE4,
+        RLE8,
+        // Whichever of the encoding Save writes and the palette ones gives the smallest file for the image.
+        // Palettes can't hold alpha, so images with alpha always save as BGRA32
+        Smallest
+    };
 
-        while (t <= 1.0)
-        {
-            float x = pow(1 - t, 2) * start.x + 2 * t * (1 - t) * control.x + pow(t, 2) * end.x;
-            float y = pow(1 - t, 2) * start.y + 2 * t * (1 - t) * control.y + pow(t, 2) * end.y;
+    // Compile-time layout of the pixel types BasicImage stores: the bytes of a pixel, whether its last byte is alpha,
+    // and the uncompressed encoding Save writes it with
+    template <typename PixelT>
+    struct PixelTraits;
 
-            // Set the pixel color for the calculated point
-            SetSafe(static_cast<int>(x), static_cast<int>(y), color);
+    template <>
+    struct PixelTraits<Color>
+    {
+        static constexpr std::size_t kBytes = 3;
+        static constexpr bool kAlpha = false;
+        static constexpr Encoding kEncoding = Encoding::BGR24;
+    };
 
-            t += step_size;
-        }
-    }
+    template <>
+    struct PixelTraits<ColorX>
+    {
+        static constexpr std::size_t kBytes = 4;
+        static constexpr bool kAlpha = false;
+        static constexpr Encoding kEncoding = Encoding::BGR24;
+    };
 
-    // Probably not the best solution, but it's only addition
-    void Image::DrawCircle(std::int32_t x, std::int32_t y, std::int32_t r, Color color)
+    template <>
+    struct PixelTraits<ColorRGBA>
     {
-        for (std::int32_t y1 = -r; y1 <= r; y1++)
-            for (std::int32_t x1 = -r; x1 <= r; x1++)
-                if (x1 * x1 + y1 * y1 < r * r + r)
-                    SetSafe(x + x1, y + y1, color);
-    }
+        static constexpr std::size_t kBytes = 4;
+        static constexpr bool kAlpha = true;
+        static constexpr Encoding kEncoding = Encoding::BGRA32;
+    };
 
-    void Image::DrawCircleLine(std::int32_t x, std::int32_t y, std::int32_t r, Color color)
+    template <>
+    struct PixelTraits<Gray>
     {
-        int center_x = 0;
-        int center_y = r;
-        int d = 3 - 2 * r;
+        static constexpr std::size_t kBytes = 1;
+        static constexpr bool kAlpha = false;
+        static constexpr Encoding kEncoding = Encoding::Gray8;
+    };
 
-        while (center_x <= center_y)
-        {
-            // Octants
-            SetSafe(x + center_x, y + center_y, color);
-            SetSafe(x - center_x, y + center_y, color);
-            SetSafe(x + center_x, y - center_y, color);
-            SetSafe(x - center_x, y - center_y, color);
-            SetSafe(x + center_y, y + center_x, color);
-            SetSafe(x - center_y, y + center_x, color);
-            SetSafe(x + center_y, y - center_x, color);
-            SetSafe(x - center_y, y - center_x, color);
+    // Flips an image has recorded but not yet applied to its pixels
+    struct Orientation
+    {
+        bool flip_x = false, flip_y = false;
+    };
 
-            if (d < 0)
-                d += 4 * center_x++ + 6;
-            else
-                d += 4 * (center_x++ - center_y--) + 10;
-        }
-    }
+    // 2D affine transform mapping x;y to xx * x + xy * y + tx; yx * x + yy * y + ty.
+    // Coordinates are continuous: pixel x;y covers [x;x+1) x [y;y+1) and its center is x+0.5;y+0.5
+    struct Affine
+    {
+        double xx = 1, xy = 0, tx = 0;
+        double yx = 0, yy = 1, ty = 0;
+
+        // Moves by dx;dy
+        static Affine Translation(double dx, double dy) noexcept;
+        // Scales by sx;sy around the origin
+        static Affine Scale(double sx, double sy) noexcept;
+        // Rotates clockwise (with y pointing down) by an angle in degrees around the origin. Multiples of 90 degrees are exact
+        static Affine Rotation(double degrees) noexcept;
+        // Rotates clockwise by an angle in degrees around cx;cy
+        static Affine Rotation(double degrees, double cx, double cy) noexcept;
+        // Returns the transform applying other first, then this one
+        Affine operator*(const Affine &other) const noexcept;
+        // Returns the inverse transform, or nothing if this one is singular
+        std::optional<Affine> Inverse() const noexcept;
+    };
 
-    void Image::DrawCircleInverted(std::int32_t x, std::int32_t y, std::int32_t r, Color color)
+    // One row of a planar image, with a separate pointer per channel
+    struct PlanarRow
     {
-        for (std::int32_t y1 = -r; y1 <= r; y1++)
-            for (std::int32_t x1 = -r; x1 <= r; x1++)
-                if (x1 * x1 + y1 * y1 >= r * r + r && x1 / x1 + y1 / y1 <= r * r - r)
-                    SetSafe(x + x1, y + y1, color);
-    }
+        std::uint8_t *r, *g, *b;
+    };
 
-    void Image::DrawRectangle(std::int32_t x, std::int32_t y, std::int32_t w, std::int32_t h, Color color)
+#if defined(BMPR_ENABLE_STATS)
+    // Operations BMPR_ENABLE_STATS times, every overload of a function counting as the same operation
+    enum class Operation : std::uint8_t
     {
-        for (std::int32_t width = 0; width < w; width++)
-            for (std::int32_t height = 0; height < h; height++)
-                SetSafe(x + width, y + height, color);
-    }
+        DrawLine,
+        DrawThickLine,
+        DrawQuadraticBezierCurve,
+        DrawCubicBezierCurve,
+        DrawCircle,
+        DrawCircleLine,
+        DrawLineAA,
+        DrawCircleAA,
+        DrawCircleLineAA,
+        DrawCircleInverted,
+        DrawRectangle,
+        DrawRectangleLine,
+        DrawPolygon,
+        DrawTriangles,
+        DrawText,
+        Composite,
+        Clear,
+        // Transform and Rotate
+        Transform,
+        Resize,
+        Rotate180,
+        FlipHorizontally,
+        FlipVertically,
+        Invert,
+        FillRandom,
+        BoxBlur,
+        GaussianBlur,
+        Convolve,
+        // Transpose, and the first half of Rotate90 and Rotate270
+        Transpose,
+        // Writing the pixels of a BMP file: SaveTo and the rest of the Save family
+        Encode,
+        Count
+    };
 
-    void Image::DrawRectangleLine(std::int32_t x, std::int32_t y, std::int32_t w, std::int32_t h, Color color)
+    // Returns the name of operation, such as "DrawCircle"
+    const char *OperationName(Operation operation) noexcept;
+
+    // Counters collected since the program started or the last ResetStats, summed over every thread
+    struct Stats
     {
-        for (std::int32_t width = 0; width < w; width++)
-        {
-            SetSafe(x + width, y, color);
-            SetSafe(x + width, y + h, color);
-        }
-        for (std::int32_t height = 0; height < h; height++)
+        // Number of calls and their total and longest latency in nanoseconds
+        struct Timing
         {
-            SetSafe(x, y + height, color);
-            SetSafe(x + w, y + height, color);
-        }
-        SetSafe(x + w, y + h, color);
-    }
+            std::uint64_t calls = 0, total_ns = 0, max_ns = 0;
+        };
 
-    void Image::Clear(const Color &color)
-    {
-        std::fill(m_data.begin(), m_data.end(), color);
-    }
+        // Pixels stored or blended by drawing functions, Set and whole-image operations
+        std::uint64_t pixels_written = 0;
+        // SetSafe calls for pixels outside the image
+        std::uint64_t set_safe_rejections = 0;
+        // Row spans filled by the shape functions
+        std::uint64_t spans_filled = 0;
+        // Bytes of BMP data the Save family wrote
+        std::uint64_t bytes_encoded = 0;
+        Timing timings[static_cast<std::size_t>(Operation::Count)];
+
+        const Timing &operator[](Operation operation) const noexcept { return timings[static_cast<std::size_t>(operation)]; }
+    };
 
-    std::int32_t Image::Width() const noexcept { return m_width; }
+    // Called after every timed operation with its latency, on the thread that ran it
+    using StatsCallback = void (*)(Operation operation, std::uint64_t nanoseconds, void *user);
 
-    std::int32_t Image::Height() const noexcept { return m_height; }
+    // Returns a snapshot of the counters. Counters keep running while it's taken, so they may be a few calls apart
+    Stats GetStats() noexcept;
+    // Sets every counter back to zero
+    void ResetStats() noexcept;
+    // Calls callback with user after every timed operation, nullptr stops. Set it while no operation is running
+    void SetStatsCallback(StatsCallback callback, void *user = nullptr) noexcept;
+#endif
 
-    bool Image::Save(const std::string &path)
+    // Reusable pool of worker threads that splits row ranges into bands.
+    // Every band runs the same code as the serial path, so results don't depend on the thread count.
+    class Executor
     {
-        const std::int32_t row_size = m_width * 3 + m_width % 4;
-        const std::uint32_t bmp_size = row_size * m_height;
+    public:
+        // threads counts the calling thread too, 0 uses every hardware thread. grain is the number of rows per band
+        explicit Executor(std::size_t threads = 0, std::int32_t grain = 64);
+        ~Executor();
+        Executor(const Executor &) = delete;
+        Executor &operator=(const Executor &) = delete;
 
-        const Header header = {0x4d42,                                                // Signature ('BM')
-                               static_cast<std::uint32_t>(bmp_size + sizeof(Header)), // File size in bytes
-                               0,                                                     // reserved (unused)
-                               sizeof(Header),                                        // Offset from beginning of file to the beginning of the bitmap data
-                               40,                                                    // Size of InfoHeader
-                               m_width,                                               // Horizontal width of bitmap in pixels
-                               m_height,                                              // Vertical height of bitmap in pixels
-                               1,                                                     // Number of Planes
-                               24,                                                    // Bit-depth
-                               0,                                                     // Compression (0 = none)
-                               bmp_size,                                              // Size of Image
-                               0,                                                     // Horizontal resolution: Pixels/meter
-                               0,                                                     // Vertical resolution: Pixels/meter
-                               0,                                                     // Colors used
-                               0};                                                    // Number of important colors (0 = all)
+        // Returns the number of threads taking part in a ParallelFor, including the caller
+        std::size_t Threads() const noexcept;
+        // Returns the number of rows per band
+        std::int32_t Grain() const noexcept;
+        // Sets the number of rows per band
+        void SetGrain(std::int32_t grain) noexcept;
+        // Calls fn(band_begin, band_end) for bands covering [begin;end) and waits for all of them.
+        // The first exception thrown by fn is rethrown once every band has finished.
+        template <typename Fn>
+        void ParallelFor(std::int32_t begin, std::int32_t end, Fn &&fn);
+        // Same as above with grain items per band instead of Grain()
+        template <typename Fn>
+        void ParallelFor(std::int32_t begin, std::int32_t end, std::int32_t grain, Fn &&fn);
+        // Returns an executor that runs everything on the calling thread
+        static Executor &Serial();
 
-        if (std::ofstream ofs{path, std::ios_base::binary})
+    private:
+        struct Job
         {
-            ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
-
-            std::vector<std::uint8_t> line(row_size);
+            void *context;
+            void (*invoke)(void *context, std::int32_t begin, std::int32_t end);
+            std::int32_t begin, end, grain;
+            std::size_t bands;
+        };
 
-            for (std::int32_t y = m_height - 1; -1 < y; --y)
-            {
-                size_t pos = 0;
+        void Run(const Job &job);
+        void Work(const Job &job);
+        void WorkerLoop();
 
-                for (std::int32_t x = 0; x < m_width; ++x)
-                {
-                    const Color &col = m_data[static_cast<std::size_t>(y) * m_width + x];
-                    line[pos++] = col.b;
-                    line[pos++] = col.g;
-                    line[pos++] = col.r;
-                }
+        std::vector<std::thread> m_workers;
+        std::int32_t m_grain;
 
-                ofs.write(reinterpret_cast<const char *>(line.data()), line.size());
-            }
+        std::mutex m_submit;
+        std::mutex m_mutex;
+        std::condition_variable m_wake, m_done;
+        const Job *m_job = nullptr;
+        std::uint64_t m_generation = 0;
+        std::size_t m_finished = 0, m_busy = 0;
+        std::atomic<std::size_t> m_next{0};
+        std::exception_ptr m_error;
+        bool m_stop = false;
 
-            return true;
-        }
-        else
-            return false;
-    }
+        // The pool the current thread is working for, nested calls on it run inline
+        static inline thread_local const Executor *t_current = nullptr;
+    };
 
-    void Image::Rotate180()
+    namespace detail
     {
-        std::reverse(m_data.begin(), m_data.end());
+        template <typename Target>
+        class ClipTarget;
+        struct Paint;
+        struct BmpLayout;
+        class Palette;
     }
 
-    void Image::FlipHorizontally()
-    {
-        for (int y = 0; y < m_height; ++y)
-        {
-            for (int x = 0; x < m_width / 2; ++x)
-            {
-                int index_1D_left = y * m_width + x;
-                int index_1D_right = y * m_width + (m_width - 1 - x);
-                std::swap(m_data[index_1D_left], m_data[index_1D_right]);
-            }
-        }
-    }
+    // Largest text size DrawText draws at, larger sizes being drawn at this one
+    inline constexpr std::int32_t kMaxTextSize = 256;
 
-    void Image::FlipVertically()
-    {
-        for (int y = 0; y < m_height / 2; ++y)
-        {
-            for (int x = 0; x < m_width; ++x)
-            {
-                int index_1D_top = y * m_width + x;
-                int index_1D_bottom = (m_height - 1 - y) * m_width + x;
-                std::swap(m_data[index_1D_top], m_data[index_1D_bottom]);
-            }
-        }
-    }
+    // Returns every pixel DrawText(x, y, text, size, ...) can touch, empty if it draws nothing
+    Rect TextBounds(std::int32_t x, std::int32_t y, std::string_view text, std::int32_t size);
 
-    void Image::Invert()
+    // Drawing and whole-image operations shared by every pixel layout.
+    // Derived must provide Width(), Height(), Set(), RowPtr(y) and Bounds(), the rectangle drawing is clipped to.
+    // Whole-image operations and saving apply to the pixels inside Bounds().
+    template <typename Derived>
+    class ImageBase
     {
-        for (std::size_t i = 0; i < m_width * m_height; i++)
-        {
-            Color &pixel = m_data[i];
-            // Invert each color component
-            pixel.r = 255 - pixel.r;
-            pixel.g = 255 - pixel.g;
-            pixel.b = 255 - pixel.b;
-        }
-    }
+    public:
+        // Set the color of a specific pixel only if it's valid
+        void SetSafe(std::int32_t x, std::int32_t y, const Color &color);
+        // Sets the whole image to the specific color
+        void Clear(const Color &color);
+        void Clear(const Color &color, Executor &executor);
+        // The Draw functions below blend color into the image with mode, touching every pixel at most once.
+        // Opaque colors drawn with Over or Replace are stored directly.
+        // Draws a line from x1;y1 to x2;y2
+        void DrawLine(std::int32_t x1, std::int32_t y1, std::int32_t x2, std::int32_t y2, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        // Draws a line from x1;y1 to x2;y2 with a certain thickness, filled one row span at a time
+        void DrawLine(std::int32_t x1, std::int32_t y1, std::int32_t x2, std::int32_t y2, int thickness, ColorRGBA color, LineCap cap = LineCap::Square, BlendMode mode = BlendMode::Over);
+        // Draws a quadratic bezier curve
+        void DrawQuadraticBezierCurve(const Vector2 &start, const Vector2 &control, const Vector2 &end, float step_size, const ColorRGBA &color, BlendMode mode = BlendMode::Over);
+        void DrawQuadraticBezierCurve(const Vector2 &start, const Vector2 &control, const Vector2 &end, int num_points, const ColorRGBA &color, BlendMode mode = BlendMode::Over);
+        // Draws a quadratic bezier curve as connected line segments, as many as it takes to stay within a quarter pixel of the curve
+        void DrawQuadraticBezierCurve(const Vector2 &start, const Vector2 &control, const Vector2 &end, const ColorRGBA &color, BlendMode mode = BlendMode::Over);
+        // Draws a cubic bezier curve the same way
+        void DrawCubicBezierCurve(const Vector2 &start, const Vector2 &control1, const Vector2 &control2, const Vector2 &end, const ColorRGBA &color, BlendMode mode = BlendMode::Over);
+        // Draws a filled circle at x;y as its center
+        void DrawCircle(std::int32_t x, std::int32_t y, std::int32_t r, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        // Draws the circumference of a circle at x;y as its center
+        void DrawCircleLine(std::int32_t x, std::int32_t y, std::int32_t r, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        // The AA functions below draw anti-aliased shapes at subpixel positions, pixel x;y being centered on x;y.
+        // The color is blended by the part of every pixel the shape covers; with Replace it is drawn opaque.
+        // Draws a one pixel wide line from x1;y1 to x2;y2
+        void DrawLineAA(float x1, float y1, float x2, float y2, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        // Draws a filled circle at x;y as its center
+        void DrawCircleAA(float x, float y, float r, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        // Draws the one pixel wide circumference of a circle at x;y as its center
+        void DrawCircleLineAA(float x, float y, float r, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        // Draws a filled rectangle that contains the circle, with the circle not being drawn
+        void DrawCircleInverted(std::int32_t x, std::int32_t y, std::int32_t r, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        // Draws a filled rectangle with the top-left most point at x;y
+        void DrawRectangle(std::int32_t x, std::int32_t y, std::int32_t w, std::int32_t h, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        // Draws the perimeter of a rectangle witht the top-left most point at x;y
+        void DrawRectangleLine(std::int32_t x, std::int32_t y, std::int32_t w, std::int32_t h, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        // Draws a filled polygon through points, closed back to the first one. A pixel is filled when its center is inside
+        // by rule, so a polygon with the corners of a DrawRectangle fills the same pixels
+        void DrawPolygon(std::span<const Vector2> points, ColorRGBA color, FillRule rule = FillRule::NonZero, BlendMode mode = BlendMode::Over);
+        // Draws a filled triangle for every 3 vertices. Triangles sharing an edge don't share pixels, so a mesh blends every pixel once
+        void DrawTriangles(std::span<const Vector2> vertices, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        // Same as above for the triangles made by every 3 indices into vertices, skipping those with an index out of range
+        void DrawTriangles(std::span<const Vector2> vertices, std::span<const std::uint32_t> indices, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        // Draws text in the built-in 5x7 font with the top-left corner of its first line at x;y, every line size pixels high.
+        // Lines break at '\n' and bytes outside printable ASCII draw as '?'. Glyphs are scaled with anti-aliased edges into
+        // coverage masks built once per size and shared by every thread, so drawing only blends their rows
+        void DrawText(std::int32_t x, std::int32_t y, std::string_view text, std::int32_t size, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        // Blends the pixels inside source.Bounds() into the image with their top-left corner at x;y, scaled by opacity and
+        // by their own alpha for sources with alpha. The alpha of the image composites over. source may have any pixel
+        // layout but must not overlap the pixels it is blended into
+        template <typename Source>
+        void Composite(ImageBase<Source> &source, std::int32_t x, std::int32_t y, BlendMode mode = BlendMode::Over, std::uint8_t opacity = 255);
+        template <typename Source>
+        void Composite(ImageBase<Source> &&source, std::int32_t x, std::int32_t y, BlendMode mode = BlendMode::Over, std::uint8_t opacity = 255);
+        // Saves the image to file in the encoding of its pixels: 24-bit BGR, 32-bit BGRA for pixels with alpha and 8-bit gray
+        // for Gray pixels. NOTE: Include the .bmp extension
+        bool Save(const std::string &path);
+        bool Save(const std::string &path, Executor &executor);
+        // Encodes the image as a BMP file into buffer, resizing it to fit
+        bool SaveToBuffer(std::vector<std::uint8_t> &buffer);
+        bool SaveToBuffer(std::vector<std::uint8_t> &buffer, Executor &executor);
+        // Saves the image to file with encoding, returns false if the image has more colors than a palette encoding holds
+        bool Save(const std::string &path, Encoding encoding);
+        bool Save(const std::string &path, Encoding encoding, Executor &executor);
+        // Encodes the image as a BMP file with encoding into buffer, resizing it to fit
+        bool SaveToBuffer(std::vector<std::uint8_t> &buffer, Encoding encoding);
+        bool SaveToBuffer(std::vector<std::uint8_t> &buffer, Encoding encoding, Executor &executor);
+        // Encodes the image as a BMP file into out. Returns the number of bytes written, or 0 if out is too small
+        std::size_t SaveTo(std::span<std::uint8_t> out);
+        std::size_t SaveTo(std::span<std::uint8_t> out, Executor &executor);
+        // Same as above with the uncompressed encoding BGR24, BGRA32 or Gray8. Returns 0 for the other encodings
+        std::size_t SaveTo(std::span<std::uint8_t> out, Encoding encoding);
+        std::size_t SaveTo(std::span<std::uint8_t> out, Encoding encoding, Executor &executor);
+        // Returns the size in bytes of the BMP file Save writes
+        std::size_t EncodedSize() const;
+        // Returns the size in bytes of the BMP file SaveTo writes with encoding, 0 if it isn't uncompressed
+        std::size_t EncodedSize(Encoding encoding) const;
+        // Loads a 1, 4, 8, 24 or 32-bit BMP file, uncompressed or BI_RLE4/BI_RLE8, returns nothing if it can't be read. The fourth byte of
+        // 32-bit pixels is read as alpha by images with alpha
+        static std::optional<Derived> Load(const std::string &path);
+        // Decodes a BMP file Load can read held in memory, returns nothing if it is malformed
+        static std::optional<Derived> FromMemory(const std::uint8_t *data, std::size_t size);
+        // Same as FromMemory, decoding into this image and reusing its memory when it's large enough.
+        // Returns false and leaves the image unchanged if the data is malformed. Only images, not views or bands, can be resized
+        bool Decode(const std::uint8_t *data, std::size_t size);
+        // Replaces the image with itself moved by transform, in coordinates relative to the top-left of Bounds().
+        // Every pixel is sampled from a copy with filter, Box sampling as Nearest and Lanczos as Bilinear. Pixels mapped from
+        // outside the image become black. Returns false and leaves the image untouched if transform can't be inverted
+        bool Transform(const Affine &transform, Filter filter = Filter::Bilinear);
+        bool Transform(const Affine &transform, Filter filter, Executor &executor);
+        // Rotates the image clockwise around its center by an angle in degrees, the uncovered corners become black
+        void Rotate(float degrees, Filter filter = Filter::Bilinear);
+        void Rotate(float degrees, Filter filter, Executor &executor);
+        // Resizes the image to width x height, each pixel filtered from the source pixels around it. When shrinking, every filter
+        // but Nearest widens to cover all the source pixels under the destination pixel, so thumbnails don't alias.
+        // Pixels beyond the edges count as copies of the edge pixels. Only images, not views or bands, can be resized
+        void Resize(std::size_t width, std::size_t height, Filter filter = Filter::Bilinear);
+        void Resize(std::size_t width, std::size_t height, Filter filter, Executor &executor);
+        // Rotates the image 180 degrees
+        void Rotate180();
+        void Rotate180(Executor &executor);
+        // Flips the image horizontally
+        void FlipHorizontally();
+        void FlipHorizontally(Executor &executor);
+        // Flips the image vertically
+        void FlipVertically();
+        void FlipVertically(Executor &executor);
+        // Inverts the colors of the image
+        void Invert();
+        void Invert(Executor &executor);
+        // Fills the image with random colors. The pixels only depend on seed and their position relative to the top-left
+        // of Bounds(), not on the pixel layout, CPU or number of threads
+        void FillRandom(std::uint64_t seed);
+        void FillRandom(std::uint64_t seed, Executor &executor);
+        // Replaces every pixel with the average of the (2 * radius + 1)^2 square around it, at the same cost for any radius.
+        // Pixels beyond the edges count as copies of the edge pixels. The radius is capped at 32767
+        void BoxBlur(std::int32_t radius);
+        void BoxBlur(std::int32_t radius, Executor &executor);
+        // Blurs the image with a Gaussian of standard deviation sigma pixels, exactly up to sigma 5 and with three box blurs
+        // above, where the difference doesn't show. Pixels beyond the edges count as copies of the edge pixels. Sigmas
+        // above about 32766 blur as that one, and non-finite ones leave the image as it is
+        void GaussianBlur(float sigma);
+        void GaussianBlur(float sigma, Executor &executor);
+        // Filters the rows with horizontal, then the columns with vertical, each an odd number of weights centered on the pixel.
+        // An empty kernel leaves that direction as is. Weights are rounded to 14 fraction bits, keeping their sum, and pixels
+        // beyond the edges count as copies of the edge pixels. Returns false and leaves the image untouched if a kernel has
+        // an even number of weights, more than 255 or one outside (-2;2)
+        bool Convolve(std::span<const float> horizontal, std::span<const float> vertical);
+        bool Convolve(std::span<const float> horizontal, std::span<const float> vertical, Executor &executor);
+
+    protected:
+        // Draws paint over the pixels [x0;x1) of row y, clipped to the image
+        void FillSpan(std::int32_t y, std::int32_t x0, std::int32_t x1, const detail::Paint &paint);
+        // Draws paint over pixel x;y, which must be inside the image
+        void Plot(std::int32_t x, std::int32_t y, const detail::Paint &paint);
+        // Same as above, for any pixel
+        void PlotSafe(std::int32_t x, std::int32_t y, const detail::Paint &paint);
+        // Draws paint over the part coverage / 255 of pixel x;y, which must be inside the image
+        void PlotCoverage(std::int32_t x, std::int32_t y, const detail::Paint &paint, std::uint8_t coverage);
+        // Draws the pixels closer than outer to x;y, each covered by coverage(distance) from 0 to 1.
+        // The pixels closer than inner are left out, or filled as a whole when fill_inner is set
+        template <typename Coverage>
+        void DrawRadial(double x, double y, double inner, double outer, bool fill_inner, const detail::Paint &paint, Coverage &&coverage);
+        // Returns the half-width of the row dy away from the center of a filled circle, or -1 if the row is empty
+        static std::int32_t CircleHalfWidth(std::int32_t r, std::int32_t dy);
+        // Calls fn(x, y) in drawing order for the pixels of the line x1;y1 to x2;y2 inside clip, x2;y2 excluded
+        template <typename Fn>
+        static void TraceLine(std::int32_t x1, std::int32_t y1, std::int32_t x2, std::int32_t y2, const Rect &clip, Fn &&fn);
+        // Draws segments line segments from start through the points returned by next() to end, every pixel once
+        template <typename Next>
+        void DrawCurve(const Vector2 &start, const Vector2 &end, std::int64_t segments, Next &&next, const detail::Paint &paint);
+        // Fills the pixels whose centers are inside the triangle abc
+        void FillTriangle(const Vector2 &a, const Vector2 &b, const Vector2 &c, const Rect &bounds, const detail::Paint &paint);
+        // Prepares color for drawing with mode into the rows of the image
+        detail::Paint MakePaint(const ColorRGBA &color, BlendMode mode);
+        // Same as above for the AA functions, turning Replace into drawing the color opaque
+        detail::Paint MakeCoveragePaint(const ColorRGBA &color, BlendMode mode);
+
+    private:
+        // Returns the uncompressed encoding Save writes the pixels of Derived with
+        static constexpr Encoding NativeEncoding();
+        // Returns Bounds(), first applying the flips Derived deferred with lazy orientation
+        Rect Area();
+        // Same as above, marking the whole area as changed
+        Rect TouchArea();
+        // Decodes the rows of the BMP in data, laid out as layout, into an image of its size
+        void DecodeRows(const detail::BmpLayout &layout, const std::uint8_t *data);
+        // Saves the image to file with the uncompressed encoding, encoding straight into the file where it can be mapped
+        bool SaveUncompressed(const std::string &path, Encoding encoding, Executor &executor);
+        // Collects the colors inside Bounds() into palette, sorted, one band of rows per thread.
+        // Returns false if there are more than 256
+        bool ScanPalette(detail::Palette &palette, Executor &executor);
+        // Encodes the pixels into buffer as palette indices with bits_per_pixel, RLE compressing them with compression 1 or 2
+        void EncodeIndexed(std::vector<std::uint8_t> &buffer, const detail::Palette &palette, std::uint16_t bits_per_pixel, std::uint32_t compression, Executor &executor);
+        // Filters the pixels inside Bounds() in two passes through a BGRX copy. horizontal(line, out, width) filters one row
+        // into out, line holding pad copies of the edge pixel on either side of it. vertical(copy, stride, height, y0, y1, emit)
+        // then filters the columns of the copy for rows [y0;y1), calling emit(y, x, n, pixels) to store n BGRX pixels at x;y
+        template <typename Horizontal, typename Vertical>
+        void FilterSeparable(std::int32_t pad, Horizontal &&horizontal, Vertical &&vertical, Executor &executor);
+
+        Derived &self() { return static_cast<Derived &>(*this); }
+        const Derived &self() const { return static_cast<const Derived &>(*this); }
+    };
 
-    void Image::DEBUGRotate(float angle)
+    template <typename PixelT>
+    class BasicImageView;
+    class ImagePlanarView;
+
+    // Image storing its pixels interleaved, one PixelT per pixel
+    template <typename PixelT>
+    class BasicImage : public ImageBase<BasicImage<PixelT>>
     {
-        const float center_x = static_cast<float>(m_width) / 2.0f;
-        const float center_y = static_cast<float>(m_height) / 2.0f;
+    public:
+        // 64-byte aligned pixel memory, rows following each other without padding. Buffer(n) and resize(n) leave new pixels
+        // uninitialized, like the Uninitialized constructors; resize(n, PixelT()) clears them
+        using Buffer = std::vector<PixelT, AlignedAllocator<PixelT>>;
 
-        for (int y = 0; y < m_height; ++y)
-        {
-            for (int x = 0; x < m_width; ++x)
-            {
-                // Translate the coordinates so that the center of the image is the origin
-                float translated_x = static_cast<float>(x) - center_x;
-                float translated_y = static_cast<float>(y) - center_y;
+        // Initialize an image with a width and height in pixels. Pixel memory comes from resource when one is given
+        BasicImage(std::size_t width, std::size_t height, std::pmr::memory_resource *resource = nullptr);
+        // Same as above, leaving the pixels uninitialized
+        BasicImage(std::size_t width, std::size_t height, UninitializedTag, std::pmr::memory_resource *resource = nullptr);
+        // Takes over pixels as a width x height image without copying them, resizing pixels to width * height if it holds a
+        // different number, missing pixels black. Memory owned elsewhere can be adopted through a buffer whose allocator has a memory resource
+        BasicImage(Buffer &&pixels, std::size_t width, std::size_t height);
+        // Moves the pixels out, with the flips recorded by lazy orientation applied, leaving a 0 x 0 image
+        Buffer Release();
+        // Changes the size of the image to width x height and clears it to black, reusing the memory when it's large enough
+        void Reset(std::size_t width, std::size_t height);
+        // Same as above, leaving the pixels uninitialized
+        void Reset(std::size_t width, std::size_t height, UninitializedTag);
+        // Reserves memory for a width x height image, so later calls to Reset up to that size don't allocate
+        void Reserve(std::size_t width, std::size_t height);
+        // Set the color of a specific pixel
+        void Set(std::int32_t x, std::int32_t y, const Color &color);
+        // Returns the pixel at x;y, which must be inside the image, as it will be saved
+        PixelT Get(std::int32_t x, std::int32_t y) const;
+        // Returns the pixels of row y, applying the flips recorded by lazy orientation and marking the row as changed.
+        // Valid until the image is reset or destroyed
+        std::span<PixelT> Row(std::int32_t y);
+        // Same as above without marking the row as changed, for hashing, diffing or uploading. Recorded flips are still applied
+        // first, so the pixels are the ones Save writes. While flips are recorded this writes the pixels, so it must not
+        // race with other readers of the image
+        std::span<const PixelT> Row(std::int32_t y) const;
+        // Returns the first pixel of the top row, rows being Stride() pixels apart. Applies recorded flips and marks the whole
+        // image as changed
+        PixelT *Data();
+        // Same as above without marking the image as changed, applying recorded flips as the const Row does
+        const PixelT *Data() const;
+        // Returns the distance between rows in pixels, the width of the image
+        std::size_t Stride() const noexcept;
+        // Returns image width in pixels
+        std::int32_t Width() const noexcept;
+        // Returns image height in pixels
+        std::int32_t Height() const noexcept;
+        // Returns the area drawn to, the whole image
+        Rect Bounds() const noexcept;
+        // Returns a view of the whole image, valid until the image is reset or destroyed
+        BasicImageView<PixelT> View();
+        // Returns a view of the part of area inside the image
+        BasicImageView<PixelT> View(const Rect &area);
+        // Swaps rows and columns, so pixel x;y moves to y;x and a width x height image becomes height x width.
+        // Square images are transposed in place, others into a new buffer
+        void Transpose();
+        void Transpose(Executor &executor);
+        // Rotates the image 90 degrees clockwise, a width x height image becomes height x width
+        void Rotate90();
+        void Rotate90(Executor &executor);
+        // Rotates the image 90 degrees counter-clockwise, a width x height image becomes height x width
+        void Rotate270();
+        void Rotate270(Executor &executor);
+        // With lazy orientation on, FlipHorizontally, FlipVertically and Rotate180 only record the flip: saving writes the
+        // pixels in flipped order and any other operation applies the recorded flips first. Turning it off applies them too.
+        // Views made before a recorded flip see the pixels as stored until it is applied
+        void SetLazyOrientation(bool lazy);
+        // Returns the flips recorded by lazy orientation and not applied yet
+        Orientation PendingOrientation() const noexcept;
+        // Applies the flips recorded by lazy orientation to the pixels
+        void ApplyOrientation();
+        void ApplyOrientation(Executor &executor);
+        // Same as the ImageBase versions, unless lazy orientation is on
+        void Rotate180();
+        void Rotate180(Executor &executor);
+        void FlipHorizontally();
+        void FlipHorizontally(Executor &executor);
+        void FlipVertically();
+        void FlipVertically(Executor &executor);
+        // With dirty tracking on, every function changing pixels marks the 64x64 tiles it touches, views marking their whole
+        // area when they are made. Turning it on starts with every tile clean, taking the image to match its last save
+        void SetDirtyTracking(bool tracking);
+        // Returns whether any tile changed since tracking was turned on or the last ClearDirty
+        bool IsDirty() const noexcept;
+        // Returns the smallest rectangle holding every changed tile, clipped to the image
+        Rect DirtyBounds() const noexcept;
+        // Marks the tiles overlapping area as changed
+        void MarkDirty(const Rect &area) noexcept;
+        // Marks every tile as clean
+        void ClearDirty() noexcept;
+        // Rewrites the changed tiles in an uncompressed BMP of the same size and encoding, such as one Save wrote earlier, and clears them.
+        // Without dirty tracking every pixel is rewritten. Returns false and keeps the changed tiles if the file doesn't match the image
+        bool SaveDirty(const std::string &path);
+        bool SaveDirty(std::span<std::uint8_t> out);
 
-                // Rotate the coordinates around the origin
-                float rotated_x = translated_x * cos(angle) - translated_y * sin(angle);
-                float rotated_y = translated_x * sin(angle) + translated_y * cos(angle);
+    private:
+        template <typename>
+        friend class ImageBase;
+        template <typename>
+        friend class detail::ClipTarget;
 
-                // Translate the coordinates back to the original coordinate system
-                rotated_x += center_x;
-                rotated_y += center_y;
+        // Returns a pointer to the first pixel of row y
+        PixelT *RowPtr(std::int32_t y);
+        // Applies the recorded flips to the stored pixels from const accessors, serially and without marking tiles, which
+        // recording the flips marked already
+        void ApplyOrientationRows() const;
+        // Resizes the tiles to the image size after it changed and marks all of them
+        void ResetDirty();
+        // Checks that layout matches the image, then calls emit(offset, pixels, n) for every run of
+        // changed pixels in a row, offset being where the run starts in the file
+        template <typename Emit>
+        bool WriteDirty(const detail::BmpLayout &layout, Emit &&emit);
 
-                // Interpolate the color using the rotated coordinates (you may implement this)
-                Color interpolatedColor = DEBUGInterpolateColor(rotated_x, rotated_y);
+        // Mutable so the const accessors can apply recorded flips, which change where pixels are stored but not the image
+        mutable Buffer m_data;
+        std::int32_t m_width = 0, m_height = 0;
+        mutable Orientation m_pending;
+        bool m_lazy = false;
+        // One byte per tile, set when the tile changed
+        std::vector<std::uint8_t> m_dirty;
+        bool m_tracking = false;
+    };
 
-                // Set the color for the current pixel
-                SetSafe(x, y, interpolatedColor);
-            }
-        }
-    }
+    // Packed 3-byte RGB image
+    using Image = BasicImage<Color>;
+    // 4-byte aligned RGBX image, friendlier to vector loads
+    using ImageRGBX = BasicImage<ColorX>;
+    // RGBA image keeping the alpha drawing leaves, saved as 32-bit BGRA
+    using ImageRGBA = BasicImage<ColorRGBA>;
+    // 8-bit grayscale image, saved as 8-bit BMPs with a gray color table
+    using ImageGray = BasicImage<Gray>;
 
-    Color Image::DEBUGInterpolateColor(float x, float y)
+    // Image storing each channel in its own plane (structure of arrays).
+    // Every row of every plane starts on a 64-byte boundary.
+    class ImagePlanar : public ImageBase<ImagePlanar>
     {
-        // Calculate the integer coordinates of the surrounding pixels
-        int x1 = static_cast<int>(floor(x));
-        int x2 = x1 + 1;
-        int y1 = static_cast<int>(floor(y));
-        int y2 = y1 + 1;
+    public:
+        // Initialize an image with a width and height in pixels. Pixel memory comes from resource when one is given
+        ImagePlanar(std::size_t width, std::size_t height, std::pmr::memory_resource *resource = nullptr);
+        // Same as above, leaving the pixels uninitialized
+        ImagePlanar(std::size_t width, std::size_t height, UninitializedTag, std::pmr::memory_resource *resource = nullptr);
+        // Changes the size of the image to width x height and clears it to black, reusing the memory when it's large enough
+        void Reset(std::size_t width, std::size_t height);
+        // Same as above, leaving the pixels uninitialized
+        void Reset(std::size_t width, std::size_t height, UninitializedTag);
+        // Reserves memory for a width x height image, so later calls to Reset up to that size don't allocate
+        void Reserve(std::size_t width, std::size_t height);
+        // Set the color of a specific pixel
+        void Set(std::int32_t x, std::int32_t y, const Color &color);
+        // Returns the color of the pixel at x;y, which must be inside the image
+        Color Get(std::int32_t x, std::int32_t y) const;
+        // Returns image width in pixels
+        std::int32_t Width() const noexcept;
+        // Returns image height in pixels
+        std::int32_t Height() const noexcept;
+        // Returns the area drawn to, the whole image
+        Rect Bounds() const noexcept;
+        // Returns a view of the whole image, valid until the image is reset or destroyed
+        ImagePlanarView View();
+        // Returns a view of the part of area inside the image
+        ImagePlanarView View(const Rect &area);
+        // Swaps rows and columns, so pixel x;y moves to y;x and a width x height image becomes height x width.
+        // Square images are transposed in place, others into a new buffer
+        void Transpose();
+        void Transpose(Executor &executor);
+        // Rotates the image 90 degrees clockwise, a width x height image becomes height x width
+        void Rotate90();
+        void Rotate90(Executor &executor);
+        // Rotates the image 90 degrees counter-clockwise, a width x height image becomes height x width
+        void Rotate270();
+        void Rotate270(Executor &executor);
 
-        if (x1 < 0 || x2 >= m_width || y1 < 0 || y2 >= m_height)
-        {
-            // Handle out-of-bounds condition (e.g., return a default color)
-            return Color(0, 0, 0);
-        }
+    private:
+        template <typename>
+        friend class ImageBase;
+        template <typename>
+        friend class detail::ClipTarget;
+
+        // Returns the channel pointers of row y
+        PlanarRow RowPtr(std::int32_t y);
 
-        // Get the colors of the surrounding pixels
-        // x * row_len + y
-        const Color &topLeft = m_data.at(x1 * m_width + y1);     // img.GetPixel(x1, y1);
-        const Color &topRight = m_data.at(x2 * m_width + y1);    // img.GetPixel(x2, y1);
-        const Color &bottomLeft = m_data.at(x1 * m_width + y2);  // img.GetPixel(x1, y2);
-        const Color &bottomRight = m_data.at(x2 * m_width + y2); // img.GetPixel(x2, y2);
+        std::vector<std::uint8_t, AlignedAllocator<std::uint8_t>> m_r, m_g, m_b;
+        std::size_t m_stride = 0;
+        std::int32_t m_width = 0, m_height = 0;
+    };
 
-        // Calculate the weights for the interpolation
-        float weightTopLeft = (x2 - x) * (y2 - y);
-        float weightTopRight = (x - x1) * (y2 - y);
-        float weightBottomLeft = (x2 - x) * (y - y1);
-        float weightBottomRight = (x - x1) * (y - y1);
+    // Non-owning view of width x height pixels whose rows are stride pixels apart.
+    // Views of disjoint areas can be drawn to from different threads.
+    template <typename PixelT>
+    class BasicImageView : public ImageBase<BasicImageView<PixelT>>
+    {
+    public:
+        // View width x height pixels starting at data
+        BasicImageView(PixelT *data, std::size_t width, std::size_t height, std::size_t stride);
+        // Set the color of a specific pixel
+        void Set(std::int32_t x, std::int32_t y, const Color &color);
+        // Returns the pixel at x;y, which must be inside the view
+        PixelT Get(std::int32_t x, std::int32_t y) const;
+        // Returns the pixels of row y of the view
+        std::span<PixelT> Row(std::int32_t y) const;
+        // Returns the first pixel of the top row, rows being Stride() pixels apart
+        PixelT *Data() const noexcept;
+        // Returns view width in pixels
+        std::int32_t Width() const noexcept;
+        // Returns view height in pixels
+        std::int32_t Height() const noexcept;
+        // Returns the distance between rows in pixels
+        std::size_t Stride() const noexcept;
+        // Returns the area drawn to, the whole view
+        Rect Bounds() const noexcept;
+        // Returns a view of the part of area inside this view
+        BasicImageView View(const Rect &area) const;
 
-        // Interpolate the color components
-        uint8_t r = static_cast<uint8_t>(topLeft.r * weightTopLeft + topRight.r * weightTopRight +
-                                         bottomLeft.r * weightBottomLeft + bottomRight.r * weightBottomRight);
-        uint8_t g = static_cast<uint8_t>(topLeft.g * weightTopLeft + topRight.g * weightTopRight +
-                                         bottomLeft.g * weightBottomLeft + bottomRight.g * weightBottomRight);
-        uint8_t b = static_cast<uint8_t>(topLeft.b * weightTopLeft + topRight.b * weightTopRight +
-                                         bottomLeft.b * weightBottomLeft + bottomRight.b * weightBottomRight);
+    private:
+        template <typename>
+        friend class ImageBase;
+        template <typename>
+        friend class detail::ClipTarget;
 
-        return Color(r, g, b);
-    }
-}
\ No newline at end of file
+        // Returns a pointer to the first pixel of row y
+        PixelT *RowPtr(std::int32_t y) const;
+
+        PixelT *m_data = nullptr;
+        std::size_t m_stride = 0;
+        std::int32_t m_width = 0, m_height = 0;
+    };
+
+    // View of an Image
+    using ImageView = BasicImageView<Color>;
+    // View of an ImageRGBX
+    using ImageViewRGBX = BasicImageView<ColorX>;
+    // View of an ImageRGBA
+    using ImageViewRGBA = BasicImageView<ColorRGBA>;
+    // View of an ImageGray
+    using ImageViewGray = BasicImageView<Gray>;
+
+    // Non-owning view of part of a planar image, every plane's rows stride bytes apart
+    class ImagePlanarView : public ImageBase<ImagePlanarView>
+    {
+    public:
+        // View width x height pixels starting at the channel pointers of origin
+        ImagePlanarView(PlanarRow origin, std::size_t width, std::size_t height, std::size_t stride);
+        // Set the color of a specific pixel
+        void Set(std::int32_t x, std::int32_t y, const Color &color);
+        // Returns the color of the pixel at x;y, which must be inside the view
+        Color Get(std::int32_t x, std::int32_t y) const;
+        // Returns view width in pixels
+        std::int32_t Width() const noexcept;
+        // Returns view height in pixels
+        std::int32_t Height() const noexcept;
+        // Returns the distance between rows in bytes
+        std::size_t Stride() const noexcept;
+        // Returns the area drawn to, the whole view
+        Rect Bounds() const noexcept;
+        // Returns a view of the part of area inside this view
+        ImagePlanarView View(const Rect &area) const;
+
+    private:
+        template <typename>
+        friend class ImageBase;
+        template <typename>
+        friend class detail::ClipTarget;
+
+        // Returns the channel pointers of row y
+        PlanarRow RowPtr(std::int32_t y) const;
+
+        PlanarRow m_origin;
+        std::size_t m_stride = 0;
+        std::int32_t m_width = 0, m_height = 0;
+    };
+
+    // Holds rows [Top();Top() + rows) of a larger width x height image, for rendering it strip by strip.
+    // Drawing uses the coordinates of the whole image and is clipped to the band;
+    // whole-image operations and saving only apply to the band's rows.
+    template <typename PixelT>
+    class BasicImageBand : public ImageBase<BasicImageBand<PixelT>>
+    {
+    public:
+        // Initialize a band of rows rows of a width x height image, starting at the top row
+        BasicImageBand(std::size_t width, std::size_t height, std::size_t rows, std::pmr::memory_resource *resource = nullptr);
+        // Moves the band to start at row top, keeping its pixels
+        void MoveTo(std::int32_t top);
+        // Set the color of a specific pixel, which must be inside the band
+        void Set(std::int32_t x, std::int32_t y, const Color &color);
+        // Returns the width of the whole image in pixels
+        std::int32_t Width() const noexcept;
+        // Returns the height of the whole image in pixels
+        std::int32_t Height() const noexcept;
+        // Returns the first row of the band
+        std::int32_t Top() const noexcept;
+        // Returns the area drawn to, the band's rows inside the image
+        Rect Bounds() const noexcept;
+
+    private:
+        template <typename>
+        friend class ImageBase;
+        template <typename>
+        friend class detail::ClipTarget;
+
+        // Returns a pointer to the first pixel of row y
+        PixelT *RowPtr(std::int32_t y);
+
+        std::vector<PixelT, AlignedAllocator<PixelT>> m_data;
+        std::int32_t m_width = 0, m_height = 0, m_rows = 0, m_top = 0;
+    };
+
+    // Band of an Image
+    using ImageBand = BasicImageBand<Color>;
+
+    // Writes a 24-bit BMP file piece by piece, whatever the pixels of the images written to it, so the whole image never has to be in memory.
+    // Rows can be written in any order; rows never written are left black. Files of 4 GiB or more, such as 100000 x 100000
+    // images, are written whole but their header can't hold their size, so it stores 0 and readers go by width and height.
+    class StreamWriter
+    {
+    public:
+        // Creates the file at path and writes the header of a width x height image
+        StreamWriter(const std::string &path, std::size_t width, std::size_t height);
+        // Closes the file
+        ~StreamWriter();
+        StreamWriter(const StreamWriter &) = delete;
+        StreamWriter &operator=(const StreamWriter &) = delete;
+
+        // Returns true if the file was created and every write so far succeeded
+        bool IsOpen() const noexcept;
+        // Writes the rows inside image.Bounds() to the same rows of the file
+        template <typename Derived>
+        bool Write(ImageBase<Derived> &image);
+        template <typename Derived>
+        bool Write(ImageBase<Derived> &image, Executor &executor);
+        // Writes the rows inside image.Bounds() to the rows of the file starting at y
+        template <typename Derived>
+        bool Write(ImageBase<Derived> &image, std::int32_t y);
+        template <typename Derived>
+        bool Write(ImageBase<Derived> &image, std::int32_t y, Executor &executor);
+        // Flushes and closes the file, returns true if every write succeeded
+        bool Close();
+
+    private:
+        // Writes size bytes at offset bytes into the file
+        bool WriteAt(std::size_t offset, const std::uint8_t *data, std::size_t size);
+
+#if defined(BMPR_POSIX)
+        int m_fd = -1;
+#else
+        std::ofstream m_file;
+#endif
+        bool m_ok = false;
+        std::int32_t m_width = 0, m_height = 0;
+        // Encoded rows of the last write, reused between writes
+        std::vector<std::uint8_t> m_buffer;
+    };
+
+    namespace detail
+    {
+        // Forwards drawing to another image while clipping it to a smaller rectangle
+        template <typename Target>
+        class ClipTarget : public ImageBase<ClipTarget<Target>>
+        {
+        public:
+            ClipTarget(Target &target, const Rect &clip) : m_target{target}, m_clip{clip.Intersect(target.Bounds())} {}
+
+            void Set(std::int32_t x, std::int32_t y, const Color &color) { m_target.Set(x, y, color); }
+            std::int32_t Width() const noexcept { return m_target.Width(); }
+            std::int32_t Height() const noexcept { return m_target.Height(); }
+
+        private:
+            template <typename>
+            friend class bmpr::ImageBase;
+
+            auto RowPtr(std::int32_t y) { return m_target.RowPtr(y); }
+            Rect Bounds() const noexcept { return m_clip; }
+
+            Target &m_target;
+            Rect m_clip;
+        };
+    }
+
+    // One recorded draw call, a small POD so command lists stay compact
+    struct DrawCommand
+    {
+        enum class Type : std::uint8_t
+        {
+            Pixel,
+            Line,
+            ThickLine,
+            BezierPoints,
+            BezierStep,
+            Bezier,
+            CubicBezier,
+            Circle,
+            CircleLine,
+            LineAA,
+            CircleAA,
+            CircleLineAA,
+            CircleInverted,
+            Rectangle,
+            RectangleLine,
+            Polygon,
+            Triangle,
+            Text
+        };
+
+        Type type;
+        BlendMode mode;
+        ColorRGBA color;
+        std::int32_t args[8];
+        float step;
+        // Every pixel the command can touch
+        Rect bounds;
+    };
+
+    // Records draw calls and rasterizes them later in one go.
+    // Submitting with an executor bins the commands into screen tiles and draws the tiles in parallel,
+    // every tile replaying its commands in recording order, so the result matches drawing immediately.
+    class CommandBuffer
+    {
+    public:
+        // Same as the ImageBase functions of the same name, recorded instead of drawn
+        void SetSafe(std::int32_t x, std::int32_t y, const Color &color);
+        void DrawLine(std::int32_t x1, std::int32_t y1, std::int32_t x2, std::int32_t y2, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        void DrawLine(std::int32_t x1, std::int32_t y1, std::int32_t x2, std::int32_t y2, int thickness, ColorRGBA color, LineCap cap = LineCap::Square, BlendMode mode = BlendMode::Over);
+        void DrawQuadraticBezierCurve(const Vector2 &start, const Vector2 &control, const Vector2 &end, float step_size, const ColorRGBA &color, BlendMode mode = BlendMode::Over);
+        void DrawQuadraticBezierCurve(const Vector2 &start, const Vector2 &control, const Vector2 &end, int num_points, const ColorRGBA &color, BlendMode mode = BlendMode::Over);
+        void DrawQuadraticBezierCurve(const Vector2 &start, const Vector2 &control, const Vector2 &end, const ColorRGBA &color, BlendMode mode = BlendMode::Over);
+        void DrawCubicBezierCurve(const Vector2 &start, const Vector2 &control1, const Vector2 &control2, const Vector2 &end, const ColorRGBA &color, BlendMode mode = BlendMode::Over);
+        void DrawCircle(std::int32_t x, std::int32_t y, std::int32_t r, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        void DrawCircleLine(std::int32_t x, std::int32_t y, std::int32_t r, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        void DrawLineAA(float x1, float y1, float x2, float y2, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        void DrawCircleAA(float x, float y, float r, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        void DrawCircleLineAA(float x, float y, float r, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        void DrawCircleInverted(std::int32_t x, std::int32_t y, std::int32_t r, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        void DrawRectangle(std::int32_t x, std::int32_t y, std::int32_t w, std::int32_t h, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        void DrawRectangleLine(std::int32_t x, std::int32_t y, std::int32_t w, std::int32_t h, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        void DrawPolygon(std::span<const Vector2> points, ColorRGBA color, FillRule rule = FillRule::NonZero, BlendMode mode = BlendMode::Over);
+        // Triangles are recorded one command each, so a parallel submit only draws them in the tiles they overlap
+        void DrawTriangles(std::span<const Vector2> vertices, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        void DrawTriangles(std::span<const Vector2> vertices, std::span<const std::uint32_t> indices, ColorRGBA color, BlendMode mode = BlendMode::Over);
+        void DrawText(std::int32_t x, std::int32_t y, std::string_view text, std::int32_t size, ColorRGBA color, BlendMode mode = BlendMode::Over);
+
+        // Removes every recorded command, keeping the memory
+        void Reset() noexcept;
+        // Reserves memory for count commands
+        void Reserve(std::size_t count);
+        // Returns the number of recorded commands
+        std::size_t Size() const noexcept;
+        // Sets the width and height in pixels of the tiles used by a parallel submit
+        void SetTileSize(std::int32_t tile_size) noexcept;
+
+        // Draws every command onto image in recording order
+        template <typename Derived>
+        void Submit(ImageBase<Derived> &image) const;
+        // Draws every command onto image, one tile per band
+        template <typename Derived>
+        void Submit(ImageBase<Derived> &image, Executor &executor);
+
+    private:
+        void Record(DrawCommand::Type type, const ColorRGBA &color, BlendMode mode, const Rect &bounds, std::initializer_list<std::int32_t> args, float step = 0.0f);
+        template <typename Derived>
+        void Replay(const DrawCommand &command, ImageBase<Derived> &target) const;
+
+        std::vector<DrawCommand> m_commands;
+        // Corners of the recorded polygons, which commands refer to by offset and count
+        std::vector<Vector2> m_points;
+        // Characters of the recorded text, referred to the same way
+        std::string m_text;
+        std::int32_t m_tile_size = 64;
+        // Command indices grouped by tile, reused between submits
+        std::vector<std::uint32_t> m_tile_offsets, m_tile_commands;
+    };
+
+    // Converts many BMPs the same way: every input is decoded, run through the operations in the order they were added
+    // and encoded again. Each thread of the executor takes the next input as soon as it's done with one, converting it in
+    // an image and buffer of its own that are kept between inputs and runs, so once they are large enough saving 24-bit BMPs
+    // allocates nothing
+    class Batch
+    {
+    public:
+        // Operation added with Then, called with the image and the user pointer
+        using Step = void (*)(Image &image, void *user);
+
+        // Converts on executor's threads. The executor can be shared with other work and must outlive the batch
+        explicit Batch(Executor &executor);
+
+        // Add the operation of the same name
+        Batch &FlipHorizontally();
+        Batch &FlipVertically();
+        Batch &Rotate90();
+        Batch &Rotate180();
+        Batch &Rotate270();
+        Batch &Transpose();
+        Batch &Invert();
+        // Adds a call to step(image, user). Threads call it at the same time, each with its own image
+        Batch &Then(Step step, void *user = nullptr);
+        // Sets the encoding images are saved with, Encoding::BGR24 by default
+        Batch &SetEncoding(Encoding encoding) noexcept;
+        // Removes every operation
+        void Clear() noexcept;
+
+        // Converts the file at inputs[i] and saves it to outputs[i], for every index in both. While a thread converts
+        // one file, the next one it takes is read in the background. Returns the number of files converted
+        std::size_t Run(std::span<const std::string> inputs, std::span<const std::string> outputs);
+        // Same as above, from BMPs in memory into buffers, reusing their memory. The buffers of failed inputs are emptied
+        std::size_t Run(std::span<const std::span<const std::uint8_t>> inputs, std::span<std::vector<std::uint8_t>> outputs);
+        // Returns the indices of the inputs the last Run couldn't decode or save, in increasing order
+        std::span<const std::size_t> Failed() const noexcept;
+
+    private:
+        // Image and encoding buffer of one thread, reused for every input it converts
+        struct Worker
+        {
+            Image image{0, 0};
+            std::vector<std::uint8_t> buffer;
+        };
+
+        // Calls convert(worker, claim, done) once on every thread of the executor. claim() returns the index of the next input,
+        // past the last one once there are none left, and done(i, ok) records whether input i was converted. Returns how many were
+        template <typename Convert>
+        std::size_t Process(Convert &&convert);
+        // Decodes data into the image of worker and applies every operation to it
+        bool Apply(Worker &worker, const std::uint8_t *data, std::size_t size) const;
+
+        Executor &m_executor;
+        std::vector<std::pair<Step, void *>> m_steps;
+        Encoding m_encoding = Encoding::BGR24;
+        std::vector<Worker> m_workers;
+        std::vector<std::size_t> m_failed;
+        std::mutex m_failed_mutex;
+    };
+}
+
+// Streaming byte kernels. The best implementation for the running CPU is picked on first use;
+// define BMPR_NO_SIMD to always use the scalar versions.
+namespace bmpr::kernels
+{
+    // Instruction sets a kernel table can be built for
+    enum class Isa
+    {
+        Scalar,
+        SSE2,
+        SSSE3,
+        AVX2,
+        NEON
+    };
+
+    struct KernelTable
+    {
+        Isa isa = Isa::Scalar;
+        // Inverts every byte of data
+        void (*invert)(std::uint8_t *data, std::size_t n);
+        // Repeats the 3-byte pixel rgb n times
+        void (*fill3)(std::uint8_t *dst, std::size_t n, const std::uint8_t *rgb);
+        // Repeats the 4-byte pixel pattern n times
+        void (*fill4)(std::uint8_t *dst, std::size_t n, std::uint32_t pattern);
+        // Swaps the first and last byte of n 3-byte pixels (RGB <-> BGR). src and dst may be the same
+        void (*swizzle3)(const std::uint8_t *src, std::uint8_t *dst, std::size_t n);
+        // Packs n 4-byte pixels into 3-byte pixels, swapping the first and third byte (RGBX -> BGR, BGRX -> RGB)
+        void (*swizzle4to3)(const std::uint8_t *src, std::uint8_t *dst, std::size_t n);
+        // Expands n 3-byte pixels into 4-byte pixels, swapping the first and third byte and zeroing the fourth (BGR -> RGBX)
+        void (*swizzle3to4)(const std::uint8_t *src, std::uint8_t *dst, std::size_t n);
+        // Reverses the order of n 3-byte pixels in place
+        void (*reverse3)(std::uint8_t *data, std::size_t n);
+        // Reverses the order of n 4-byte pixels in place
+        void (*reverse4)(std::uint8_t *data, std::size_t n);
+        // Reverses the order of n bytes in place
+        void (*reverse1)(std::uint8_t *data, std::size_t n);
+        // Exchanges n bytes between a and b
+        void (*swap)(std::uint8_t *a, std::uint8_t *b, std::size_t n);
+        // Writes n 4-byte pixels, each blended from the 2x2 block at the 16.16 fixed point position u;v of src, then steps u;v by du;dv.
+        // src has stride bytes per row and every block must lie inside it. All versions round the same way
+        void (*bilinear4)(const std::uint8_t *src, std::size_t stride, std::int64_t u, std::int64_t v, std::int64_t du, std::int64_t dv, std::size_t n, std::uint8_t *dst);
+        // Blends n bytes of src, premultiplied by alpha, into dst with mode. Replace copies src. All versions round the same way
+        void (*blend)(std::uint8_t *dst, const std::uint8_t *src, std::size_t n, std::uint8_t alpha, BlendMode mode);
+        // Fills n bytes with the random stream of key starting at word counter: bytes 4i to 4i+3 are RandomWord(key, counter + i),
+        // little-endian, the last word cut off at n. All versions write the same bytes
+        void (*random)(std::uint8_t *dst, std::size_t n, std::uint64_t key, std::uint32_t counter);
+        // Writes n bytes, byte i being the sum of rows[k][i] * weights[k] over the taps rows, weights in 2.14 fixed point,
+        // rounded and clamped to 0..255. All versions round the same way
+        void (*convolve)(std::uint8_t *dst, const std::uint8_t *const *rows, const std::int16_t *weights, std::size_t taps, std::size_t n);
+        // Slides n running sums of box windows down one row: adds enter[i] to sums[i], writes the rounded average
+        // (sums[i] * scale) >> 24 to dst[i] and subtracts leave[i]
+        void (*box_columns)(std::uint32_t *sums, const std::uint8_t *enter, const std::uint8_t *leave, std::uint32_t scale, std::uint8_t *dst, std::size_t n);
+        // Averages every 4-byte pixel of a row of width with the radius pixels on either side, line holding radius extra
+        // pixels on either side of the row, rounding as box_columns
+        void (*box_row)(const std::uint8_t *line, std::uint8_t *dst, std::size_t width, std::size_t radius, std::uint32_t scale);
+        // Writes n 4-byte pixels to dst, pixel i the sum of the taps pixels of src from starts[i] times weights[i * taps]
+        // onwards, rounded and clamped as convolve
+        void (*resample)(std::uint8_t *dst, const std::uint8_t *src, const std::int32_t *starts, const std::int16_t *weights, std::size_t taps, std::size_t n);
+    };
+
+    // Returns the kernels selected for this CPU
+    const KernelTable &Active();
+
+    inline void Invert(std::uint8_t *data, std::size_t n) { Active().invert(data, n); }
+    inline void Fill3(std::uint8_t *dst, std::size_t n, const std::uint8_t *rgb) { Active().fill3(dst, n, rgb); }
+    inline void Fill4(std::uint8_t *dst, std::size_t n, std::uint32_t pattern) { Active().fill4(dst, n, pattern); }
+    inline void Swizzle3(const std::uint8_t *src, std::uint8_t *dst, std::size_t n) { Active().swizzle3(src, dst, n); }
+    inline void Swizzle4To3(const std::uint8_t *src, std::uint8_t *dst, std::size_t n) { Active().swizzle4to3(src, dst, n); }
+    inline void Swizzle3To4(const std::uint8_t *src, std::uint8_t *dst, std::size_t n) { Active().swizzle3to4(src, dst, n); }
+    inline void Reverse3(std::uint8_t *data, std::size_t n) { Active().reverse3(data, n); }
+    inline void Reverse4(std::uint8_t *data, std::size_t n) { Active().reverse4(data, n); }
+    inline void Reverse1(std::uint8_t *data, std::size_t n) { Active().reverse1(data, n); }
+    inline void Swap(std::uint8_t *a, std::uint8_t *b, std::size_t n) { Active().swap(a, b, n); }
+    inline void Bilinear4(const std::uint8_t *src, std::size_t stride, std::int64_t u, std::int64_t v, std::int64_t du, std::int64_t dv, std::size_t n, std::uint8_t *dst)
+    {
+        Active().bilinear4(src, stride, u, v, du, dv, n, dst);
+    }
+    inline void Blend(std::uint8_t *dst, const std::uint8_t *src, std::size_t n, std::uint8_t alpha, BlendMode mode) { Active().blend(dst, src, n, alpha, mode); }
+    inline void Random(std::uint8_t *dst, std::size_t n, std::uint64_t key, std::uint32_t counter) { Active().random(dst, n, key, counter); }
+    inline void Convolve(std::uint8_t *dst, const std::uint8_t *const *rows, const std::int16_t *weights, std::size_t taps, std::size_t n)
+    {
+        Active().convolve(dst, rows, weights, taps, n);
+    }
+    inline void BoxColumns(std::uint32_t *sums, const std::uint8_t *enter, const std::uint8_t *leave, std::uint32_t scale, std::uint8_t *dst, std::size_t n)
+    {
+        Active().box_columns(sums, enter, leave, scale, dst, n);
+    }
+    inline void BoxRow(const std::uint8_t *line, std::uint8_t *dst, std::size_t width, std::size_t radius, std::uint32_t scale) { Active().box_row(line, dst, width, radius, scale); }
+    inline void Resample(std::uint8_t *dst, const std::uint8_t *src, const std::int32_t *starts, const std::int16_t *weights, std::size_t taps, std::size_t n)
+    {
+        Active().resample(dst, src, starts, weights, taps, n);
+    }
+    // Copies one row of n bytes
+    inline void CopyRow(std::uint8_t *dst, const std::uint8_t *src, std::size_t n) { std::memcpy(dst, src, n); }
+
+    namespace scalar
+    {
+        inline void Invert(std::uint8_t *data, std::size_t n)
+        {
+            for (std::size_t i = 0; i < n; i++)
+                data[i] = 255 - data[i];
+        }
+
+        inline void Fill3(std::uint8_t *dst, std::size_t n, const std::uint8_t *rgb)
+        {
+            if (n == 0)
+                return;
+
+            // Write one pixel, then keep doubling the filled prefix
+            dst[0] = rgb[0];
+            dst[1] = rgb[1];
+            dst[2] = rgb[2];
+
+            const std::size_t total = n * 3;
+            std::size_t filled = 3;
+            while (filled < total)
+            {
+                const std::size_t chunk = std::min(filled, total - filled);
+                std::memcpy(dst + filled, dst, chunk);
+                filled += chunk;
+            }
+        }
+
+        inline void Fill4(std::uint8_t *dst, std::size_t n, std::uint32_t pattern)
+        {
+            for (std::size_t i = 0; i < n; i++)
+                std::memcpy(dst + i * 4, &pattern, 4);
+        }
+
+        inline void Swizzle3(const std::uint8_t *src, std::uint8_t *dst, std::size_t n)
+        {
+            for (std::size_t i = 0; i < n; i++, src += 3, dst += 3)
+            {
+                const std::uint8_t first = src[0];
+                dst[0] = src[2];
+                dst[1] = src[1];
+                dst[2] = first;
+            }
+        }
+
+        inline void Swizzle4To3(const std::uint8_t *src, std::uint8_t *dst, std::size_t n)
+        {
+            for (std::size_t i = 0; i < n; i++, src += 4, dst += 3)
+            {
+                dst[0] = src[2];
+                dst[1] = src[1];
+                dst[2] = src[0];
+            }
+        }
+
+        inline void Swizzle3To4(const std::uint8_t *src, std::uint8_t *dst, std::size_t n)
+        {
+            for (std::size_t i = 0; i < n; i++, src += 3, dst += 4)
+            {
+                dst[0] = src[2];
+                dst[1] = src[1];
+                dst[2] = src[0];
+                dst[3] = 0;
+            }
+        }
+
+        inline void Reverse3(std::uint8_t *data, std::size_t n)
+        {
+            if (n < 2)
+                return;
+
+            std::uint8_t *left = data;
+            std::uint8_t *right = data + (n - 1) * 3;
+            for (; left < right; left += 3, right -= 3)
+            {
+                std::swap(left[0], right[0]);
+                std::swap(left[1], right[1]);
+                std::swap(left[2], right[2]);
+            }
+        }
+
+        inline void Reverse4(std::uint8_t *data, std::size_t n)
+        {
+            if (n < 2)
+                return;
+
+            std::uint8_t *left = data;
+            std::uint8_t *right = data + (n - 1) * 4;
+            for (; left < right; left += 4, right -= 4)
+            {
+                std::uint32_t a, b;
+                std::memcpy(&a, left, 4);
+                std::memcpy(&b, right, 4);
+                std::memcpy(left, &b, 4);
+                std::memcpy(right, &a, 4);
+            }
+        }
+
+        inline void Reverse1(std::uint8_t *data, std::size_t n)
+        {
+            std::reverse(data, data + n);
+        }
+
+        inline void Swap(std::uint8_t *a, std::uint8_t *b, std::size_t n)
+        {
+            std::swap_ranges(a, a + n, b);
+        }
+
+        inline void Bilinear4(const std::uint8_t *src, std::size_t stride, std::int64_t u, std::int64_t v, std::int64_t du, std::int64_t dv, std::size_t n, std::uint8_t *dst)
+        {
+            // 7-bit weights keep the horizontal blend within a signed 16-bit lane for the vector versions
+            for (std::size_t i = 0; i < n; i++, u += du, v += dv, dst += 4)
+            {
+                const std::uint8_t *top = src + static_cast<std::size_t>(v >> 16) * stride + static_cast<std::size_t>(u >> 16) * 4;
+                const std::uint8_t *bottom = top + stride;
+                const std::uint32_t fx = static_cast<std::uint32_t>(u >> 9) & 127;
+                const std::uint32_t fy = static_cast<std::uint32_t>(v >> 9) & 127;
+                for (int c = 0; c < 4; c++)
+                {
+                    const std::uint32_t upper = top[c] * (128 - fx) + top[c + 4] * fx;
+                    const std::uint32_t lower = bottom[c] * (128 - fx) + bottom[c + 4] * fx;
+                    dst[c] = static_cast<std::uint8_t>((upper * (128 - fy) + lower * fy + 8192) >> 14);
+                }
+            }
+        }
+
+        // Rounds x / 255 to nearest for x up to 255 * 255
+        inline std::uint32_t Div255(std::uint32_t x)
+        {
+            return ((x + 128) * 257) >> 16;
+        }
+
+        inline void Blend(std::uint8_t *dst, const std::uint8_t *src, std::size_t n, std::uint8_t alpha, BlendMode mode)
+        {
+            // s is the premultiplied source channel, ia the part of the destination showing through it
+            const std::uint32_t a = alpha, ia = 255 - alpha;
+            for (std::size_t i = 0; i < n; i++)
+            {
+                const std::uint32_t d = dst[i];
+                const std::uint32_t s = Div255(src[i] * a);
+                switch (mode)
+                {
+                case BlendMode::Replace:
+                    dst[i] = src[i];
+                    break;
+                case BlendMode::Over:
+                    // One rounding for the whole lerp keeps alpha 0 and 255 exact
+                    dst[i] = static_cast<std::uint8_t>(Div255(src[i] * a + d * ia));
+                    break;
+                case BlendMode::Add:
+                    dst[i] = static_cast<std::uint8_t>(std::min<std::uint32_t>(d + s, 255));
+                    break;
+                case BlendMode::Multiply:
+                    dst[i] = static_cast<std::uint8_t>(Div255(d * (ia + s)));
+                    break;
+                case BlendMode::Screen:
+                    dst[i] = static_cast<std::uint8_t>(d + s - Div255(d * s));
+                    break;
+                }
+            }
+        }
+
+        // Step between the counters hashed for consecutive words, and the multipliers of the lowbias32 hash
+        constexpr std::uint32_t kRandomStep = 0x9e3779b9, kRandomMul1 = 0x7feb352d, kRandomMul2 = 0x846ca68b;
+
+        // Returns word counter of the random stream of key: a Weyl sequence offset by key, hashed
+        inline std::uint32_t RandomWord(std::uint64_t key, std::uint32_t counter)
+        {
+            std::uint32_t x = (counter * kRandomStep + static_cast<std::uint32_t>(key)) ^ static_cast<std::uint32_t>(key >> 32);
+            x = (x ^ (x >> 16)) * kRandomMul1;
+            x = (x ^ (x >> 15)) * kRandomMul2;
+            return x ^ (x >> 16);
+        }
+
+        inline void Random(std::uint8_t *dst, std::size_t n, std::uint64_t key, std::uint32_t counter)
+        {
+            for (std::size_t i = 0; i < n; i += 4, ++counter)
+            {
+                const std::uint32_t word = RandomWord(key, counter);
+                for (std::size_t b = 0; b < 4 && i + b < n; b++)
+                    dst[i + b] = static_cast<std::uint8_t>(word >> (8 * b));
+            }
+        }
+
+        // Fraction bits of the convolution weights
+        constexpr int kWeightBits = 14;
+
+        // Convolves bytes [begin;n) of the rows, for the tails of the vector versions
+        inline void ConvolveTail(std::uint8_t *dst, const std::uint8_t *const *rows, const std::int16_t *weights, std::size_t taps, std::size_t begin, std::size_t n)
+        {
+            for (std::size_t i = begin; i < n; i++)
+            {
+                std::int32_t sum = 1 << (kWeightBits - 1);
+                for (std::size_t k = 0; k < taps; k++)
+                    sum += rows[k][i] * weights[k];
+                dst[i] = static_cast<std::uint8_t>(std::clamp(sum >> kWeightBits, 0, 255));
+            }
+        }
+
+        inline void Convolve(std::uint8_t *dst, const std::uint8_t *const *rows, const std::int16_t *weights, std::size_t taps, std::size_t n)
+        {
+            ConvolveTail(dst, rows, weights, taps, 0, n);
+        }
+
+        // Fraction bits of the box average multipliers. Windows of up to 65535 bytes keep sum * scale in 32 bits
+        constexpr int kBoxBits = 24;
+
+        inline std::uint8_t BoxAverage(std::uint32_t sum, std::uint32_t scale)
+        {
+            return static_cast<std::uint8_t>((sum * scale + (1u << (kBoxBits - 1))) >> kBoxBits);
+        }
+
+        inline void BoxColumns(std::uint32_t *sums, const std::uint8_t *enter, const std::uint8_t *leave, std::uint32_t scale, std::uint8_t *dst, std::size_t n)
+        {
+            for (std::size_t i = 0; i < n; i++)
+            {
+                sums[i] += enter[i];
+                dst[i] = BoxAverage(sums[i], scale);
+                sums[i] -= leave[i];
+            }
+        }
+
+        inline void BoxRow(const std::uint8_t *line, std::uint8_t *dst, std::size_t width, std::size_t radius, std::uint32_t scale)
+        {
+            std::uint32_t sums[4] = {};
+            for (std::size_t i = 0; i < 2 * radius; i++)
+                for (int c = 0; c < 4; c++)
+                    sums[c] += line[i * 4 + c];
+            for (std::size_t x = 0; x < width; x++)
+                BoxColumns(sums, line + (x + 2 * radius) * 4, line + x * 4, scale, dst + x * 4, 4);
+        }
+
+        inline void Resample(std::uint8_t *dst, const std::uint8_t *src, const std::int32_t *starts, const std::int16_t *weights, std::size_t taps, std::size_t n)
+        {
+            for (std::size_t i = 0; i < n; i++, weights += taps)
+            {
+                const std::uint8_t *pixels = src + static_cast<std::size_t>(starts[i]) * 4;
+                for (int c = 0; c < 4; c++)
+                {
+                    std::int32_t sum = 1 << (kWeightBits - 1);
+                    for (std::size_t k = 0; k < taps; k++)
+                        sum += pixels[k * 4 + c] * weights[k];
+                    dst[i * 4 + c] = static_cast<std::uint8_t>(std::clamp(sum >> kWeightBits, 0, 255));
+                }
+            }
+        }
+    }
+
+#if defined(BMPR_X86)
+    namespace sse2
+    {
+        BMPR_TARGET("sse2")
+        inline void Invert(std::uint8_t *data, std::size_t n)
+        {
+            const __m128i ones = _mm_set1_epi8(-1);
+            std::size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+            {
+                __m128i *p = reinterpret_cast<__m128i *>(data + i);
+                _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), ones));
+            }
+            scalar::Invert(data + i, n - i);
+        }
+
+        BMPR_TARGET("sse2")
+        inline void Fill3(std::uint8_t *dst, std::size_t n, const std::uint8_t *rgb)
+        {
+            // 48 bytes hold a whole number of pixels
+            alignas(16) std::uint8_t pattern[48];
+            for (std::size_t i = 0; i < 48; i++)
+                pattern[i] = rgb[i % 3];
+
+            const __m128i a = _mm_load_si128(reinterpret_cast<const __m128i *>(pattern));
+            const __m128i b = _mm_load_si128(reinterpret_cast<const __m128i *>(pattern + 16));
+            const __m128i c = _mm_load_si128(reinterpret_cast<const __m128i *>(pattern + 32));
+
+            const std::size_t total = n * 3;
+            std::size_t i = 0;
+            for (; i + 48 <= total; i += 48)
+            {
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), a);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 16), b);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 32), c);
+            }
+            std::memcpy(dst + i, pattern, total - i);
+        }
+
+        BMPR_TARGET("sse2")
+        inline void Fill4(std::uint8_t *dst, std::size_t n, std::uint32_t pattern)
+        {
+            const __m128i value = _mm_set1_epi32(static_cast<int>(pattern));
+            std::size_t i = 0;
+            for (; i + 4 <= n; i += 4)
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 4), value);
+            scalar::Fill4(dst + i * 4, n - i, pattern);
+        }
+
+        BMPR_TARGET("sse2")
+        inline void Reverse4(std::uint8_t *data, std::size_t n)
+        {
+            std::size_t left = 0, right = n;
+            for (; right - left >= 8; left += 4, right -= 4)
+            {
+                __m128i *l = reinterpret_cast<__m128i *>(data + left * 4);
+                __m128i *r = reinterpret_cast<__m128i *>(data + (right - 4) * 4);
+                const __m128i a = _mm_shuffle_epi32(_mm_loadu_si128(l), _MM_SHUFFLE(0, 1, 2, 3));
+                const __m128i b = _mm_shuffle_epi32(_mm_loadu_si128(r), _MM_SHUFFLE(0, 1, 2, 3));
+                _mm_storeu_si128(l, b);
+                _mm_storeu_si128(r, a);
+            }
+            scalar::Reverse4(data + left * 4, right - left);
+        }
+
+        BMPR_TARGET("sse2")
+        inline void Swap(std::uint8_t *a, std::uint8_t *b, std::size_t n)
+        {
+            std::size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+            {
+                __m128i *pa = reinterpret_cast<__m128i *>(a + i);
+                __m128i *pb = reinterpret_cast<__m128i *>(b + i);
+                const __m128i va = _mm_loadu_si128(pa);
+                _mm_storeu_si128(pa, _mm_loadu_si128(pb));
+                _mm_storeu_si128(pb, va);
+            }
+            scalar::Swap(a + i, b + i, n - i);
+        }
+
+        // Blends the horizontal pairs of two pixels' 2x2 blocks: lanes 0-3 get the first pixel, lanes 4-7 the second
+        BMPR_TARGET("sse2")
+        inline __m128i BlendPairs(const std::uint8_t *a, const std::uint8_t *b, int fa, int fb)
+        {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i pa = _mm_mullo_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(a)), zero),
+                                               _mm_setr_epi16(128 - fa, 128 - fa, 128 - fa, 128 - fa, fa, fa, fa, fa));
+            const __m128i pb = _mm_mullo_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(b)), zero),
+                                               _mm_setr_epi16(128 - fb, 128 - fb, 128 - fb, 128 - fb, fb, fb, fb, fb));
+            return _mm_unpacklo_epi64(_mm_add_epi16(pa, _mm_srli_si128(pa, 8)), _mm_add_epi16(pb, _mm_srli_si128(pb, 8)));
+        }
+
+        BMPR_TARGET("sse2")
+        inline void Bilinear4(const std::uint8_t *src, std::size_t stride, std::int64_t u, std::int64_t v, std::int64_t du, std::int64_t dv, std::size_t n, std::uint8_t *dst)
+        {
+            // Two pixels per step with their channels side by side, blended horizontally in 16-bit lanes and vertically with madd
+            const __m128i round = _mm_set1_epi32(8192);
+            std::size_t i = 0;
+            for (; i + 2 <= n; i += 2, u += 2 * du, v += 2 * dv)
+            {
+                const std::uint8_t *a = src + static_cast<std::size_t>(v >> 16) * stride + static_cast<std::size_t>(u >> 16) * 4;
+                const std::uint8_t *b = src + static_cast<std::size_t>((v + dv) >> 16) * stride + static_cast<std::size_t>((u + du) >> 16) * 4;
+                const int fxa = static_cast<int>((u >> 9) & 127), fxb = static_cast<int>(((u + du) >> 9) & 127);
+                const int fya = static_cast<int>((v >> 9) & 127), fyb = static_cast<int>(((v + dv) >> 9) & 127);
+
+                const __m128i upper = BlendPairs(a, b, fxa, fxb);
+                const __m128i lower = BlendPairs(a + stride, b + stride, fxa, fxb);
+                const __m128i wa = _mm_set1_epi32((fya << 16) | (128 - fya));
+                const __m128i wb = _mm_set1_epi32((fyb << 16) | (128 - fyb));
+                const __m128i sa = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(upper, lower), wa), round), 14);
+                const __m128i sb = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(upper, lower), wb), round), 14);
+                const __m128i words = _mm_packs_epi32(sa, sb);
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i * 4), _mm_packus_epi16(words, words));
+            }
+            scalar::Bilinear4(src, stride, u, v, du, dv, n - i, dst + i * 4);
+        }
+
+        // Rounds every 16-bit lane / 255 to nearest, exactly like scalar::Div255
+        BMPR_TARGET("sse2")
+        inline __m128i Div255(__m128i x)
+        {
+            return _mm_mulhi_epu16(_mm_add_epi16(x, _mm_set1_epi16(128)), _mm_set1_epi16(257));
+        }
+
+        // Blends 8 destination channels with 8 source channels, both widened to 16 bits. Add is saturated by the final pack
+        BMPR_TARGET("sse2")
+        inline __m128i BlendLanes(__m128i d, __m128i src, __m128i a, __m128i ia, BlendMode mode)
+        {
+            const __m128i s = Div255(_mm_mullo_epi16(src, a));
+            switch (mode)
+            {
+            case BlendMode::Over:
+                return Div255(_mm_add_epi16(_mm_mullo_epi16(src, a), _mm_mullo_epi16(d, ia)));
+            case BlendMode::Add:
+                return _mm_add_epi16(d, s);
+            case BlendMode::Multiply:
+                return Div255(_mm_mullo_epi16(d, _mm_add_epi16(ia, s)));
+            default:
+                return _mm_sub_epi16(_mm_add_epi16(d, s), Div255(_mm_mullo_epi16(d, s)));
+            }
+        }
+
+        BMPR_TARGET("sse2")
+        inline void Blend(std::uint8_t *dst, const std::uint8_t *src, std::size_t n, std::uint8_t alpha, BlendMode mode)
+        {
+            if (mode == BlendMode::Replace)
+            {
+                std::memcpy(dst, src, n);
+                return;
+            }
+
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i a = _mm_set1_epi16(alpha);
+            const __m128i ia = _mm_set1_epi16(static_cast<short>(255 - alpha));
+            std::size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+            {
+                const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+                const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+                const __m128i lo = BlendLanes(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(s, zero), a, ia, mode);
+                const __m128i hi = BlendLanes(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(s, zero), a, ia, mode);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(lo, hi));
+            }
+            scalar::Blend(dst + i, src + i, n - i, alpha, mode);
+        }
+
+        // Multiplies four 32-bit lanes, keeping the low halves (SSE2 only multiplies two at a time)
+        BMPR_TARGET("sse2")
+        inline __m128i MulLo32(__m128i a, __m128i b)
+        {
+            const __m128i even = _mm_mul_epu32(a, b);
+            const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+            return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+        }
+
+        BMPR_TARGET("sse2")
+        inline void Random(std::uint8_t *dst, std::size_t n, std::uint64_t key, std::uint32_t counter)
+        {
+            const __m128i step = _mm_set1_epi32(static_cast<int>(scalar::kRandomStep * 4));
+            const __m128i lo = _mm_set1_epi32(static_cast<int>(key)), hi = _mm_set1_epi32(static_cast<int>(key >> 32));
+            const __m128i mul1 = _mm_set1_epi32(static_cast<int>(scalar::kRandomMul1)), mul2 = _mm_set1_epi32(static_cast<int>(scalar::kRandomMul2));
+            // Counters times the step, kept incrementally
+            __m128i weyl = MulLo32(_mm_add_epi32(_mm_set1_epi32(static_cast<int>(counter)), _mm_setr_epi32(0, 1, 2, 3)), _mm_set1_epi32(static_cast<int>(scalar::kRandomStep)));
+            std::size_t i = 0;
+            for (; i + 16 <= n; i += 16, counter += 4)
+            {
+                __m128i x = _mm_xor_si128(_mm_add_epi32(weyl, lo), hi);
+                x = MulLo32(_mm_xor_si128(x, _mm_srli_epi32(x, 16)), mul1);
+                x = MulLo32(_mm_xor_si128(x, _mm_srli_epi32(x, 15)), mul2);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_xor_si128(x, _mm_srli_epi32(x, 16)));
+                weyl = _mm_add_epi32(weyl, step);
+            }
+            scalar::Random(dst + i, n - i, key, counter);
+        }
+
+        BMPR_TARGET("sse2")
+        inline void Convolve(std::uint8_t *dst, const std::uint8_t *const *rows, const std::int16_t *weights, std::size_t taps, std::size_t n)
+        {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i round = _mm_set1_epi32(1 << (scalar::kWeightBits - 1));
+            std::size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+            {
+                // Taps are taken in pairs, multiplying interleaved 16-bit pixels of both rows by both weights in one madd
+                __m128i sum[4] = {round, round, round, round};
+                for (std::size_t k = 0; k < taps; k += 2)
+                {
+                    const bool pair = k + 1 < taps;
+                    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[k] + i));
+                    const __m128i b = pair ? _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[k + 1] + i)) : zero;
+                    const std::uint32_t packed = static_cast<std::uint16_t>(weights[k]) | (pair ? static_cast<std::uint32_t>(static_cast<std::uint16_t>(weights[k + 1])) << 16 : 0);
+                    const __m128i w = _mm_set1_epi32(static_cast<int>(packed));
+                    const __m128i lo = _mm_unpacklo_epi8(a, zero), hi = _mm_unpackhi_epi8(a, zero);
+                    const __m128i lo_b = _mm_unpacklo_epi8(b, zero), hi_b = _mm_unpackhi_epi8(b, zero);
+                    sum[0] = _mm_add_epi32(sum[0], _mm_madd_epi16(_mm_unpacklo_epi16(lo, lo_b), w));
+                    sum[1] = _mm_add_epi32(sum[1], _mm_madd_epi16(_mm_unpackhi_epi16(lo, lo_b), w));
+                    sum[2] = _mm_add_epi32(sum[2], _mm_madd_epi16(_mm_unpacklo_epi16(hi, hi_b), w));
+                    sum[3] = _mm_add_epi32(sum[3], _mm_madd_epi16(_mm_unpackhi_epi16(hi, hi_b), w));
+                }
+                const __m128i lo = _mm_packs_epi32(_mm_srai_epi32(sum[0], scalar::kWeightBits), _mm_srai_epi32(sum[1], scalar::kWeightBits));
+                const __m128i hi = _mm_packs_epi32(_mm_srai_epi32(sum[2], scalar::kWeightBits), _mm_srai_epi32(sum[3], scalar::kWeightBits));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(lo, hi));
+            }
+            scalar::ConvolveTail(dst, rows, weights, taps, i, n);
+        }
+
+        // Adds enter to the four sums, returns their rounded averages and subtracts leave, all as 32-bit lanes
+        BMPR_TARGET("sse2")
+        inline __m128i BoxStep(__m128i &sums, __m128i enter, __m128i leave, __m128i scale)
+        {
+            sums = _mm_add_epi32(sums, enter);
+            const __m128i average = _mm_srli_epi32(_mm_add_epi32(MulLo32(sums, scale), _mm_set1_epi32(1 << (scalar::kBoxBits - 1))), scalar::kBoxBits);
+            sums = _mm_sub_epi32(sums, leave);
+            return average;
+        }
+
+        BMPR_TARGET("sse2")
+        inline void BoxColumns(std::uint32_t *sums, const std::uint8_t *enter, const std::uint8_t *leave, std::uint32_t scale, std::uint8_t *dst, std::size_t n)
+        {
+            const __m128i zero = _mm_setzero_si128(), factor = _mm_set1_epi32(static_cast<int>(scale));
+            std::size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+            {
+                const __m128i e = _mm_loadu_si128(reinterpret_cast<const __m128i *>(enter + i)), l = _mm_loadu_si128(reinterpret_cast<const __m128i *>(leave + i));
+                const __m128i e16[2] = {_mm_unpacklo_epi8(e, zero), _mm_unpackhi_epi8(e, zero)}, l16[2] = {_mm_unpacklo_epi8(l, zero), _mm_unpackhi_epi8(l, zero)};
+                __m128i average[4];
+                for (int q = 0; q < 4; q++)
+                {
+                    __m128i *p = reinterpret_cast<__m128i *>(sums + i + q * 4);
+                    __m128i sum = _mm_loadu_si128(p);
+                    const __m128i e32 = q % 2 ? _mm_unpackhi_epi16(e16[q / 2], zero) : _mm_unpacklo_epi16(e16[q / 2], zero);
+                    const __m128i l32 = q % 2 ? _mm_unpackhi_epi16(l16[q / 2], zero) : _mm_unpacklo_epi16(l16[q / 2], zero);
+                    average[q] = BoxStep(sum, e32, l32, factor);
+                    _mm_storeu_si128(p, sum);
+                }
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(_mm_packs_epi32(average[0], average[1]), _mm_packs_epi32(average[2], average[3])));
+            }
+            scalar::BoxColumns(sums + i, enter + i, leave + i, scale, dst + i, n - i);
+        }
+
+        // AVX2 keeps this version: a pixel's four channels fill one 128-bit vector, and every step depends on the last
+        BMPR_TARGET("sse2")
+        inline void BoxRow(const std::uint8_t *line, std::uint8_t *dst, std::size_t width, std::size_t radius, std::uint32_t scale)
+        {
+            // One pixel per step, its four channels in the lanes of one vector
+            const __m128i zero = _mm_setzero_si128(), factor = _mm_set1_epi32(static_cast<int>(scale));
+            const auto load = [&](const std::uint8_t *p)
+            {
+                std::int32_t v;
+                std::memcpy(&v, p, 4);
+                return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero), zero);
+            };
+            __m128i sums = zero;
+            for (std::size_t i = 0; i < 2 * radius; i++)
+                sums = _mm_add_epi32(sums, load(line + i * 4));
+            for (std::size_t x = 0; x < width; x++)
+            {
+                const __m128i average = BoxStep(sums, load(line + (x + 2 * radius) * 4), load(line + x * 4), factor);
+                const std::int32_t packed = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(average, zero), zero));
+                std::memcpy(dst + x * 4, &packed, 4);
+            }
+        }
+
+        BMPR_TARGET("sse2")
+        inline void Resample(std::uint8_t *dst, const std::uint8_t *src, const std::int32_t *starts, const std::int16_t *weights, std::size_t taps, std::size_t n)
+        {
+            const __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi32(1 << (scalar::kWeightBits - 1));
+            for (std::size_t i = 0; i < n; i++, weights += taps)
+            {
+                // Taps in pairs, the channels of both pixels interleaved so one madd multiplies them by both weights
+                const std::uint8_t *pixels = src + static_cast<std::size_t>(starts[i]) * 4;
+                __m128i sum = round;
+                std::size_t k = 0;
+                for (; k + 2 <= taps; k += 2)
+                {
+                    const __m128i pair = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(pixels + k * 4));
+                    const __m128i channels = _mm_unpacklo_epi8(_mm_unpacklo_epi8(pair, _mm_srli_si128(pair, 4)), zero);
+                    const auto w = static_cast<std::uint16_t>(weights[k]) | static_cast<std::uint32_t>(static_cast<std::uint16_t>(weights[k + 1])) << 16;
+                    sum = _mm_add_epi32(sum, _mm_madd_epi16(channels, _mm_set1_epi32(static_cast<int>(w))));
+                }
+                if (k < taps)
+                {
+                    std::int32_t last;
+                    std::memcpy(&last, pixels + k * 4, 4);
+                    const __m128i channels = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(last), zero), zero);
+                    sum = _mm_add_epi32(sum, _mm_madd_epi16(channels, _mm_set1_epi32(static_cast<std::uint16_t>(weights[k]))));
+                }
+                const __m128i words = _mm_packs_epi32(_mm_srai_epi32(sum, scalar::kWeightBits), zero);
+                const std::int32_t packed = _mm_cvtsi128_si32(_mm_packus_epi16(words, zero));
+                std::memcpy(dst + i * 4, &packed, 4);
+            }
+        }
+    }
+
+    namespace ssse3
+    {
+        // Swaps bytes 0 and 2 of the five pixels in a 16-byte block, byte 15 is left as is
+        BMPR_TARGET("ssse3")
+        inline __m128i SwizzleMask3()
+        {
+            return _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+        }
+
+        BMPR_TARGET("ssse3")
+        inline void Swizzle3(const std::uint8_t *src, std::uint8_t *dst, std::size_t n)
+        {
+            // Every step rewrites 15 bytes and stores byte 15 unchanged, so this also works in place
+            const __m128i mask = SwizzleMask3();
+            std::size_t i = 0;
+            for (; (n - i) * 3 >= 16; i += 5)
+            {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 3));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 3), _mm_shuffle_epi8(v, mask));
+            }
+            scalar::Swizzle3(src + i * 3, dst + i * 3, n - i);
+        }
+
+        BMPR_TARGET("ssse3")
+        inline void Swizzle4To3(const std::uint8_t *src, std::uint8_t *dst, std::size_t n)
+        {
+            // Four pixels per step, the 4 trailing bytes of each store are overwritten by the next one
+            const __m128i mask = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+            std::size_t i = 0;
+            for (; (n - i) * 3 >= 16; i += 4)
+            {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 4));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 3), _mm_shuffle_epi8(v, mask));
+            }
+            scalar::Swizzle4To3(src + i * 4, dst + i * 3, n - i);
+        }
+
+        BMPR_TARGET("ssse3")
+        inline void Swizzle3To4(const std::uint8_t *src, std::uint8_t *dst, std::size_t n)
+        {
+            // Four pixels per step, reading 16 bytes of which 12 are used
+            const __m128i mask = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+            std::size_t i = 0;
+            for (; (n - i) * 3 >= 16; i += 4)
+            {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 3));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 4), _mm_shuffle_epi8(v, mask));
+            }
+            scalar::Swizzle3To4(src + i * 3, dst + i * 4, n - i);
+        }
+
+        BMPR_TARGET("ssse3")
+        inline void Reverse3(std::uint8_t *data, std::size_t n)
+        {
+            // Left block: pixels in bytes [0;15) plus a foreign byte 15.
+            // Right block: a foreign byte 0 plus pixels in bytes [1;16).
+            const __m128i to_left = _mm_setr_epi8(13, 14, 15, 10, 11, 12, 7, 8, 9, 4, 5, 6, 1, 2, 3, -1);
+            const __m128i to_right = _mm_setr_epi8(-1, 12, 13, 14, 9, 10, 11, 6, 7, 8, 3, 4, 5, 0, 1, 2);
+            const __m128i keep_left = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1);
+            const __m128i keep_right = _mm_setr_epi8(-1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+            std::size_t left = 0, right = n * 3;
+            for (; right - left >= 32; left += 15, right -= 15)
+            {
+                __m128i *l = reinterpret_cast<__m128i *>(data + left);
+                __m128i *r = reinterpret_cast<__m128i *>(data + right - 16);
+                const __m128i a = _mm_loadu_si128(l);
+                const __m128i b = _mm_loadu_si128(r);
+                // The shuffles zero the foreign byte, which is then restored from the original block
+                _mm_storeu_si128(l, _mm_or_si128(_mm_shuffle_epi8(b, to_left), _mm_and_si128(a, keep_left)));
+                _mm_storeu_si128(r, _mm_or_si128(_mm_shuffle_epi8(a, to_right), _mm_and_si128(b, keep_right)));
+            }
+            scalar::Reverse3(data + left, (right - left) / 3);
+        }
+
+        BMPR_TARGET("ssse3")
+        inline void Reverse1(std::uint8_t *data, std::size_t n)
+        {
+            const __m128i mask = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+            std::size_t left = 0, right = n;
+            for (; right - left >= 32; left += 16, right -= 16)
+            {
+                __m128i *l = reinterpret_cast<__m128i *>(data + left);
+                __m128i *r = reinterpret_cast<__m128i *>(data + right - 16);
+                const __m128i a = _mm_shuffle_epi8(_mm_loadu_si128(l), mask);
+                const __m128i b = _mm_shuffle_epi8(_mm_loadu_si128(r), mask);
+                _mm_storeu_si128(l, b);
+                _mm_storeu_si128(r, a);
+            }
+            scalar::Reverse1(data + left, right - left);
+        }
+    }
+
+    namespace avx2
+    {
+        BMPR_TARGET("avx2")
+        inline void Invert(std::uint8_t *data, std::size_t n)
+        {
+            const __m256i ones = _mm256_set1_epi8(-1);
+            std::size_t i = 0;
+            for (; i + 32 <= n; i += 32)
+            {
+                __m256i *p = reinterpret_cast<__m256i *>(data + i);
+                _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), ones));
+            }
+            scalar::Invert(data + i, n - i);
+        }
+
+        BMPR_TARGET("avx2")
+        inline void Fill3(std::uint8_t *dst, std::size_t n, const std::uint8_t *rgb)
+        {
+            alignas(32) std::uint8_t pattern[96];
+            for (std::size_t i = 0; i < 96; i++)
+                pattern[i] = rgb[i % 3];
+
+            const __m256i a = _mm256_load_si256(reinterpret_cast<const __m256i *>(pattern));
+            const __m256i b = _mm256_load_si256(reinterpret_cast<const __m256i *>(pattern + 32));
+            const __m256i c = _mm256_load_si256(reinterpret_cast<const __m256i *>(pattern + 64));
+
+            const std::size_t total = n * 3;
+            std::size_t i = 0;
+            for (; i + 96 <= total; i += 96)
+            {
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), a);
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 32), b);
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 64), c);
+            }
+            std::memcpy(dst + i, pattern, total - i);
+        }
+
+        BMPR_TARGET("avx2")
+        inline void Fill4(std::uint8_t *dst, std::size_t n, std::uint32_t pattern)
+        {
+            const __m256i value = _mm256_set1_epi32(static_cast<int>(pattern));
+            std::size_t i = 0;
+            for (; i + 8 <= n; i += 8)
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 4), value);
+            scalar::Fill4(dst + i * 4, n - i, pattern);
+        }
+
+        BMPR_TARGET("avx2")
+        inline void Swizzle3(const std::uint8_t *src, std::uint8_t *dst, std::size_t n)
+        {
+            // Two SSSE3 blocks per step, 15 bytes apart, one per 128-bit lane
+            const __m256i mask = _mm256_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15,
+                                                  2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+            std::size_t i = 0;
+            for (; (n - i) * 3 >= 31; i += 10)
+            {
+                const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 3));
+                const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 3 + 15));
+                const __m256i v = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), mask);
+                // The low half must be stored first, its byte 15 belongs to the high half
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 3), _mm256_castsi256_si128(v));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 3 + 15), _mm256_extracti128_si256(v, 1));
+            }
+            ssse3::Swizzle3(src + i * 3, dst + i * 3, n - i);
+        }
+
+        BMPR_TARGET("avx2")
+        inline void Swizzle4To3(const std::uint8_t *src, std::uint8_t *dst, std::size_t n)
+        {
+            // Eight pixels per step: pack 12 bytes per lane, then move the lanes next to each other
+            const __m256i mask = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                                  2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+            const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+            std::size_t i = 0;
+            for (; (n - i) * 3 >= 32; i += 8)
+            {
+                const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i * 4));
+                const __m256i packed = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, mask), lanes);
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 3), packed);
+            }
+            ssse3::Swizzle4To3(src + i * 4, dst + i * 3, n - i);
+        }
+
+        BMPR_TARGET("avx2")
+        inline void Swap(std::uint8_t *a, std::uint8_t *b, std::size_t n)
+        {
+            std::size_t i = 0;
+            for (; i + 32 <= n; i += 32)
+            {
+                __m256i *pa = reinterpret_cast<__m256i *>(a + i);
+                __m256i *pb = reinterpret_cast<__m256i *>(b + i);
+                const __m256i va = _mm256_loadu_si256(pa);
+                _mm256_storeu_si256(pa, _mm256_loadu_si256(pb));
+                _mm256_storeu_si256(pb, va);
+            }
+            sse2::Swap(a + i, b + i, n - i);
+        }
+
+        BMPR_TARGET("avx2")
+        inline __m256i Div255(__m256i x)
+        {
+            return _mm256_mulhi_epu16(_mm256_add_epi16(x, _mm256_set1_epi16(128)), _mm256_set1_epi16(257));
+        }
+
+        BMPR_TARGET("avx2")
+        inline __m256i BlendLanes(__m256i d, __m256i src, __m256i a, __m256i ia, BlendMode mode)
+        {
+            const __m256i s = Div255(_mm256_mullo_epi16(src, a));
+            switch (mode)
+            {
+            case BlendMode::Over:
+                return Div255(_mm256_add_epi16(_mm256_mullo_epi16(src, a), _mm256_mullo_epi16(d, ia)));
+            case BlendMode::Add:
+                return _mm256_add_epi16(d, s);
+            case BlendMode::Multiply:
+                return Div255(_mm256_mullo_epi16(d, _mm256_add_epi16(ia, s)));
+            default:
+                return _mm256_sub_epi16(_mm256_add_epi16(d, s), Div255(_mm256_mullo_epi16(d, s)));
+            }
+        }
+
+        BMPR_TARGET("avx2")
+        inline void Blend(std::uint8_t *dst, const std::uint8_t *src, std::size_t n, std::uint8_t alpha, BlendMode mode)
+        {
+            if (mode == BlendMode::Replace)
+            {
+                std::memcpy(dst, src, n);
+                return;
+            }
+
+            // Unpacking and packing both work within 128-bit lanes, so the bytes come back in order
+            const __m256i zero = _mm256_setzero_si256();
+            const __m256i a = _mm256_set1_epi16(alpha);
+            const __m256i ia = _mm256_set1_epi16(static_cast<short>(255 - alpha));
+            std::size_t i = 0;
+            for (; i + 32 <= n; i += 32)
+            {
+                const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+                const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+                const __m256i lo = BlendLanes(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(s, zero), a, ia, mode);
+                const __m256i hi = BlendLanes(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(s, zero), a, ia, mode);
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_packus_epi16(lo, hi));
+            }
+            sse2::Blend(dst + i, src + i, n - i, alpha, mode);
+        }
+
+        BMPR_TARGET("avx2")
+        inline void Random(std::uint8_t *dst, std::size_t n, std::uint64_t key, std::uint32_t counter)
+        {
+            const __m256i step = _mm256_set1_epi32(static_cast<int>(scalar::kRandomStep * 8));
+            const __m256i lo = _mm256_set1_epi32(static_cast<int>(key)), hi = _mm256_set1_epi32(static_cast<int>(key >> 32));
+            const __m256i mul1 = _mm256_set1_epi32(static_cast<int>(scalar::kRandomMul1)), mul2 = _mm256_set1_epi32(static_cast<int>(scalar::kRandomMul2));
+            __m256i weyl = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(counter)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)),
+                                              _mm256_set1_epi32(static_cast<int>(scalar::kRandomStep)));
+            std::size_t i = 0;
+            for (; i + 32 <= n; i += 32, counter += 8)
+            {
+                __m256i x = _mm256_xor_si256(_mm256_add_epi32(weyl, lo), hi);
+                x = _mm256_mullo_epi32(_mm256_xor_si256(x, _mm256_srli_epi32(x, 16)), mul1);
+                x = _mm256_mullo_epi32(_mm256_xor_si256(x, _mm256_srli_epi32(x, 15)), mul2);
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_xor_si256(x, _mm256_srli_epi32(x, 16)));
+                weyl = _mm256_add_epi32(weyl, step);
+            }
+            sse2::Random(dst + i, n - i, key, counter);
+        }
+
+        BMPR_TARGET("avx2")
+        inline void Convolve(std::uint8_t *dst, const std::uint8_t *const *rows, const std::int16_t *weights, std::size_t taps, std::size_t n)
+        {
+            // Same as the SSE2 version on both 128-bit lanes; unpacking and packing within lanes keeps the bytes in order
+            const __m256i zero = _mm256_setzero_si256();
+            const __m256i round = _mm256_set1_epi32(1 << (scalar::kWeightBits - 1));
+            std::size_t i = 0;
+            for (; i + 32 <= n; i += 32)
+            {
+                __m256i sum[4] = {round, round, round, round};
+                for (std::size_t k = 0; k < taps; k += 2)
+                {
+                    const bool pair = k + 1 < taps;
+                    const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(rows[k] + i));
+                    const __m256i b = pair ? _mm256_loadu_si256(reinterpret_cast<const __m256i *>(rows[k + 1] + i)) : zero;
+                    const std::uint32_t packed = static_cast<std::uint16_t>(weights[k]) | (pair ? static_cast<std::uint32_t>(static_cast<std::uint16_t>(weights[k + 1])) << 16 : 0);
+                    const __m256i w = _mm256_set1_epi32(static_cast<int>(packed));
+                    const __m256i lo = _mm256_unpacklo_epi8(a, zero), hi = _mm256_unpackhi_epi8(a, zero);
+                    const __m256i lo_b = _mm256_unpacklo_epi8(b, zero), hi_b = _mm256_unpackhi_epi8(b, zero);
+                    sum[0] = _mm256_add_epi32(sum[0], _mm256_madd_epi16(_mm256_unpacklo_epi16(lo, lo_b), w));
+                    sum[1] = _mm256_add_epi32(sum[1], _mm256_madd_epi16(_mm256_unpackhi_epi16(lo, lo_b), w));
+                    sum[2] = _mm256_add_epi32(sum[2], _mm256_madd_epi16(_mm256_unpacklo_epi16(hi, hi_b), w));
+                    sum[3] = _mm256_add_epi32(sum[3], _mm256_madd_epi16(_mm256_unpackhi_epi16(hi, hi_b), w));
+                }
+                const __m256i lo = _mm256_packs_epi32(_mm256_srai_epi32(sum[0], scalar::kWeightBits), _mm256_srai_epi32(sum[1], scalar::kWeightBits));
+                const __m256i hi = _mm256_packs_epi32(_mm256_srai_epi32(sum[2], scalar::kWeightBits), _mm256_srai_epi32(sum[3], scalar::kWeightBits));
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_packus_epi16(lo, hi));
+            }
+            scalar::ConvolveTail(dst, rows, weights, taps, i, n);
+        }
+
+        BMPR_TARGET("avx2")
+        inline void BoxColumns(std::uint32_t *sums, const std::uint8_t *enter, const std::uint8_t *leave, std::uint32_t scale, std::uint8_t *dst, std::size_t n)
+        {
+            const __m256i factor = _mm256_set1_epi32(static_cast<int>(scale)), round = _mm256_set1_epi32(1 << (scalar::kBoxBits - 1));
+            std::size_t i = 0;
+            for (; i + 8 <= n; i += 8)
+            {
+                __m256i *p = reinterpret_cast<__m256i *>(sums + i);
+                const __m256i sum = _mm256_add_epi32(_mm256_loadu_si256(p), _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(enter + i))));
+                const __m256i average = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(sum, factor), round), scalar::kBoxBits);
+                _mm256_storeu_si256(p, _mm256_sub_epi32(sum, _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(leave + i)))));
+                const __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(average), _mm256_extracti128_si256(average, 1));
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(words, words));
+            }
+            scalar::BoxColumns(sums + i, enter + i, leave + i, scale, dst + i, n - i);
+        }
+    }
+#endif
+
+#if defined(BMPR_NEON)
+    namespace neon
+    {
+        inline void Invert(std::uint8_t *data, std::size_t n)
+        {
+            std::size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+                vst1q_u8(data + i, vmvnq_u8(vld1q_u8(data + i)));
+            scalar::Invert(data + i, n - i);
+        }
+
+        inline void Fill3(std::uint8_t *dst, std::size_t n, const std::uint8_t *rgb)
+        {
+            const uint8x16x3_t value = {{vdupq_n_u8(rgb[0]), vdupq_n_u8(rgb[1]), vdupq_n_u8(rgb[2])}};
+            std::size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+                vst3q_u8(dst + i * 3, value);
+            scalar::Fill3(dst + i * 3, n - i, rgb);
+        }
+
+        inline void Fill4(std::uint8_t *dst, std::size_t n, std::uint32_t pattern)
+        {
+            const uint32x4_t value = vdupq_n_u32(pattern);
+            std::size_t i = 0;
+            for (; i + 4 <= n; i += 4)
+                vst1q_u8(dst + i * 4, vreinterpretq_u8_u32(value));
+            scalar::Fill4(dst + i * 4, n - i, pattern);
+        }
+
+        inline void Swizzle3(const std::uint8_t *src, std::uint8_t *dst, std::size_t n)
+        {
+            std::size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+            {
+                uint8x16x3_t v = vld3q_u8(src + i * 3);
+                const uint8x16_t first = v.val[0];
+                v.val[0] = v.val[2];
+                v.val[2] = first;
+                vst3q_u8(dst + i * 3, v);
+            }
+            scalar::Swizzle3(src + i * 3, dst + i * 3, n - i);
+        }
+
+        inline void Swizzle4To3(const std::uint8_t *src, std::uint8_t *dst, std::size_t n)
+        {
+            std::size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+            {
+                const uint8x16x4_t v = vld4q_u8(src + i * 4);
+                const uint8x16x3_t out = {{v.val[2], v.val[1], v.val[0]}};
+                vst3q_u8(dst + i * 3, out);
+            }
+            scalar::Swizzle4To3(src + i * 4, dst + i * 3, n - i);
+        }
+
+        inline void Swizzle3To4(const std::uint8_t *src, std::uint8_t *dst, std::size_t n)
+        {
+            std::size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+            {
+                const uint8x16x3_t v = vld3q_u8(src + i * 3);
+                const uint8x16x4_t out = {{v.val[2], v.val[1], v.val[0], vdupq_n_u8(0)}};
+                vst4q_u8(dst + i * 4, out);
+            }
+            scalar::Swizzle3To4(src + i * 3, dst + i * 4, n - i);
+        }
+
+        // Reverses the 16 lanes of v
+        inline uint8x16_t ReverseLanes(uint8x16_t v)
+        {
+            const uint8x16_t halves = vrev64q_u8(v);
+            return vextq_u8(halves, halves, 8);
+        }
+
+        inline void Reverse3(std::uint8_t *data, std::size_t n)
+        {
+            std::size_t left = 0, right = n;
+            for (; right - left >= 32; left += 16, right -= 16)
+            {
+                uint8x16x3_t a = vld3q_u8(data + left * 3);
+                uint8x16x3_t b = vld3q_u8(data + (right - 16) * 3);
+                for (int c = 0; c < 3; c++)
+                {
+                    a.val[c] = ReverseLanes(a.val[c]);
+                    b.val[c] = ReverseLanes(b.val[c]);
+                }
+                vst3q_u8(data + left * 3, b);
+                vst3q_u8(data + (right - 16) * 3, a);
+            }
+            scalar::Reverse3(data + left * 3, right - left);
+        }
+
+        inline void Reverse4(std::uint8_t *data, std::size_t n)
+        {
+            std::size_t left = 0, right = n;
+            for (; right - left >= 8; left += 4, right -= 4)
+            {
+                const uint32x4_t a = vld1q_u32(reinterpret_cast<const std::uint32_t *>(data + left * 4));
+                const uint32x4_t b = vld1q_u32(reinterpret_cast<const std::uint32_t *>(data + (right - 4) * 4));
+                const uint32x4_t ra = vrev64q_u32(a);
+                const uint32x4_t rb = vrev64q_u32(b);
+                vst1q_u32(reinterpret_cast<std::uint32_t *>(data + left * 4), vextq_u32(rb, rb, 2));
+                vst1q_u32(reinterpret_cast<std::uint32_t *>(data + (right - 4) * 4), vextq_u32(ra, ra, 2));
+            }
+            scalar::Reverse4(data + left * 4, right - left);
+        }
+
+        inline void Reverse1(std::uint8_t *data, std::size_t n)
+        {
+            std::size_t left = 0, right = n;
+            for (; right - left >= 32; left += 16, right -= 16)
+            {
+                const uint8x16_t a = ReverseLanes(vld1q_u8(data + left));
+                const uint8x16_t b = ReverseLanes(vld1q_u8(data + right - 16));
+                vst1q_u8(data + left, b);
+                vst1q_u8(data + right - 16, a);
+            }
+            scalar::Reverse1(data + left, right - left);
+        }
+
+        inline void Swap(std::uint8_t *a, std::uint8_t *b, std::size_t n)
+        {
+            std::size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+            {
+                const uint8x16_t va = vld1q_u8(a + i);
+                vst1q_u8(a + i, vld1q_u8(b + i));
+                vst1q_u8(b + i, va);
+            }
+            scalar::Swap(a + i, b + i, n - i);
+        }
+
+        inline void Bilinear4(const std::uint8_t *src, std::size_t stride, std::int64_t u, std::int64_t v, std::int64_t du, std::int64_t dv, std::size_t n, std::uint8_t *dst)
+        {
+            // One pixel per step with its channels side by side
+            for (std::size_t i = 0; i < n; i++, u += du, v += dv)
+            {
+                const std::uint8_t *top = src + static_cast<std::size_t>(v >> 16) * stride + static_cast<std::size_t>(u >> 16) * 4;
+                const std::uint16_t fx = static_cast<std::uint16_t>((u >> 9) & 127);
+                const std::uint16_t fy = static_cast<std::uint16_t>((v >> 9) & 127);
+
+                const uint16x8_t upper = vmovl_u8(vld1_u8(top));
+                const uint16x8_t lower = vmovl_u8(vld1_u8(top + stride));
+                const uint16x4_t h0 = vmla_n_u16(vmul_n_u16(vget_low_u16(upper), 128 - fx), vget_high_u16(upper), fx);
+                const uint16x4_t h1 = vmla_n_u16(vmul_n_u16(vget_low_u16(lower), 128 - fx), vget_high_u16(lower), fx);
+                const uint16x4_t sum = vrshrn_n_u32(vmlal_n_u16(vmull_n_u16(h0, 128 - fy), h1, fy), 14);
+                const uint8x8_t packed = vmovn_u16(vcombine_u16(sum, sum));
+                vst1_lane_u32(reinterpret_cast<std::uint32_t *>(dst + i * 4), vreinterpret_u32_u8(packed), 0);
+            }
+        }
+
+        // Rounds every 16-bit lane / 255 to nearest, exactly like scalar::Div255
+        inline uint16x8_t Div255(uint16x8_t x)
+        {
+            const uint16x8_t t = vaddq_u16(x, vdupq_n_u16(128));
+            return vshrq_n_u16(vsraq_n_u16(t, t, 8), 8);
+        }
+
+        inline uint16x8_t BlendLanes(uint16x8_t d, uint16x8_t src, uint16x8_t a, uint16x8_t ia, BlendMode mode)
+        {
+            const uint16x8_t s = Div255(vmulq_u16(src, a));
+            switch (mode)
+            {
+            case BlendMode::Over:
+                return Div255(vmlaq_u16(vmulq_u16(src, a), d, ia));
+            case BlendMode::Add:
+                return vaddq_u16(d, s);
+            case BlendMode::Multiply:
+                return Div255(vmulq_u16(d, vaddq_u16(ia, s)));
+            default:
+                return vsubq_u16(vaddq_u16(d, s), Div255(vmulq_u16(d, s)));
+            }
+        }
+
+        inline void Blend(std::uint8_t *dst, const std::uint8_t *src, std::size_t n, std::uint8_t alpha, BlendMode mode)
+        {
+            if (mode == BlendMode::Replace)
+            {
+                std::memcpy(dst, src, n);
+                return;
+            }
+
+            const uint16x8_t a = vdupq_n_u16(alpha);
+            const uint16x8_t ia = vdupq_n_u16(static_cast<std::uint16_t>(255 - alpha));
+            std::size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+            {
+                const uint8x16_t d = vld1q_u8(dst + i);
+                const uint8x16_t s = vld1q_u8(src + i);
+                const uint16x8_t lo = BlendLanes(vmovl_u8(vget_low_u8(d)), vmovl_u8(vget_low_u8(s)), a, ia, mode);
+                const uint16x8_t hi = BlendLanes(vmovl_u8(vget_high_u8(d)), vmovl_u8(vget_high_u8(s)), a, ia, mode);
+                vst1q_u8(dst + i, vcombine_u8(vqmovn_u16(lo), vqmovn_u16(hi)));
+            }
+            scalar::Blend(dst + i, src + i, n - i, alpha, mode);
+        }
+
+        inline void Random(std::uint8_t *dst, std::size_t n, std::uint64_t key, std::uint32_t counter)
+        {
+            const uint32x4_t step = vdupq_n_u32(scalar::kRandomStep * 4);
+            const uint32x4_t lo = vdupq_n_u32(static_cast<std::uint32_t>(key)), hi = vdupq_n_u32(static_cast<std::uint32_t>(key >> 32));
+            const std::uint32_t lanes[4] = {0, 1, 2, 3};
+            uint32x4_t weyl = vmulq_n_u32(vaddq_u32(vdupq_n_u32(counter), vld1q_u32(lanes)), scalar::kRandomStep);
+            std::size_t i = 0;
+            for (; i + 16 <= n; i += 16, counter += 4)
+            {
+                uint32x4_t x = veorq_u32(vaddq_u32(weyl, lo), hi);
+                x = vmulq_n_u32(veorq_u32(x, vshrq_n_u32(x, 16)), scalar::kRandomMul1);
+                x = vmulq_n_u32(veorq_u32(x, vshrq_n_u32(x, 15)), scalar::kRandomMul2);
+                vst1q_u8(dst + i, vreinterpretq_u8_u32(veorq_u32(x, vshrq_n_u32(x, 16))));
+                weyl = vaddq_u32(weyl, step);
+            }
+            scalar::Random(dst + i, n - i, key, counter);
+        }
+
+        inline void Convolve(std::uint8_t *dst, const std::uint8_t *const *rows, const std::int16_t *weights, std::size_t taps, std::size_t n)
+        {
+            const int32x4_t round = vdupq_n_s32(1 << (scalar::kWeightBits - 1));
+            std::size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+            {
+                int32x4_t sum[4] = {round, round, round, round};
+                for (std::size_t k = 0; k < taps; k++)
+                {
+                    const uint8x16_t a = vld1q_u8(rows[k] + i);
+                    const int16x8_t lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(a))), hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(a)));
+                    sum[0] = vmlal_n_s16(sum[0], vget_low_s16(lo), weights[k]);
+                    sum[1] = vmlal_n_s16(sum[1], vget_high_s16(lo), weights[k]);
+                    sum[2] = vmlal_n_s16(sum[2], vget_low_s16(hi), weights[k]);
+                    sum[3] = vmlal_n_s16(sum[3], vget_high_s16(hi), weights[k]);
+                }
+                const int16x8_t lo = vcombine_s16(vqshrn_n_s32(sum[0], scalar::kWeightBits), vqshrn_n_s32(sum[1], scalar::kWeightBits));
+                const int16x8_t hi = vcombine_s16(vqshrn_n_s32(sum[2], scalar::kWeightBits), vqshrn_n_s32(sum[3], scalar::kWeightBits));
+                vst1q_u8(dst + i, vcombine_u8(vqmovun_s16(lo), vqmovun_s16(hi)));
+            }
+            scalar::ConvolveTail(dst, rows, weights, taps, i, n);
+        }
+
+        inline void BoxColumns(std::uint32_t *sums, const std::uint8_t *enter, const std::uint8_t *leave, std::uint32_t scale, std::uint8_t *dst, std::size_t n)
+        {
+            const uint32x4_t round = vdupq_n_u32(1u << (scalar::kBoxBits - 1));
+            std::size_t i = 0;
+            for (; i + 8 <= n; i += 8)
+            {
+                const uint16x8_t e = vmovl_u8(vld1_u8(enter + i)), l = vmovl_u8(vld1_u8(leave + i));
+                const uint32x4_t lo = vaddq_u32(vld1q_u32(sums + i), vmovl_u16(vget_low_u16(e))), hi = vaddq_u32(vld1q_u32(sums + i + 4), vmovl_u16(vget_high_u16(e)));
+                const uint16x4_t average_lo = vmovn_u32(vshrq_n_u32(vmlaq_n_u32(round, lo, scale), scalar::kBoxBits));
+                const uint16x4_t average_hi = vmovn_u32(vshrq_n_u32(vmlaq_n_u32(round, hi, scale), scalar::kBoxBits));
+                vst1q_u32(sums + i, vsubq_u32(lo, vmovl_u16(vget_low_u16(l))));
+                vst1q_u32(sums + i + 4, vsubq_u32(hi, vmovl_u16(vget_high_u16(l))));
+                vst1_u8(dst + i, vmovn_u16(vcombine_u16(average_lo, average_hi)));
+            }
+            scalar::BoxColumns(sums + i, enter + i, leave + i, scale, dst + i, n - i);
+        }
+
+        inline void BoxRow(const std::uint8_t *line, std::uint8_t *dst, std::size_t width, std::size_t radius, std::uint32_t scale)
+        {
+            // One pixel per step, its four channels in the lanes of one vector
+            const uint32x4_t round = vdupq_n_u32(1u << (scalar::kBoxBits - 1));
+            const auto load = [](const std::uint8_t *p)
+            {
+                std::uint32_t v;
+                std::memcpy(&v, p, 4);
+                return vmovl_u16(vget_low_u16(vmovl_u8(vcreate_u8(v))));
+            };
+            uint32x4_t sums = vdupq_n_u32(0);
+            for (std::size_t i = 0; i < 2 * radius; i++)
+                sums = vaddq_u32(sums, load(line + i * 4));
+            for (std::size_t x = 0; x < width; x++)
+            {
+                sums = vaddq_u32(sums, load(line + (x + 2 * radius) * 4));
+                const uint16x4_t average = vmovn_u32(vshrq_n_u32(vmlaq_n_u32(round, sums, scale), scalar::kBoxBits));
+                const std::uint32_t packed = vget_lane_u32(vreinterpret_u32_u8(vmovn_u16(vcombine_u16(average, average))), 0);
+                std::memcpy(dst + x * 4, &packed, 4);
+                sums = vsubq_u32(sums, load(line + x * 4));
+            }
+        }
+
+        inline void Resample(std::uint8_t *dst, const std::uint8_t *src, const std::int32_t *starts, const std::int16_t *weights, std::size_t taps, std::size_t n)
+        {
+            const int32x4_t round = vdupq_n_s32(1 << (scalar::kWeightBits - 1));
+            for (std::size_t i = 0; i < n; i++, weights += taps)
+            {
+                // The four channels of a pixel in the lanes of one vector
+                const std::uint8_t *pixels = src + static_cast<std::size_t>(starts[i]) * 4;
+                int32x4_t sum = round;
+                for (std::size_t k = 0; k < taps; k++)
+                {
+                    std::uint32_t pixel;
+                    std::memcpy(&pixel, pixels + k * 4, 4);
+                    const int16x4_t channels = vreinterpret_s16_u16(vget_low_u16(vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(pixel)))));
+                    sum = vmlal_n_s16(sum, channels, weights[k]);
+                }
+                const int16x4_t words = vqshrn_n_s32(sum, scalar::kWeightBits);
+                const std::uint32_t packed = vget_lane_u32(vreinterpret_u32_u8(vqmovun_s16(vcombine_s16(words, words))), 0);
+                std::memcpy(dst + i * 4, &packed, 4);
+            }
+        }
+    }
+#endif
+
+#if defined(BMPR_X86)
+    // Returns true if the running CPU and OS support isa
+    inline bool CpuSupports(Isa isa)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        switch (isa)
+        {
+        case Isa::SSE2:
+            return __builtin_cpu_supports("sse2");
+        case Isa::SSSE3:
+            return __builtin_cpu_supports("ssse3");
+        case Isa::AVX2:
+            return __builtin_cpu_supports("avx2");
+        default:
+            return false;
+        }
+#elif defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+        const bool sse2 = (info[3] & (1 << 26)) != 0;
+        const bool ssse3 = (info[2] & (1 << 9)) != 0;
+        const bool os_saves_ymm = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+        __cpuidex(info, 7, 0);
+        const bool avx2 = os_saves_ymm && (info[1] & (1 << 5)) != 0;
+        switch (isa)
+        {
+        case Isa::SSE2:
+            return sse2;
+        case Isa::SSSE3:
+            return ssse3;
+        case Isa::AVX2:
+            return avx2;
+        default:
+            return false;
+        }
+#else
+        return isa == Isa::SSE2 && sizeof(void *) == 8;
+#endif
+    }
+#endif
+
+    // Builds the kernel table for the running CPU
+    inline KernelTable Detect()
+    {
+        KernelTable table;
+        table.invert = scalar::Invert;
+        table.fill3 = scalar::Fill3;
+        table.fill4 = scalar::Fill4;
+        table.swizzle3 = scalar::Swizzle3;
+        table.swizzle4to3 = scalar::Swizzle4To3;
+        table.swizzle3to4 = scalar::Swizzle3To4;
+        table.reverse3 = scalar::Reverse3;
+        table.reverse4 = scalar::Reverse4;
+        table.reverse1 = scalar::Reverse1;
+        table.swap = scalar::Swap;
+        table.bilinear4 = scalar::Bilinear4;
+        table.blend = scalar::Blend;
+        table.random = scalar::Random;
+        table.convolve = scalar::Convolve;
+        table.box_columns = scalar::BoxColumns;
+        table.box_row = scalar::BoxRow;
+        table.resample = scalar::Resample;
+
+#if !defined(BMPR_NO_SIMD)
+#if defined(BMPR_X86)
+        if (CpuSupports(Isa::SSE2))
+        {
+            table.isa = Isa::SSE2;
+            table.invert = sse2::Invert;
+            table.fill3 = sse2::Fill3;
+            table.fill4 = sse2::Fill4;
+            table.reverse4 = sse2::Reverse4;
+            table.swap = sse2::Swap;
+            table.bilinear4 = sse2::Bilinear4;
+            table.blend = sse2::Blend;
+            table.random = sse2::Random;
+            table.convolve = sse2::Convolve;
+            table.box_columns = sse2::BoxColumns;
+            table.box_row = sse2::BoxRow;
+            table.resample = sse2::Resample;
+        }
+        if (CpuSupports(Isa::SSSE3))
+        {
+            table.isa = Isa::SSSE3;
+            table.swizzle3 = ssse3::Swizzle3;
+            table.swizzle4to3 = ssse3::Swizzle4To3;
+            table.swizzle3to4 = ssse3::Swizzle3To4;
+            table.reverse3 = ssse3::Reverse3;
+            table.reverse1 = ssse3::Reverse1;
+        }
+        if (CpuSupports(Isa::AVX2))
+        {
+            table.isa = Isa::AVX2;
+            table.invert = avx2::Invert;
+            table.fill3 = avx2::Fill3;
+            table.fill4 = avx2::Fill4;
+            table.swizzle3 = avx2::Swizzle3;
+            table.swizzle4to3 = avx2::Swizzle4To3;
+            table.swap = avx2::Swap;
+            table.blend = avx2::Blend;
+            table.random = avx2::Random;
+            table.convolve = avx2::Convolve;
+            table.box_columns = avx2::BoxColumns;
+        }
+#elif defined(BMPR_NEON)
+        table.isa = Isa::NEON;
+        table.invert = neon::Invert;
+        table.fill3 = neon::Fill3;
+        table.fill4 = neon::Fill4;
+        table.swizzle3 = neon::Swizzle3;
+        table.swizzle4to3 = neon::Swizzle4To3;
+        table.swizzle3to4 = neon::Swizzle3To4;
+        table.reverse3 = neon::Reverse3;
+        table.reverse4 = neon::Reverse4;
+        table.reverse1 = neon::Reverse1;
+        table.swap = neon::Swap;
+        table.bilinear4 = neon::Bilinear4;
+        table.blend = neon::Blend;
+        table.random = neon::Random;
+        table.convolve = neon::Convolve;
+        table.box_columns = neon::BoxColumns;
+        table.box_row = neon::BoxRow;
+        table.resample = neon::Resample;
+#endif
+#endif
+        return table;
+    }
+
+    inline const KernelTable &Active()
+    {
+        static const KernelTable table = Detect();
+        return table;
+    }
+}
+
+// Row helpers, overloaded for every row type returned by RowPtr
+namespace bmpr::detail
+{
+    // Clamps a 64-bit coordinate to the 32-bit range
+    inline std::int32_t ClampCoord(std::int64_t v)
+    {
+        return static_cast<std::int32_t>(std::clamp<std::int64_t>(v, INT32_MIN, INT32_MAX));
+    }
+
+    // Rounds to the nearest 32-bit coordinate
+    inline std::int32_t RoundCoord(double v)
+    {
+        return static_cast<std::int32_t>(std::floor(std::clamp<double>(v, INT32_MIN, INT32_MAX) + 0.5));
+    }
+
+    // Builds a rectangle from 64-bit edges, clamped to the 32-bit coordinate range
+    inline Rect ClampedRect(std::int64_t x0, std::int64_t y0, std::int64_t x1, std::int64_t y1)
+    {
+        return {ClampCoord(x0), ClampCoord(y0), ClampCoord(x1), ClampCoord(y1)};
+    }
+
+    // Bounds of a set of points, inclusive of the last pixel and grown by pad on every side
+    inline Rect PointBounds(std::initializer_list<std::int64_t> xs, std::initializer_list<std::int64_t> ys, std::int64_t pad = 0)
+    {
+        return ClampedRect(std::min(xs) - pad, std::min(ys) - pad, std::max(xs) + 1 + pad, std::max(ys) + 1 + pad);
+    }
+
+    // Returns the first pixel whose center x + 0.5 is at v or after it, clamped to the 32-bit coordinate range
+    inline std::int32_t CenterCoord(double v)
+    {
+        return static_cast<std::int32_t>(std::clamp<double>(std::ceil(v - 0.5), INT32_MIN, INT32_MAX));
+    }
+
+    // Every pixel a filled polygon through points can touch
+    inline Rect PolygonBounds(std::span<const Vector2> points)
+    {
+        std::int64_t x0 = INT64_MAX, y0 = INT64_MAX, x1 = INT64_MIN, y1 = INT64_MIN;
+        for (const Vector2 &point : points)
+        {
+            x0 = std::min<std::int64_t>(x0, point.x);
+            y0 = std::min<std::int64_t>(y0, point.y);
+            x1 = std::max<std::int64_t>(x1, point.x);
+            y1 = std::max<std::int64_t>(y1, point.y);
+        }
+        return points.empty() ? Rect{} : ClampedRect(x0, y0, x1 + 1, y1 + 1);
+    }
+
+    // Non-horizontal polygon edge, crossing the centers of rows [first;last) of the clip rectangle
+    struct PolygonEdge
+    {
+        double x, y, dxdy;
+        std::int32_t first, last;
+        // +1 for edges going down, -1 for edges going up
+        std::int32_t winding;
+
+        // Builds the edge from a to b clipped to rows [y0;y1), returns false if it crosses no row center there
+        static bool Make(const Vector2 &a, const Vector2 &b, std::int32_t y0, std::int32_t y1, PolygonEdge &edge)
+        {
+            if (a.y == b.y)
+                return false;
+            const bool down = a.y < b.y;
+            const Vector2 &top = down ? a : b, &bottom = down ? b : a;
+            // Computed from the top end whichever way the edge runs, so neighbouring shapes see the same crossings
+            edge = {static_cast<double>(top.x), static_cast<double>(top.y), (static_cast<double>(bottom.x) - top.x) / (static_cast<double>(bottom.y) - top.y),
+                    std::max(CenterCoord(top.y), y0), std::min(CenterCoord(bottom.y), y1), down ? 1 : -1};
+            return edge.first < edge.last;
+        }
+
+        // Returns the x the edge crosses the center of row row at
+        double X(std::int32_t row) const { return x + (row + 0.5 - y) * dxdy; }
+    };
+
+    // Buffers for the edge table of polygons, kept per thread so filling allocates only while they grow
+    struct PolygonScratch
+    {
+        std::vector<PolygonEdge> edges;
+        std::vector<std::uint32_t> active;
+        // Where the active edges cross the current row, and their winding
+        std::vector<std::pair<double, std::int32_t>> crossings;
+
+        static PolygonScratch &Get()
+        {
+            static thread_local PolygonScratch scratch;
+            return scratch;
+        }
+    };
+
+    // Returns the multiplier turning the sum of a window of 2 * radius + 1 bytes into their average for the box kernels
+    inline std::uint32_t BoxScale(std::int32_t radius)
+    {
+        const std::uint32_t size = 2 * static_cast<std::uint32_t>(radius) + 1;
+        return ((1u << kernels::scalar::kBoxBits) + size / 2) / size;
+    }
+
+    // Rounds kernel to weights with the fraction bits of kernels::Convolve, giving the rounding error of their sum to the
+    // center weight so flat areas stay flat. Returns false if kernel has an even number of weights, more than 255 or one
+    // that doesn't fit
+    inline bool QuantizeKernel(std::span<const float> kernel, std::vector<std::int16_t> &weights)
+    {
+        if (kernel.size() % 2 == 0 || kernel.size() > 255)
+            return false;
+
+        constexpr double one = 1 << kernels::scalar::kWeightBits;
+        weights.resize(kernel.size());
+        double sum = 0.0;
+        std::int64_t total = 0;
+        for (std::size_t i = 0; i < kernel.size(); ++i)
+        {
+            if (!(std::abs(kernel[i]) < 2.0f))
+                return false;
+            const std::int64_t weight = std::llround(kernel[i] * one);
+            weights[i] = static_cast<std::int16_t>(std::clamp<std::int64_t>(weight, INT16_MIN, INT16_MAX));
+            sum += kernel[i];
+            total += weights[i];
+        }
+        const std::int64_t center = weights[kernel.size() / 2] + std::llround(sum * one) - total;
+        if (center < INT16_MIN || center > INT16_MAX)
+            return false;
+        weights[kernel.size() / 2] = static_cast<std::int16_t>(center);
+        return true;
+    }
+
+    // Integer division rounding down, for a positive divisor
+    inline std::int64_t FloorDiv(std::int64_t a, std::int64_t b)
+    {
+        return a / b - (a % b < 0 ? 1 : 0);
+    }
+
+    // Integer division rounding up, for a positive divisor
+    inline std::int64_t CeilDiv(std::int64_t a, std::int64_t b)
+    {
+        return a / b + (a % b > 0 ? 1 : 0);
+    }
+
+    // PixelTraits of the pixels in rows of type Row. Planar rows store three channels, without alpha
+    template <typename Row>
+    struct RowTraits;
+
+    template <typename PixelT>
+    struct RowTraits<PixelT *> : PixelTraits<std::remove_const_t<PixelT>>
+    {
+    };
+
+    template <>
+    struct RowTraits<PlanarRow>
+    {
+        static constexpr bool kAlpha = false;
+        static constexpr Encoding kEncoding = Encoding::BGR24;
+    };
+
+    template <typename PixelT>
+    void StorePixel(PixelT *row, std::size_t x, const Color &color)
+    {
+        row[x] = PixelT(color);
+    }
+
+    inline void StorePixel(PlanarRow row, std::size_t x, const Color &color)
+    {
+        row.r[x] = color.r;
+        row.g[x] = color.g;
+        row.b[x] = color.b;
+    }
+
+    template <typename PixelT>
+    std::uint8_t *Bytes(PixelT *row)
+    {
+        return reinterpret_cast<std::uint8_t *>(row);
+    }
+
+    template <typename PixelT>
+    const std::uint8_t *Bytes(const PixelT *row)
+    {
+        return reinterpret_cast<const std::uint8_t *>(row);
+    }
+
+    template <typename PixelT>
+    void FillRow(PixelT *row, std::size_t x0, std::size_t x1, const Color &color)
+    {
+        const PixelT pixel(color);
+        if constexpr (PixelTraits<PixelT>::kBytes == 1)
+            std::memset(Bytes(row + x0), *Bytes(&pixel), x1 - x0);
+        else if constexpr (PixelTraits<PixelT>::kBytes == 3)
+            kernels::Fill3(Bytes(row + x0), x1 - x0, Bytes(&pixel));
+        else
+        {
+            std::uint32_t pattern;
+            std::memcpy(&pattern, &pixel, sizeof(pattern));
+            kernels::Fill4(Bytes(row + x0), x1 - x0, pattern);
+        }
+    }
+
+    inline void FillRow(PlanarRow row, std::size_t x0, std::size_t x1, const Color &color)
+    {
+        std::memset(row.r + x0, color.r, x1 - x0);
+        std::memset(row.g + x0, color.g, x1 - x0);
+        std::memset(row.b + x0, color.b, x1 - x0);
+    }
+
+    // A draw color prepared for one row layout, stored as is when it covers the pixels completely and blended otherwise
+    struct Paint
+    {
+        Color color;
+        std::uint8_t alpha;
+        BlendMode mode;
+        // The color replaces the pixels, nothing to blend
+        bool store;
+        // Whole pixels of the color laid out like the row, 32 bytes per channel for planar rows. The alpha byte of pixels
+        // with alpha holds 255, blending alpha like the colors, or with Replace the alpha of the color
+        alignas(32) std::uint8_t pattern[96];
+    };
+
+    // Prepares color for drawing with mode into rows of type Row
+    template <typename Row>
+    Paint MakePaint(const ColorRGBA &color, BlendMode mode)
+    {
+        Paint paint;
+        paint.color = color;
+        paint.alpha = color.a;
+        paint.mode = mode;
+        paint.store = mode == BlendMode::Replace || (mode == BlendMode::Over && color.a == 255);
+
+        // Partly covered pixels of anti-aliased shapes blend even a stored color
+        if constexpr (std::is_same_v<Row, PlanarRow>)
+        {
+            const std::uint8_t rgb[3] = {color.r, color.g, color.b};
+            for (std::size_t i = 0; i < sizeof(paint.pattern); i++)
+                paint.pattern[i] = rgb[i / 32];
+        }
+        else
+        {
+            using PixelT = std::remove_pointer_t<Row>;
+            PixelT pixel{Color(color)};
+            if constexpr (PixelTraits<PixelT>::kAlpha)
+                pixel.a = mode == BlendMode::Replace ? color.a : 255;
+            for (std::size_t i = 0; i < sizeof(paint.pattern); i++)
+                paint.pattern[i] = Bytes(&pixel)[i % sizeof(PixelT)];
+        }
+        return paint;
+    }
+
+    // Blends the first period bytes of pattern over n bytes of dst, over and over
+    inline void BlendPattern(std::uint8_t *dst, std::size_t n, const std::uint8_t *pattern, std::size_t period, const Paint &paint)
+    {
+        for (std::size_t i = 0; i < n; i += period)
+            kernels::Blend(dst + i, pattern, std::min(period, n - i), paint.alpha, paint.mode);
+    }
+
+    // Blends paint over the pixels [x0;x1) of row. The pattern holds a whole number of pixels of every size
+    template <typename PixelT>
+    void BlendRow(PixelT *row, std::size_t x0, std::size_t x1, const Paint &paint)
+    {
+        BlendPattern(Bytes(row + x0), (x1 - x0) * PixelTraits<PixelT>::kBytes, paint.pattern, sizeof(paint.pattern), paint);
+    }
+
+    inline void BlendRow(PlanarRow row, std::size_t x0, std::size_t x1, const Paint &paint)
+    {
+        BlendPattern(row.r + x0, x1 - x0, paint.pattern, 32, paint);
+        BlendPattern(row.g + x0, x1 - x0, paint.pattern + 32, 32, paint);
+        BlendPattern(row.b + x0, x1 - x0, paint.pattern + 64, 32, paint);
+    }
+
+    // Blends paint over pixel x of row with alpha in place of the paint's own
+    template <typename PixelT>
+    void BlendPixel(PixelT *row, std::size_t x, const Paint &paint, std::uint8_t alpha)
+    {
+        kernels::Blend(Bytes(row + x), paint.pattern, PixelTraits<PixelT>::kBytes, alpha, paint.mode);
+    }
+
+    inline void BlendPixel(PlanarRow row, std::size_t x, const Paint &paint, std::uint8_t alpha)
+    {
+        kernels::Blend(row.r + x, paint.pattern, 1, alpha, paint.mode);
+        kernels::Blend(row.g + x, paint.pattern + 32, 1, alpha, paint.mode);
+        kernels::Blend(row.b + x, paint.pattern + 64, 1, alpha, paint.mode);
+    }
+
+    // Converts a coverage from 0 to 1 to 0 to 255
+    inline std::uint8_t CoverageByte(double coverage)
+    {
+        return static_cast<std::uint8_t>(std::lround(std::clamp(coverage, 0.0, 1.0) * 255.0));
+    }
+
+    // The printable ASCII characters from ' ' to '~' in 5x7 pixels, one byte per column with the top row in the lowest bit
+    inline constexpr std::uint8_t kFont[95][5] = {
+        {0x00, 0x00, 0x00, 0x00, 0x00}, {0x00, 0x00, 0x5F, 0x00, 0x00}, {0x00, 0x07, 0x00, 0x07, 0x00}, {0x14, 0x7F, 0x14, 0x7F, 0x14}, {0x24, 0x2A, 0x7F, 0x2A, 0x12}, {0x23, 0x13, 0x08, 0x64, 0x62}, // space ! " # $ %
+        {0x36, 0x49, 0x55, 0x22, 0x50}, {0x00, 0x05, 0x03, 0x00, 0x00}, {0x00, 0x1C, 0x22, 0x41, 0x00}, {0x00, 0x41, 0x22, 0x1C, 0x00}, {0x14, 0x08, 0x3E, 0x08, 0x14}, {0x08, 0x08, 0x3E, 0x08, 0x08}, // & ' ( ) * +
+        {0x00, 0x50, 0x30, 0x00, 0x00}, {0x08, 0x08, 0x08, 0x08, 0x08}, {0x00, 0x60, 0x60, 0x00, 0x00}, {0x20, 0x10, 0x08, 0x04, 0x02}, {0x3E, 0x51, 0x49, 0x45, 0x3E}, {0x00, 0x42, 0x7F, 0x40, 0x00}, // , - . / 0 1
+        {0x42, 0x61, 0x51, 0x49, 0x46}, {0x21, 0x41, 0x45, 0x4B, 0x31}, {0x18, 0x14, 0x12, 0x7F, 0x10}, {0x27, 0x45, 0x45, 0x45, 0x39}, {0x3C, 0x4A, 0x49, 0x49, 0x30}, {0x01, 0x71, 0x09, 0x05, 0x03}, // 2 3 4 5 6 7
+        {0x36, 0x49, 0x49, 0x49, 0x36}, {0x06, 0x49, 0x49, 0x29, 0x1E}, {0x00, 0x36, 0x36, 0x00, 0x00}, {0x00, 0x56, 0x36, 0x00, 0x00}, {0x08, 0x14, 0x22, 0x41, 0x00}, {0x14, 0x14, 0x14, 0x14, 0x14}, // 8 9 : ; < =
+        {0x00, 0x41, 0x22, 0x14, 0x08}, {0x02, 0x01, 0x51, 0x09, 0x06}, {0x32, 0x49, 0x79, 0x41, 0x3E}, {0x7E, 0x11, 0x11, 0x11, 0x7E}, {0x7F, 0x49, 0x49, 0x49, 0x36}, {0x3E, 0x41, 0x41, 0x41, 0x22}, // > ? @ A B C
+        {0x7F, 0x41, 0x41, 0x22, 0x1C}, {0x7F, 0x49, 0x49, 0x49, 0x41}, {0x7F, 0x09, 0x09, 0x09, 0x01}, {0x3E, 0x41, 0x49, 0x49, 0x7A}, {0x7F, 0x08, 0x08, 0x08, 0x7F}, {0x00, 0x41, 0x7F, 0x41, 0x00}, // D E F G H I
+        {0x20, 0x40, 0x41, 0x3F, 0x01}, {0x7F, 0x08, 0x14, 0x22, 0x41}, {0x7F, 0x40, 0x40, 0x40, 0x40}, {0x7F, 0x02, 0x0C, 0x02, 0x7F}, {0x7F, 0x04, 0x08, 0x10, 0x7F}, {0x3E, 0x41, 0x41, 0x41, 0x3E}, // J K L M N O
+        {0x7F, 0x09, 0x09, 0x09, 0x06}, {0x3E, 0x41, 0x51, 0x21, 0x5E}, {0x7F, 0x09, 0x19, 0x29, 0x46}, {0x46, 0x49, 0x49, 0x49, 0x31}, {0x01, 0x01, 0x7F, 0x01, 0x01}, {0x3F, 0x40, 0x40, 0x40, 0x3F}, // P Q R S T U
+        {0x1F, 0x20, 0x40, 0x20, 0x1F}, {0x3F, 0x40, 0x38, 0x40, 0x3F}, {0x63, 0x14, 0x08, 0x14, 0x63}, {0x07, 0x08, 0x70, 0x08, 0x07}, {0x61, 0x51, 0x49, 0x45, 0x43}, {0x00, 0x7F, 0x41, 0x41, 0x00}, // V W X Y Z [
+        {0x02, 0x04, 0x08, 0x10, 0x20}, {0x00, 0x41, 0x41, 0x7F, 0x00}, {0x04, 0x02, 0x01, 0x02, 0x04}, {0x40, 0x40, 0x40, 0x40, 0x40}, {0x00, 0x01, 0x02, 0x04, 0x00}, {0x20, 0x54, 0x54, 0x54, 0x78}, // \ ] ^ _ ` a
+        {0x7F, 0x48, 0x44, 0x44, 0x38}, {0x38, 0x44, 0x44, 0x44, 0x20}, {0x38, 0x44, 0x44, 0x48, 0x7F}, {0x38, 0x54, 0x54, 0x54, 0x18}, {0x08, 0x7E, 0x09, 0x01, 0x02}, {0x0C, 0x52, 0x52, 0x52, 0x3E}, // b c d e f g
+        {0x7F, 0x08, 0x04, 0x04, 0x78}, {0x00, 0x44, 0x7D, 0x40, 0x00}, {0x20, 0x40, 0x44, 0x3D, 0x00}, {0x7F, 0x10, 0x28, 0x44, 0x00}, {0x00, 0x41, 0x7F, 0x40, 0x00}, {0x7C, 0x04, 0x18, 0x04, 0x78}, // h i j k l m
+        {0x7C, 0x08, 0x04, 0x04, 0x78}, {0x38, 0x44, 0x44, 0x44, 0x38}, {0x7C, 0x14, 0x14, 0x14, 0x08}, {0x08, 0x14, 0x14, 0x18, 0x7C}, {0x7C, 0x08, 0x04, 0x04, 0x08}, {0x48, 0x54, 0x54, 0x54, 0x20}, // n o p q r s
+        {0x04, 0x3F, 0x44, 0x40, 0x20}, {0x3C, 0x40, 0x40, 0x20, 0x7C}, {0x1C, 0x20, 0x40, 0x20, 0x1C}, {0x3C, 0x40, 0x30, 0x40, 0x3C}, {0x44, 0x28, 0x10, 0x28, 0x44}, {0x0C, 0x50, 0x50, 0x50, 0x3C}, // t u v w x y
+        {0x44, 0x64, 0x54, 0x4C, 0x44}, {0x00, 0x08, 0x36, 0x41, 0x00}, {0x00, 0x00, 0x7F, 0x00, 0x00}, {0x00, 0x41, 0x36, 0x08, 0x00}, {0x08, 0x04, 0x08, 0x10, 0x08}, // z { | } ~
+    };
+
+    // Font pixels of a character cell: the glyph with a column of spacing after it and a row below it
+    constexpr std::int32_t kFontColumns = 6, kFontRows = 8;
+
+    // Returns the index into kFont of the glyph drawn for c
+    inline std::size_t GlyphIndex(char c)
+    {
+        const auto code = static_cast<unsigned char>(c);
+        return code >= 0x20 && code < 0x7f ? code - 0x20u : '?' - 0x20u;
+    }
+
+    // Pixels [x0;x1) of a glyph row, every one of them covered by coverage / 255 of the glyph
+    struct GlyphRun
+    {
+        std::int32_t x0, x1;
+        std::uint8_t coverage;
+    };
+
+    // Coverage masks of every glyph at one text size, run-length coded per row. The runs of row y of glyph g are
+    // runs[rows[g * height + y]] up to runs[rows[g * height + y + 1]]
+    struct GlyphAtlas
+    {
+        std::int32_t width = 0, height = 0, advance = 0;
+        std::vector<std::uint32_t> rows;
+        std::vector<GlyphRun> runs;
+    };
+
+    // Rasterizes the font with cells size pixels high, every pixel covered by the area of the font pixels inside it
+    inline GlyphAtlas MakeGlyphAtlas(std::int32_t size)
+    {
+        const double scale = static_cast<double>(size) / kFontRows;
+        GlyphAtlas atlas;
+        atlas.width = static_cast<std::int32_t>(std::ceil(5 * scale));
+        atlas.height = static_cast<std::int32_t>(std::ceil(7 * scale));
+        atlas.advance = std::max<std::int32_t>(1, static_cast<std::int32_t>(std::lround(kFontColumns * scale)));
+
+        // Overlap of font pixel i with pixel p along either axis
+        const auto overlap = [&](std::int32_t i, std::int32_t p)
+        { return std::max(0.0, std::min((i + 1) * scale, p + 1.0) - std::max(i * scale, static_cast<double>(p))); };
+
+        atlas.rows.reserve(std::size(kFont) * static_cast<std::size_t>(atlas.height) + 1);
+        std::vector<std::uint8_t> mask(static_cast<std::size_t>(atlas.width));
+        for (const auto &glyph : kFont)
+            for (std::int32_t y = 0; y < atlas.height; ++y)
+            {
+                // Coverage of every font column within the row, then of the row's pixels
+                double columns[5] = {};
+                for (std::int32_t i = 0; i < 5; ++i)
+                    for (std::int32_t j = 0; j < 7; ++j)
+                        if (glyph[i] >> j & 1)
+                            columns[i] += overlap(j, y);
+                for (std::int32_t x = 0; x < atlas.width; ++x)
+                {
+                    double covered = 0.0;
+                    for (std::int32_t i = 0; i < 5; ++i)
+                        covered += columns[i] * overlap(i, x);
+                    mask[static_cast<std::size_t>(x)] = CoverageByte(covered);
+                }
+
+                atlas.rows.push_back(static_cast<std::uint32_t>(atlas.runs.size()));
+                for (std::int32_t x = 0; x < atlas.width;)
+                {
+                    const std::uint8_t coverage = mask[static_cast<std::size_t>(x)];
+                    std::int32_t end = x + 1;
+                    while (end < atlas.width && mask[static_cast<std::size_t>(end)] == coverage)
+                        ++end;
+                    if (coverage != 0)
+                        atlas.runs.push_back({x, end, coverage});
+                    x = end;
+                }
+            }
+        atlas.rows.push_back(static_cast<std::uint32_t>(atlas.runs.size()));
+        return atlas;
+    }
+
+    // Returns the atlas for text size, from 1 to kMaxTextSize. The first caller for a size builds it and publishes it
+    // with one compare-and-swap, so lookups are a single atomic load and never wait for a lock. Callers racing on a missing
+    // size each build one and all but the first discard theirs
+    inline const GlyphAtlas &GlyphAtlasFor(std::int32_t size)
+    {
+        struct Cache
+        {
+            std::atomic<const GlyphAtlas *> atlases[kMaxTextSize] = {};
+            ~Cache()
+            {
+                for (std::atomic<const GlyphAtlas *> &atlas : atlases)
+                    delete atlas.load(std::memory_order_acquire);
+            }
+        };
+        static Cache cache;
+
+        std::atomic<const GlyphAtlas *> &slot = cache.atlases[size - 1];
+        const GlyphAtlas *atlas = slot.load(std::memory_order_acquire);
+        if (atlas != nullptr)
+            return *atlas;
+
+        auto built = std::make_unique<const GlyphAtlas>(MakeGlyphAtlas(size));
+        if (slot.compare_exchange_strong(atlas, built.get(), std::memory_order_acq_rel, std::memory_order_acquire))
+            return *built.release();
+        return *atlas;
+    }
+
+    // Stores paint over pixel x of row, pixels with alpha taking it from the pattern
+    template <typename Row>
+    void StorePaint(Row row, std::size_t x, const Paint &paint)
+    {
+        if constexpr (RowTraits<Row>::kAlpha)
+            std::memcpy(Bytes(row + x), paint.pattern, RowTraits<Row>::kBytes);
+        else
+            StorePixel(row, x, paint.color);
+    }
+
+    // Returns the number of pixels of rows of type Row the pattern of a Paint holds
+    template <typename Row>
+    constexpr std::size_t PatternPixels()
+    {
+        if constexpr (std::is_same_v<Row, PlanarRow>)
+            return 32;
+        else
+            return sizeof(Paint::pattern) / RowTraits<Row>::kBytes;
+    }
+
+    // Copies the pattern of paint over the pixels [x0;x1) of row, at most PatternPixels of them
+    template <typename PixelT>
+    void StorePattern(PixelT *row, std::size_t x0, std::size_t x1, const Paint &paint)
+    {
+        std::memcpy(Bytes(row + x0), paint.pattern, (x1 - x0) * PixelTraits<PixelT>::kBytes);
+    }
+
+    inline void StorePattern(PlanarRow row, std::size_t x0, std::size_t x1, const Paint &paint)
+    {
+        std::memcpy(row.r + x0, paint.pattern, x1 - x0);
+        std::memcpy(row.g + x0, paint.pattern + 32, x1 - x0);
+        std::memcpy(row.b + x0, paint.pattern + 64, x1 - x0);
+    }
+
+    // Draws paint over the pixels [x0;x1) of row, storing or blending it. Spans the pattern holds are copied from it,
+    // short spans such as glyph runs and circle edges costing less than setting up a fill
+    template <typename Row>
+    void PaintRow(Row row, std::size_t x0, std::size_t x1, const Paint &paint)
+    {
+        if (!paint.store)
+            BlendRow(row, x0, x1, paint);
+        else if (x1 - x0 <= PatternPixels<Row>())
+            StorePattern(row, x0, x1, paint);
+        else if constexpr (RowTraits<Row>::kAlpha)
+        {
+            std::uint32_t pattern;
+            std::memcpy(&pattern, paint.pattern, sizeof(pattern));
+            kernels::Fill4(Bytes(row + x0), x1 - x0, pattern);
+        }
+        else
+            FillRow(row, x0, x1, paint.color);
+    }
+
+    // Blends n pixels of src, scaled by alpha, into dst of the same layout
+    template <typename PixelT>
+    void CompositeRow(PixelT *dst, const PixelT *src, std::size_t n, std::uint8_t alpha, BlendMode mode)
+    {
+        kernels::Blend(Bytes(dst), Bytes(src), n * sizeof(PixelT), alpha, mode);
+    }
+
+    inline void CompositeRow(PlanarRow dst, PlanarRow src, std::size_t n, std::uint8_t alpha, BlendMode mode)
+    {
+        kernels::Blend(dst.r, src.r, n, alpha, mode);
+        kernels::Blend(dst.g, src.g, n, alpha, mode);
+        kernels::Blend(dst.b, src.b, n, alpha, mode);
+    }
+
+    // Blends n 32-bit pixels of src whose fourth byte is alpha into dst, each scaled by its own alpha times opacity, so
+    // transparent pixels leave dst as it is. Runs of pixels with the same alpha blend as one span. The fourth byte of dst
+    // composites Porter-Duff over, whatever the mode, and Replace copies src alpha and all
+    inline void CompositeRowAlpha(std::uint8_t *dst, const std::uint8_t *src, std::size_t n, std::uint8_t opacity, BlendMode mode)
+    {
+        if (mode == BlendMode::Replace)
+        {
+            kernels::Blend(dst, src, n * 4, opacity, mode);
+            return;
+        }
+
+        constexpr std::size_t kRun = 64;
+        std::uint8_t covered[kRun];
+        for (std::size_t i = 0; i < n;)
+        {
+            const std::uint8_t source_alpha = src[i * 4 + 3];
+            std::size_t end = i + 1;
+            while (end < n && end - i < kRun && src[end * 4 + 3] == source_alpha)
+                ++end;
+
+            const std::uint32_t alpha = kernels::scalar::Div255(std::uint32_t{source_alpha} * opacity);
+            if (alpha != 0)
+            {
+                for (std::size_t x = i; x < end; ++x)
+                    covered[x - i] = static_cast<std::uint8_t>(alpha + kernels::scalar::Div255(dst[x * 4 + 3] * (255 - alpha)));
+                kernels::Blend(dst + i * 4, src + i * 4, (end - i) * 4, static_cast<std::uint8_t>(alpha), mode);
+                for (std::size_t x = i; x < end; ++x)
+                    dst[x * 4 + 3] = covered[x - i];
+            }
+            i = end;
+        }
+    }
+
+    // Returns row advanced by x pixels
+    template <typename PixelT>
+    PixelT *Offset(PixelT *row, std::int32_t x)
+    {
+        return row + x;
+    }
+
+    inline PlanarRow Offset(PlanarRow row, std::int32_t x)
+    {
+        return {row.r + x, row.g + x, row.b + x};
+    }
+
+    // Applies the flips target deferred with lazy orientation, for the image types that can defer them
+    template <typename Target>
+    void ApplyOrientation(Target &target)
+    {
+        if constexpr (requires { target.ApplyOrientation(); })
+            target.ApplyOrientation();
+    }
+
+    // Marks area of target as changed, for the image types that track changes
+    template <typename Target>
+    void MarkDirty(Target &target, const Rect &area)
+    {
+        if constexpr (requires { target.MarkDirty(area); })
+            target.MarkDirty(area);
+    }
+
+    // Returns the flips target deferred with lazy orientation
+    template <typename Target>
+    Orientation PendingOrientation(const Target &target)
+    {
+        if constexpr (requires { target.PendingOrientation(); })
+            return target.PendingOrientation();
+        else
+            return {};
+    }
+
+    // The padding byte of ColorX is inverted as well, it is never read back
+    template <typename PixelT>
+    void InvertRow(PixelT *row, std::size_t n)
+    {
+        kernels::Invert(Bytes(row), n * sizeof(PixelT));
+    }
+
+    // Leaves the alpha as is
+    inline void InvertRow(ColorRGBA *row, std::size_t n)
+    {
+        for (std::size_t x = 0; x < n; ++x)
+        {
+            std::uint32_t pixel;
+            std::memcpy(&pixel, Bytes(row + x), 4);
+            pixel ^= std::endian::native == std::endian::little ? 0x00ffffffu : 0xffffff00u;
+            std::memcpy(Bytes(row + x), &pixel, 4);
+        }
+    }
+
+    inline void InvertRow(PlanarRow row, std::size_t n)
+    {
+        kernels::Invert(row.r, n);
+        kernels::Invert(row.g, n);
+        kernels::Invert(row.b, n);
+    }
+
+    // Reverses n pixels of bytes_per_pixel 1, 3 or 4 in place
+    inline void ReversePixels(std::uint8_t *data, std::size_t n, std::size_t bytes_per_pixel)
+    {
+        if (bytes_per_pixel == 1)
+            kernels::Reverse1(data, n);
+        else if (bytes_per_pixel == 3)
+            kernels::Reverse3(data, n);
+        else
+            kernels::Reverse4(data, n);
+    }
+
+    template <typename PixelT>
+    void ReverseRow(PixelT *row, std::size_t n)
+    {
+        ReversePixels(Bytes(row), n, PixelTraits<PixelT>::kBytes);
+    }
+
+    inline void ReverseRow(PlanarRow row, std::size_t n)
+    {
+        kernels::Reverse1(row.r, n);
+        kernels::Reverse1(row.g, n);
+        kernels::Reverse1(row.b, n);
+    }
+
+    template <typename PixelT>
+    void SwapRows(PixelT *a, PixelT *b, std::size_t n)
+    {
+        kernels::Swap(Bytes(a), Bytes(b), n * sizeof(PixelT));
+    }
+
+    inline void SwapRows(PlanarRow a, PlanarRow b, std::size_t n)
+    {
+        kernels::Swap(a.r, b.r, n);
+        kernels::Swap(a.g, b.g, n);
+        kernels::Swap(a.b, b.b, n);
+    }
+
+    // Returns the size of a 24-bit BMP row, padded to a multiple of 4 bytes
+    inline std::size_t RowSize(std::int32_t width)
+    {
+        return static_cast<std::size_t>(width) * 3 + width % 4;
+    }
+
+    // Returns the size of a row of width pixels with bits_per_pixel, padded to a multiple of 4 bytes
+    inline std::size_t IndexedRowSize(std::int32_t width, std::uint16_t bits_per_pixel)
+    {
+        return (static_cast<std::size_t>(width) * bits_per_pixel + 31) / 32 * 4;
+    }
+
+    // Returns the header of a BMP whose colors table of palette_size entries is followed by bmp_size bytes of pixels.
+    // The size fields are 32 bits: files of 4 GiB or more get a file size of 0, and an image size of 0 too when the pixels
+    // don't fit, which uncompressed BMPs allow and readers replace with the size width and height give
+    inline Header MakeHeader(std::int32_t width, std::int32_t height, std::uint16_t bit_depth, std::uint32_t compression, std::uint32_t palette_size, std::uint64_t bmp_size)
+    {
+        const std::uint32_t data_offset = static_cast<std::uint32_t>(sizeof(Header) + palette_size * 4);
+        const std::uint64_t file_size = data_offset + bmp_size;
+        const auto field = [](std::uint64_t size)
+        { return size > UINT32_MAX ? 0u : static_cast<std::uint32_t>(size); };
+
+        return {0x4d42,                   // Signature ('BM')
+                field(file_size),         // File size in bytes
+                0,                        // reserved (unused)
+                data_offset,              // Offset from beginning of file to the beginning of the bitmap data
+                40,                       // Size of InfoHeader
+                width,                    // Horizontal width of bitmap in pixels
+                height,                   // Vertical height of bitmap in pixels
+                1,                        // Number of Planes
+                bit_depth,                // Bit-depth
+                compression,              // Compression (0 = none, 1 = RLE8, 2 = RLE4)
+                field(bmp_size),          // Size of Image
+                0,                        // Horizontal resolution: Pixels/meter
+                0,                        // Vertical resolution: Pixels/meter
+                palette_size,             // Colors used
+                0};                       // Number of important colors (0 = all)
+    }
+
+    // Returns the header of an uncompressed 24-bit BMP
+    inline Header MakeHeader(std::int32_t width, std::int32_t height)
+    {
+        return MakeHeader(width, height, 24, 0, 0, RowSize(width) * static_cast<std::size_t>(height));
+    }
+
+    // Returns the bits per pixel of the uncompressed encodings, 0 for the others
+    constexpr std::uint16_t BitDepth(Encoding encoding)
+    {
+        return encoding == Encoding::BGR24 ? 24 : encoding == Encoding::BGRA32 ? 32 : encoding == Encoding::Gray8 ? 8 : 0;
+    }
+
+    // Returns the header of an uncompressed BMP with encoding, 8-bit ones having a table of 256 grays
+    inline Header MakeHeader(std::int32_t width, std::int32_t height, Encoding encoding)
+    {
+        const std::uint16_t bit_depth = BitDepth(encoding);
+        return MakeHeader(width, height, bit_depth, 0, bit_depth == 8 ? 256 : 0, IndexedRowSize(width, bit_depth) * static_cast<std::size_t>(height));
+    }
+
+#if defined(BMPR_POSIX)
+    // Writes all n bytes to fd, retrying short writes
+    inline bool WriteAll(int fd, const std::uint8_t *data, std::size_t n)
+    {
+        while (n > 0)
+        {
+            const ssize_t written = ::write(fd, data, n);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+            data += written;
+            n -= static_cast<std::size_t>(written);
+        }
+        return true;
+    }
+
+    inline bool WriteAllAt(int fd, std::size_t offset, const std::uint8_t *data, std::size_t n)
+    {
+        while (n > 0)
+        {
+            const ssize_t written = ::pwrite(fd, data, n, static_cast<off_t>(offset));
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+            data += written;
+            offset += static_cast<std::size_t>(written);
+            n -= static_cast<std::size_t>(written);
+        }
+        return true;
+    }
+
+    // Gives fd size bytes of allocated disk space, so writes through a shared mapping of it can't fail on a full disk,
+    // where they would raise SIGBUS. Returns false where the space can't be allocated or the system can't promise it
+    inline bool AllocateFile(int fd, std::size_t size)
+    {
+#if defined(__APPLE__)
+        (void)fd;
+        (void)size;
+        return false;
+#else
+        int error;
+        do
+            error = ::posix_fallocate(fd, 0, static_cast<off_t>(size));
+        while (error == EINTR);
+        return error == 0;
+#endif
+    }
+#endif
+
+    // Read-only view of a whole file, memory-mapped where the platform allows it
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const std::string &path);
+        ~MappedFile();
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        bool IsOpen() const noexcept { return m_data != nullptr; }
+        const std::uint8_t *Data() const noexcept { return m_data; }
+        std::size_t Size() const noexcept { return m_size; }
+        // Asks the system to start reading the file in the background
+        void Prefetch() const noexcept;
+
+    private:
+        const std::uint8_t *m_data = nullptr;
+        std::size_t m_size = 0;
+#if defined(BMPR_POSIX)
+        void *m_map = nullptr;
+#else
+        std::vector<std::uint8_t> m_buffer;
+#endif
+    };
+
+    inline MappedFile::MappedFile(const std::string &path)
+    {
+#if defined(BMPR_POSIX)
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+
+        struct stat info;
+        if (::fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            const std::size_t size = static_cast<std::size_t>(info.st_size);
+            void *map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED)
+            {
+                ::madvise(map, size, MADV_SEQUENTIAL);
+                m_map = map;
+                m_data = static_cast<const std::uint8_t *>(map);
+                m_size = size;
+            }
+        }
+        ::close(fd);
+#else
+        if (std::ifstream ifs{path, std::ios_base::binary | std::ios_base::ate})
+        {
+            m_buffer.resize(static_cast<std::size_t>(ifs.tellg()));
+            ifs.seekg(0);
+            if (!m_buffer.empty() && ifs.read(reinterpret_cast<char *>(m_buffer.data()), static_cast<std::streamsize>(m_buffer.size())))
+            {
+                m_data = m_buffer.data();
+                m_size = m_buffer.size();
+            }
+        }
+#endif
+    }
+
+    inline MappedFile::~MappedFile()
+    {
+#if defined(BMPR_POSIX)
+        if (m_map)
+            ::munmap(m_map, m_size);
+#endif
+    }
+
+    inline void MappedFile::Prefetch() const noexcept
+    {
+#if defined(BMPR_POSIX)
+        if (m_map)
+            ::madvise(m_map, m_size, MADV_WILLNEED);
+#endif
+    }
+
+    // Writes size bytes to a new file at path, replacing any file there
+    inline bool WriteFile(const std::string &path, const std::uint8_t *data, std::size_t size)
+    {
+#if defined(BMPR_POSIX)
+        const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        const bool ok = WriteAll(fd, data, size);
+        return ::close(fd) == 0 && ok;
+#else
+        std::ofstream ofs{path, std::ios_base::binary};
+        ofs.write(reinterpret_cast<const char *>(data), static_cast<std::streamsize>(size));
+        return static_cast<bool>(ofs);
+#endif
+    }
+
+    // Layout of the pixel data of a BMP file this library can decode
+    struct BmpLayout
+    {
+        std::int32_t width = 0, height = 0;
+        bool top_down = false;
+        std::uint16_t bit_depth = 0;
+        std::size_t data_offset = 0, row_size = 0;
+        // Color table of 1, 4 and 8-bit files, palette_size BGRX entries at palette_offset
+        std::size_t palette_offset = 0, palette_size = 0;
+        // BI_RLE8 and BI_RLE4 pixels are data_size bytes of runs, their rows having no fixed row_size
+        bool rle = false;
+        std::size_t data_size = 0;
+    };
+
+    // Validates the header of a 1, 4, 8, 24 or 32-bit BMP file of file_size bytes whose first size bytes are at data,
+    // uncompressed or, for 8 and 4 bits, run-length encoded
+    inline std::optional<BmpLayout> ParseHeader(const std::uint8_t *data, std::size_t size, std::size_t file_size)
+    {
+        if (data == nullptr || size < sizeof(Header))
+            return std::nullopt;
+
+        Header header;
+        std::memcpy(&header, data, sizeof(header));
+
+        if (header.signature != 0x4d42 || header.info_header_size < 40 || header.planes != 1)
+            return std::nullopt;
+        if (header.bit_depth != 1 && header.bit_depth != 4 && header.bit_depth != 8 && header.bit_depth != 24 && header.bit_depth != 32)
+            return std::nullopt;
+        // BI_BITFIELDS is only accepted with the default BGRX masks, which every header version stores right after the first 40 info bytes
+        if (header.compression == 3)
+        {
+            std::uint32_t rgb[3];
+            if (header.bit_depth != 32 || size < sizeof(Header) + sizeof(rgb))
+                return std::nullopt;
+            std::memcpy(rgb, data + sizeof(Header), sizeof(rgb));
+            if (rgb[0] != 0x00ff0000 || rgb[1] != 0x0000ff00 || rgb[2] != 0x000000ff)
+                return std::nullopt;
+        }
+        else if (header.compression == 1 || header.compression == 2)
+        {
+            // Run-length encoded files are always stored bottom-up
+            if (header.bit_depth != (header.compression == 1 ? 8 : 4) || header.height < 0)
+                return std::nullopt;
+        }
+        else if (header.compression != 0)
+            return std::nullopt;
+        if (header.width <= 0 || header.height == 0 || header.height == INT32_MIN)
+            return std::nullopt;
+
+        BmpLayout layout;
+        layout.width = header.width;
+        layout.top_down = header.height < 0;
+        layout.height = layout.top_down ? -header.height : header.height;
+        layout.bit_depth = header.bit_depth;
+        layout.data_offset = header.data_offset;
+        layout.row_size = header.bit_depth == 32 ? static_cast<std::size_t>(layout.width) * 4 : IndexedRowSize(layout.width, header.bit_depth);
+
+        // The color table follows the info header, 0 colors used meaning all 2, 16 or 256
+        if (header.bit_depth <= 8)
+        {
+            const std::size_t colors = std::size_t{1} << header.bit_depth;
+            layout.palette_offset = 14 + static_cast<std::size_t>(header.info_header_size);
+            layout.palette_size = header.colors_used == 0 ? colors : header.colors_used;
+            if (layout.palette_size > colors || layout.palette_offset > layout.data_offset || (layout.data_offset - layout.palette_offset) / 4 < layout.palette_size)
+                return std::nullopt;
+        }
+
+        // Runs are decoded as far as the file goes, the pixels they don't reach being left at index 0
+        if (header.compression == 1 || header.compression == 2)
+        {
+            if (layout.data_offset > file_size)
+                return std::nullopt;
+            layout.rle = true;
+            layout.row_size = 0;
+            layout.data_size = file_size - layout.data_offset;
+            return layout;
+        }
+
+        const std::size_t pixel_bytes = layout.row_size * static_cast<std::size_t>(layout.height);
+        if (layout.data_offset > file_size || pixel_bytes / layout.row_size != static_cast<std::size_t>(layout.height) || file_size - layout.data_offset < pixel_bytes)
+            return std::nullopt;
+
+        return layout;
+    }
+
+    // Same as above for a whole file held in memory
+    inline std::optional<BmpLayout> ParseHeader(const std::uint8_t *data, std::size_t size)
+    {
+        return ParseHeader(data, size, size);
+    }
+
+    // Reads n 24-bit BGR pixels into row
+    template <typename PixelT>
+    void DecodeRowBGR(PixelT *row, std::size_t n, const std::uint8_t *in)
+    {
+        for (std::size_t x = 0; x < n; ++x, in += 3)
+            row[x] = PixelT(Color(in[2], in[1], in[0]));
+    }
+
+    inline void DecodeRowBGR(Color *row, std::size_t n, const std::uint8_t *in)
+    {
+        kernels::Swizzle3(in, Bytes(row), n);
+    }
+
+    inline void DecodeRowBGR(ColorX *row, std::size_t n, const std::uint8_t *in)
+    {
+        kernels::Swizzle3To4(in, Bytes(row), n);
+    }
+
+    inline void DecodeRowBGR(PlanarRow row, std::size_t n, const std::uint8_t *in)
+    {
+        for (std::size_t x = 0; x < n; ++x, in += 3)
+        {
+            row.b[x] = in[0];
+            row.g[x] = in[1];
+            row.r[x] = in[2];
+        }
+    }
+
+    // Reads n 32-bit BGRX pixels into row, the fourth byte being the alpha of pixels with alpha
+    template <typename PixelT>
+    void DecodeRowBGRX(PixelT *row, std::size_t n, const std::uint8_t *in)
+    {
+        for (std::size_t x = 0; x < n; ++x, in += 4)
+            row[x] = PixelT(Color(in[2], in[1], in[0]));
+    }
+
+    inline void DecodeRowBGRX(ColorRGBA *row, std::size_t n, const std::uint8_t *in)
+    {
+        for (std::size_t x = 0; x < n; ++x, in += 4)
+            row[x] = ColorRGBA(in[2], in[1], in[0], in[3]);
+    }
+
+    inline void DecodeRowBGRX(Color *row, std::size_t n, const std::uint8_t *in)
+    {
+        kernels::Swizzle4To3(in, Bytes(row), n);
+    }
+
+    // Multiplies the colors of n 32-bit BGRA pixels by their alpha in place, so filters weigh every color by how much of
+    // it shows and transparent pixels don't bleed into their neighbours
+    inline void PremultiplyBGRA(std::uint8_t *pixels, std::size_t n)
+    {
+        for (std::size_t x = 0; x < n; ++x, pixels += 4)
+            for (int c = 0; c < 3; ++c)
+                pixels[c] = static_cast<std::uint8_t>(kernels::scalar::Div255(pixels[c] * std::uint32_t{pixels[3]}));
+    }
+
+    // Reads n premultiplied 32-bit BGRA pixels into row, dividing the colors by their alpha again
+    inline void DecodeRowPremultiplied(ColorRGBA *row, std::size_t n, const std::uint8_t *in)
+    {
+        for (std::size_t x = 0; x < n; ++x, in += 4)
+        {
+            const std::uint32_t a = in[3];
+            const auto straight = [a](std::uint32_t c)
+            { return static_cast<std::uint8_t>(a == 0 ? 0 : std::min<std::uint32_t>((c * 255 + a / 2) / a, 255)); };
+            row[x] = ColorRGBA(straight(in[2]), straight(in[1]), straight(in[0]), static_cast<std::uint8_t>(a));
+        }
+    }
+
+    inline void DecodeRowBGRX(PlanarRow row, std::size_t n, const std::uint8_t *in)
+    {
+        for (std::size_t x = 0; x < n; ++x, in += 4)
+        {
+            row.b[x] = in[0];
+            row.g[x] = in[1];
+            row.r[x] = in[2];
+        }
+    }
+
+    // Writes n pixels as 24-bit BGR
+    template <typename PixelT>
+    void EncodeRowBGR(const PixelT *row, std::size_t n, std::uint8_t *out)
+    {
+        for (std::size_t x = 0; x < n; ++x, out += 3)
+        {
+            const Color color = row[x];
+            out[0] = color.b;
+            out[1] = color.g;
+            out[2] = color.r;
+        }
+    }
+
+    inline void EncodeRowBGR(const Color *row, std::size_t n, std::uint8_t *out)
+    {
+        kernels::Swizzle3(Bytes(row), out, n);
+    }
+
+    inline void EncodeRowBGR(const ColorX *row, std::size_t n, std::uint8_t *out)
+    {
+        kernels::Swizzle4To3(Bytes(row), out, n);
+    }
+
+    inline void EncodeRowBGR(const ColorRGBA *row, std::size_t n, std::uint8_t *out)
+    {
+        kernels::Swizzle4To3(Bytes(row), out, n);
+    }
+
+    inline void EncodeRowBGR(PlanarRow row, std::size_t n, std::uint8_t *out)
+    {
+        for (std::size_t x = 0; x < n; ++x)
+        {
+            *out++ = row.b[x];
+            *out++ = row.g[x];
+            *out++ = row.r[x];
+        }
+    }
+
+    // Writes n pixels as 32-bit BGRX, the fourth byte being alpha for pixels with alpha and zero for the rest
+    template <typename PixelT>
+    void EncodeRowBGRX(const PixelT *row, std::size_t n, std::uint8_t *out)
+    {
+        for (std::size_t x = 0; x < n; ++x, out += 4)
+        {
+            const Color color = row[x];
+            out[0] = color.b;
+            out[1] = color.g;
+            out[2] = color.r;
+            out[3] = 0;
+        }
+    }
+
+    inline void EncodeRowBGRX(const ColorRGBA *row, std::size_t n, std::uint8_t *out)
+    {
+        for (std::size_t x = 0; x < n; ++x, out += 4)
+        {
+            out[0] = row[x].b;
+            out[1] = row[x].g;
+            out[2] = row[x].r;
+            out[3] = row[x].a;
+        }
+    }
+
+    inline void EncodeRowBGRX(const Color *row, std::size_t n, std::uint8_t *out)
+    {
+        kernels::Swizzle3To4(Bytes(row), out, n);
+    }
+
+    inline void EncodeRowBGRX(const ColorX *row, std::size_t n, std::uint8_t *out)
+    {
+        for (std::size_t x = 0; x < n; ++x)
+        {
+            *out++ = row[x].b;
+            *out++ = row[x].g;
+            *out++ = row[x].r;
+            *out++ = 0;
+        }
+    }
+
+    inline void EncodeRowBGRX(PlanarRow row, std::size_t n, std::uint8_t *out)
+    {
+        for (std::size_t x = 0; x < n; ++x)
+        {
+            *out++ = row.b[x];
+            *out++ = row.g[x];
+            *out++ = row.r[x];
+            *out++ = 0;
+        }
+    }
+
+    // Writes n pixels as 32-bit BGRA, pixels without alpha being opaque
+    template <typename Row>
+    void EncodeRowBGRA(Row row, std::size_t n, std::uint8_t *out)
+    {
+        EncodeRowBGRX(row, n, out);
+        if constexpr (!RowTraits<Row>::kAlpha)
+            for (std::size_t x = 0; x < n; ++x)
+                out[x * 4 + 3] = 255;
+    }
+
+    // Writes n pixels as 32-bit BGRX with a zero fourth byte even for pixels with alpha, the way color tables hold them
+    template <typename Row>
+    void EncodeRowColors(Row row, std::size_t n, std::uint8_t *out)
+    {
+        EncodeRowBGRX(row, n, out);
+        if constexpr (RowTraits<Row>::kAlpha)
+            for (std::size_t x = 0; x < n; ++x)
+                out[x * 4 + 3] = 0;
+    }
+
+    // Writes n pixels as 8-bit gray levels, colors as their luma
+    template <typename PixelT>
+    void EncodeRowGray(const PixelT *row, std::size_t n, std::uint8_t *out)
+    {
+        for (std::size_t x = 0; x < n; ++x)
+            out[x] = Gray(Color(row[x])).v;
+    }
+
+    inline void EncodeRowGray(const Gray *row, std::size_t n, std::uint8_t *out)
+    {
+        std::memcpy(out, row, n);
+    }
+
+    inline void EncodeRowGray(PlanarRow row, std::size_t n, std::uint8_t *out)
+    {
+        for (std::size_t x = 0; x < n; ++x)
+            out[x] = Gray(Color(row.r[x], row.g[x], row.b[x])).v;
+    }
+
+    // Writes n pixels with the uncompressed encoding BGR24, BGRA32 or Gray8
+    template <typename Row>
+    void EncodeRow(Row row, std::size_t n, Encoding encoding, std::uint8_t *out)
+    {
+        if (encoding == Encoding::Gray8)
+            EncodeRowGray(row, n, out);
+        else if (encoding == Encoding::BGRA32)
+            EncodeRowBGRA(row, n, out);
+        else
+            EncodeRowBGR(row, n, out);
+    }
+
+    // Set of up to 256 colors stored as 32-bit BGRX, the layout of BMP color tables, giving every color its index.
+    // Lookups hash the color into an open-addressing table four times larger than the palette
+    class Palette
+    {
+    public:
+        static constexpr std::size_t kMaxColors = 256;
+
+        // Adds color, returns false if the palette is full
+        bool Insert(std::uint32_t color) noexcept;
+        // Returns the index of color, which must be in the palette
+        std::uint8_t Find(std::uint32_t color) const noexcept;
+        // Sorts the colors, so the indices don't depend on the order they were added in
+        void Sort() noexcept;
+        std::size_t Size() const noexcept { return m_size; }
+        const std::uint32_t *Colors() const noexcept { return m_colors; }
+
+    private:
+        static constexpr std::size_t kSlots = kMaxColors * 4;
+
+        static std::size_t Slot(std::uint32_t key) noexcept { return (key * 0x9e3779b1u) >> 22; }
+
+        // Keys are colors with the unused fourth byte set, so 0 marks an empty slot
+        std::uint32_t m_keys[kSlots] = {};
+        std::uint8_t m_indices[kSlots] = {};
+        std::uint32_t m_colors[kMaxColors] = {};
+        std::size_t m_size = 0;
+        // Neighbouring pixels mostly share their color
+        std::uint32_t m_last = 0;
+    };
+
+    inline bool Palette::Insert(std::uint32_t color) noexcept
+    {
+        const std::uint32_t key = color | 0xff000000u;
+        if (key == m_last)
+            return true;
+
+        std::size_t slot = Slot(key);
+        for (; m_keys[slot] != 0; slot = (slot + 1) % kSlots)
+            if (m_keys[slot] == key)
+            {
+                m_last = key;
+                return true;
+            }
+        if (m_size == kMaxColors)
+            return false;
+
+        m_keys[slot] = key;
+        m_indices[slot] = static_cast<std::uint8_t>(m_size);
+        m_colors[m_size++] = color & 0xffffffu;
+        m_last = key;
+        return true;
+    }
+
+    inline std::uint8_t Palette::Find(std::uint32_t color) const noexcept
+    {
+        const std::uint32_t key = color | 0xff000000u;
+        std::size_t slot = Slot(key);
+        while (m_keys[slot] != key)
+            slot = (slot + 1) % kSlots;
+        return m_indices[slot];
+    }
+
+    inline void Palette::Sort() noexcept
+    {
+        std::sort(m_colors, m_colors + m_size);
+        for (std::size_t i = 0; i < m_size; ++i)
+        {
+            const std::uint32_t key = m_colors[i] | 0xff000000u;
+            std::size_t slot = Slot(key);
+            while (m_keys[slot] != key)
+                slot = (slot + 1) % kSlots;
+            m_indices[slot] = static_cast<std::uint8_t>(i);
+        }
+    }
+
+    // Packs n palette indices into a row of bits_per_pixel (1 or 4) bits each, first pixel in the highest bits
+    inline void PackIndices(const std::uint8_t *indices, std::size_t n, std::uint16_t bits_per_pixel, std::uint8_t *out)
+    {
+        const std::size_t per_byte = 8 / bits_per_pixel;
+        for (std::size_t x = 0; x < n; x += per_byte)
+        {
+            std::uint8_t byte = 0;
+            for (std::size_t i = 0; i < per_byte; ++i)
+                byte = static_cast<std::uint8_t>(byte << bits_per_pixel | (x + i < n ? indices[x + i] : 0));
+            *out++ = byte;
+        }
+    }
+
+    // Appends n palette indices to out as one BI_RLE8 (bits_per_pixel 8) or BI_RLE4 (4) row, ending it with end-of-line,
+    // or end-of-bitmap for the last row. Runs of 3 or more pixels are encoded as a count and color,
+    // anything between them as literal (absolute mode) stretches
+    inline void EncodeRowRLE(const std::uint8_t *indices, std::size_t n, std::uint16_t bits_per_pixel, bool last, std::vector<std::uint8_t> &out)
+    {
+        const auto run_length = [&](std::size_t x)
+        {
+            std::size_t end = x + 1;
+            while (end < n && end - x < 255 && indices[end] == indices[x])
+                ++end;
+            return end - x;
+        };
+        const auto repeat = [&](std::uint8_t index) -> std::uint8_t
+        { return bits_per_pixel == 4 ? static_cast<std::uint8_t>(index << 4 | index) : index; };
+
+        for (std::size_t x = 0; x < n;)
+        {
+            std::size_t run = run_length(x);
+            if (run >= 3)
+            {
+                out.push_back(static_cast<std::uint8_t>(run));
+                out.push_back(repeat(indices[x]));
+                x += run;
+                continue;
+            }
+
+            // The literal stretch ends where the next long run starts
+            std::size_t end = x;
+            while (end < n && end - x < 255 && (run = run_length(end)) < 3)
+                end += std::min(run, 255 - (end - x));
+            const std::size_t count = end - x;
+            if (count < 3)
+            {
+                // Absolute mode needs 3 pixels or more, shorter stretches are sent as runs
+                for (; x < end; ++x)
+                {
+                    out.push_back(1);
+                    out.push_back(repeat(indices[x]));
+                }
+                continue;
+            }
+
+            out.push_back(0);
+            out.push_back(static_cast<std::uint8_t>(count));
+            const std::size_t bytes = bits_per_pixel == 4 ? (count + 1) / 2 : count;
+            const std::size_t at = out.size();
+            out.resize(at + bytes + bytes % 2);
+            if (bits_per_pixel == 4)
+                PackIndices(indices + x, count, 4, out.data() + at);
+            else
+                std::memcpy(out.data() + at, indices + x, count);
+            x = end;
+        }
+
+        out.push_back(0);
+        out.push_back(last ? 1 : 0);
+    }
+
+    // Unpacks n palette indices from a row of bits_per_pixel (1 or 4) bits each, first pixel in the highest bits
+    inline void UnpackIndices(const std::uint8_t *in, std::size_t n, std::uint16_t bits_per_pixel, std::uint8_t *indices)
+    {
+        const std::size_t per_byte = 8 / bits_per_pixel;
+        const auto mask = static_cast<std::uint8_t>((1u << bits_per_pixel) - 1);
+        for (std::size_t x = 0; x < n; ++x)
+            indices[x] = static_cast<std::uint8_t>(in[x / per_byte] >> (8 - bits_per_pixel * (x % per_byte + 1)) & mask);
+    }
+
+    // Reads the palette indices of BI_RLE8 (bits_per_pixel 8) or BI_RLE4 (4) pixels one row at a time, bottom row first.
+    // Pixels skipped by a delta or an early end of line, or past the end of the data, are index 0
+    class RleReader
+    {
+    public:
+        RleReader(const std::uint8_t *data, std::size_t size, std::uint16_t bits_per_pixel) noexcept
+            : m_in(data), m_end(data + size), m_bits(bits_per_pixel) {}
+
+        // Fills the n indices of the next row
+        void Row(std::uint8_t *indices, std::size_t n) noexcept;
+
+    private:
+        const std::uint8_t *m_in, *m_end;
+        std::uint16_t m_bits;
+        // A delta upwards leaves m_skip rows empty and starts the one after them at column m_x
+        std::size_t m_skip = 0, m_x = 0;
+        bool m_done = false;
+    };
+
+    inline void RleReader::Row(std::uint8_t *indices, std::size_t n) noexcept
+    {
+        std::fill(indices, indices + n, std::uint8_t{0});
+        if (m_skip > 0)
+        {
+            --m_skip;
+            return;
+        }
+
+        // Pixel i of a run alternates between the two nibbles of its byte at 4 bits
+        const auto nibble = [&](std::uint8_t byte, std::size_t i)
+        { return m_bits == 4 ? static_cast<std::uint8_t>(i % 2 == 0 ? byte >> 4 : byte & 15) : byte; };
+        std::size_t x = std::exchange(m_x, 0);
+        while (!m_done && m_end - m_in >= 2)
+        {
+            const std::uint8_t count = m_in[0], value = m_in[1];
+            m_in += 2;
+            if (count > 0)
+            {
+                for (std::size_t i = 0; i < count && x < n; ++i)
+                    indices[x++] = nibble(value, i);
+                continue;
+            }
+
+            // Escapes: end of line, end of bitmap, delta and absolute mode
+            if (value == 0)
+                return;
+            if (value == 1)
+                break;
+            if (value == 2)
+            {
+                if (m_end - m_in < 2)
+                    break;
+                x += m_in[0];
+                const std::uint8_t dy = m_in[1];
+                m_in += 2;
+                if (dy > 0)
+                {
+                    m_skip = dy - 1u;
+                    m_x = x;
+                    return;
+                }
+                continue;
+            }
+
+            const std::size_t bytes = m_bits == 4 ? (value + 1u) / 2 : value;
+            if (static_cast<std::size_t>(m_end - m_in) < bytes)
+                break;
+            for (std::size_t i = 0; i < value && x < n; ++i)
+                indices[x++] = nibble(m_in[m_bits == 4 ? i / 2 : i], i);
+            // Absolute runs are padded to 16 bits
+            m_in += std::min(bytes + bytes % 2, static_cast<std::size_t>(m_end - m_in));
+        }
+        m_done = true;
+    }
+
+    // Narrows [first;last) to the steps i for which 0 <= u + i * du < limit
+    inline void NarrowSpan(std::int64_t u, std::int64_t du, std::int64_t limit, std::size_t &first, std::size_t &last)
+    {
+        std::int64_t lo = 0, hi = 0;
+        if (du > 0)
+        {
+            lo = CeilDiv(-u, du);
+            hi = CeilDiv(limit - u, du);
+        }
+        else if (du < 0)
+        {
+            lo = FloorDiv(u - limit, -du) + 1;
+            hi = FloorDiv(u, -du) + 1;
+        }
+        else if (u >= 0 && u < limit)
+            return;
+
+        const std::int64_t begin = std::clamp<std::int64_t>(lo, first, last);
+        last = static_cast<std::size_t>(std::clamp<std::int64_t>(hi, begin, last));
+        first = static_cast<std::size_t>(begin);
+    }
+
+    // Blends the 2x2 block at 16.16 fixed point u;v of a width x height BGRX image, reading pixels outside it as black
+    inline void SampleBilinearClipped(const std::uint8_t *src, std::int32_t width, std::int32_t height, std::int64_t u, std::int64_t v, std::uint8_t *out)
+    {
+        std::uint8_t block[16] = {};
+        const std::int64_t x = u >> 16, y = v >> 16;
+        for (std::int64_t dy = 0; dy < 2; ++dy)
+            for (std::int64_t dx = 0; dx < 2; ++dx)
+                if (x + dx >= 0 && x + dx < width && y + dy >= 0 && y + dy < height)
+                    std::memcpy(block + dy * 8 + dx * 4, src + (static_cast<std::size_t>(y + dy) * width + static_cast<std::size_t>(x + dx)) * 4, 4);
+
+        kernels::scalar::Bilinear4(block, 8, u & 0xffff, v & 0xffff, 0, 0, 1, out);
+    }
+
+    // Samples n pixels of a width x height BGRX image into out, starting at 16.16 fixed point u;v and stepping by du;dv.
+    // Nearest takes the pixel a position falls in, bilinear the 2x2 block starting there. Pixels outside the image read as black
+    inline void SampleRow(const std::uint8_t *src, std::int32_t width, std::int32_t height, Filter filter,
+                          std::int64_t u, std::int64_t v, std::int64_t du, std::int64_t dv, std::size_t n, std::uint8_t *out)
+    {
+        const std::size_t stride = static_cast<std::size_t>(width) * 4;
+        const std::int64_t reach = filter == Filter::Bilinear ? 1 : 0;
+
+        // Steps reading at least one pixel of the image...
+        std::size_t outer_first = 0, outer_last = n;
+        NarrowSpan(u + (reach << 16), du, (std::int64_t{width} + reach) << 16, outer_first, outer_last);
+        NarrowSpan(v + (reach << 16), dv, (std::int64_t{height} + reach) << 16, outer_first, outer_last);
+        // ...and those reading only pixels of the image
+        std::size_t first = outer_first, last = outer_last;
+        NarrowSpan(u, du, (std::int64_t{width} - reach) << 16, first, last);
+        NarrowSpan(v, dv, (std::int64_t{height} - reach) << 16, first, last);
+        if (first == last)
+            first = last = outer_last;
+
+        std::memset(out, 0, outer_first * 4);
+        std::memset(out + outer_last * 4, 0, (n - outer_last) * 4);
+        for (std::size_t i = outer_first; i < first; ++i)
+            SampleBilinearClipped(src, width, height, u + static_cast<std::int64_t>(i) * du, v + static_cast<std::int64_t>(i) * dv, out + i * 4);
+        for (std::size_t i = last; i < outer_last; ++i)
+            SampleBilinearClipped(src, width, height, u + static_cast<std::int64_t>(i) * du, v + static_cast<std::int64_t>(i) * dv, out + i * 4);
+
+        u += static_cast<std::int64_t>(first) * du;
+        v += static_cast<std::int64_t>(first) * dv;
+        if (filter == Filter::Bilinear)
+            kernels::Bilinear4(src, stride, u, v, du, dv, last - first, out + first * 4);
+        else
+            for (std::size_t i = first; i < last; ++i, u += du, v += dv)
+                std::memcpy(out + i * 4, src + static_cast<std::size_t>(v >> 16) * stride + static_cast<std::size_t>(u >> 16) * 4, 4);
+    }
+
+    // Weights resampling a row or column to another size: destination pixel i is the sum of the taps source pixels from
+    // starts[i], weighted by weights[i * taps] onwards with the fraction bits of kernels::Convolve
+    struct ResampleWeights
+    {
+        std::vector<std::int32_t> starts;
+        std::vector<std::int16_t> weights;
+        std::size_t taps = 0;
+    };
+
+    // Returns the weight of filter at x source pixels from the sample point, before it widens for shrinking
+    inline double FilterWeight(Filter filter, double x)
+    {
+        constexpr double pi = 3.14159265358979323846;
+        const auto sinc = [&](double t)
+        { return t == 0.0 ? 1.0 : std::sin(pi * t) / (pi * t); };
+        switch (filter)
+        {
+        case Filter::Bilinear:
+            return std::max(0.0, 1.0 - std::abs(x));
+        case Filter::Box:
+            return x >= -0.5 && x < 0.5 ? 1.0 : 0.0;
+        case Filter::Lanczos:
+            return std::abs(x) < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+        default:
+            return 0.0;
+        }
+    }
+
+    // Returns the weights resampling src pixels to dst with filter. Source pixels beyond the edges fold onto the edge pixels,
+    // and the weights of every destination pixel are rounded keeping their sum, so flat areas stay flat
+    inline ResampleWeights MakeResampleWeights(std::int32_t src, std::int32_t dst, Filter filter)
+    {
+        ResampleWeights result;
+        result.starts.resize(static_cast<std::size_t>(dst));
+        const double scale = static_cast<double>(src) / dst;
+        if (filter == Filter::Nearest)
+        {
+            result.taps = 1;
+            result.weights.assign(static_cast<std::size_t>(dst), std::int16_t{1 << kernels::scalar::kWeightBits});
+            for (std::int32_t i = 0; i < dst; ++i)
+                result.starts[i] = std::min(static_cast<std::int32_t>((i + 0.5) * scale), src - 1);
+            return result;
+        }
+
+        // Sample points at the destination pixel centers, in source pixels. Shrinking widens the filter by the scale
+        const double widen = std::max(scale, 1.0);
+        const double support = (filter == Filter::Lanczos ? 3.0 : filter == Filter::Bilinear ? 1.0 : 0.5) * widen;
+        std::vector<double> folded;
+        std::vector<std::int16_t> rounded;
+        std::vector<std::int32_t> firsts(static_cast<std::size_t>(dst)), counts(static_cast<std::size_t>(dst));
+        for (std::int32_t i = 0; i < dst; ++i)
+        {
+            const double center = (i + 0.5) * scale;
+            const auto lo = static_cast<std::int32_t>(std::floor(center - support - 0.5)), hi = static_cast<std::int32_t>(std::ceil(center + support - 0.5));
+            const std::int32_t first = std::clamp(lo, 0, src - 1), last = std::clamp(hi, 0, src - 1);
+            folded.assign(static_cast<std::size_t>(last - first + 1), 0.0);
+            double total = 0.0;
+            for (std::int32_t j = lo; j <= hi; ++j)
+            {
+                const double w = FilterWeight(filter, (j + 0.5 - center) / widen);
+                folded[std::clamp(j, 0, src - 1) - first] += w;
+                total += w;
+            }
+
+            // Rounding the running sum rather than every weight keeps the error of many small weights from adding up.
+            // Weights that round to 0 at either end are dropped
+            const std::size_t begin = rounded.size();
+            double sum = 0.0;
+            std::int64_t previous = 0;
+            for (const double w : folded)
+            {
+                sum += w / total;
+                const std::int64_t next = std::llround(sum * (1 << kernels::scalar::kWeightBits));
+                rounded.push_back(static_cast<std::int16_t>(next - previous));
+                previous = next;
+            }
+            std::size_t skip = 0;
+            while (rounded[begin + skip] == 0)
+                skip++;
+            rounded.erase(rounded.begin() + static_cast<std::ptrdiff_t>(begin), rounded.begin() + static_cast<std::ptrdiff_t>(begin + skip));
+            while (rounded.back() == 0)
+                rounded.pop_back();
+            firsts[i] = first + static_cast<std::int32_t>(skip);
+            counts[i] = static_cast<std::int32_t>(rounded.size() - begin);
+            result.taps = std::max(result.taps, static_cast<std::size_t>(counts[i]));
+        }
+
+        // Every pixel gets the same number of taps, the window moved back from the end so it stays inside the source
+        result.weights.assign(static_cast<std::size_t>(dst) * result.taps, 0);
+        const std::int16_t *w = rounded.data();
+        for (std::int32_t i = 0; i < dst; ++i)
+        {
+            result.starts[i] = std::min(firsts[i], src - static_cast<std::int32_t>(result.taps));
+            std::copy_n(w, counts[i], result.weights.data() + static_cast<std::size_t>(i) * result.taps + (firsts[i] - result.starts[i]));
+            w += counts[i];
+        }
+        return result;
+    }
+
+    // Side of the square tiles transposes work on: a source and a destination tile of 4-byte pixels fit in L1 together
+    inline constexpr std::size_t kTransposeTile = 32;
+
+    // Width and height in pixels of the tiles dirty tracking marks
+    inline constexpr std::int32_t kDirtyTile = 64;
+
+    // Returns the number of dirty tiles covering size pixels
+    inline std::size_t TileCount(std::int32_t size)
+    {
+        return static_cast<std::size_t>(size + kDirtyTile - 1) / kDirtyTile;
+    }
+
+    // Writes the transpose of the rows x cols block at src to dst, strides counted in elements
+    template <typename T>
+    void TransposeBlock(const T *src, std::size_t src_stride, T *dst, std::size_t dst_stride, std::size_t rows, std::size_t cols)
+    {
+        for (std::size_t y = 0; y < rows; ++y)
+            for (std::size_t x = 0; x < cols; ++x)
+                dst[x * dst_stride + y] = src[y * src_stride + x];
+    }
+
+    // Writes the transpose of the rows x cols matrix at src to dst one tile at a time.
+    // Every band fills whole destination tile rows, so the threads write disjoint memory
+    template <typename T>
+    void Transpose(const T *src, std::size_t src_stride, T *dst, std::size_t dst_stride, std::size_t rows, std::size_t cols, Executor &executor)
+    {
+        const std::size_t tile = kTransposeTile;
+        executor.ParallelFor(0, static_cast<std::int32_t>((cols + tile - 1) / tile), 1, [&](std::int32_t t0, std::int32_t t1)
+                             {
+                                 for (std::size_t x0 = t0 * tile; x0 < std::min(t1 * tile, cols); x0 += tile)
+                                     for (std::size_t y0 = 0; y0 < rows; y0 += tile)
+                                         TransposeBlock(src + y0 * src_stride + x0, src_stride, dst + x0 * dst_stride + y0, dst_stride,
+                                                        std::min(tile, rows - y0), std::min(tile, cols - x0));
+                             });
+    }
+
+    // Transposes the n x n matrix at data in place, exchanging every tile with its mirror image across the diagonal.
+    // Band i handles the tiles right of the diagonal in tile row i, so no tile is touched twice
+    template <typename T>
+    void TransposeSquare(T *data, std::size_t stride, std::size_t n, Executor &executor)
+    {
+        const std::size_t tile = kTransposeTile;
+        executor.ParallelFor(0, static_cast<std::int32_t>((n + tile - 1) / tile), 1, [&](std::int32_t t0, std::int32_t t1)
+                             {
+                                 for (std::size_t y0 = t0 * tile; y0 < std::min(t1 * tile, n); y0 += tile)
+                                 {
+                                     const std::size_t rows = std::min(tile, n - y0);
+                                     for (std::size_t y = 0; y < rows; ++y)
+                                         for (std::size_t x = y + 1; x < rows; ++x)
+                                             std::swap(data[(y0 + y) * stride + y0 + x], data[(y0 + x) * stride + y0 + y]);
+
+                                     for (std::size_t x0 = y0 + tile; x0 < n; x0 += tile)
+                                     {
+                                         const std::size_t cols = std::min(tile, n - x0);
+                                         for (std::size_t y = 0; y < rows; ++y)
+                                             for (std::size_t x = 0; x < cols; ++x)
+                                                 std::swap(data[(y0 + y) * stride + x0 + x], data[(x0 + x) * stride + y0 + y]);
+                                     }
+                                 }
+                             });
+    }
+}
+
+// Implementations
+namespace bmpr
+{
+#if defined(BMPR_ENABLE_STATS)
+    namespace detail
+    {
+        // Relaxed atomics behind Stats, updated from every thread drawing
+        struct StatsCounters
+        {
+            std::atomic<std::uint64_t> pixels_written{0}, set_safe_rejections{0}, spans_filled{0}, bytes_encoded{0};
+            std::atomic<std::uint64_t> calls[static_cast<std::size_t>(Operation::Count)] = {};
+            std::atomic<std::uint64_t> total_ns[static_cast<std::size_t>(Operation::Count)] = {};
+            std::atomic<std::uint64_t> max_ns[static_cast<std::size_t>(Operation::Count)] = {};
+            std::atomic<StatsCallback> callback{nullptr};
+            std::atomic<void *> user{nullptr};
+        };
+
+        inline StatsCounters g_stats;
+
+        // Records the time from construction to destruction as one call of an operation
+        class ScopedTimer
+        {
+        public:
+            explicit ScopedTimer(Operation operation) noexcept : m_operation{operation}, m_start{std::chrono::steady_clock::now()} {}
+            ~ScopedTimer();
+            ScopedTimer(const ScopedTimer &) = delete;
+            ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+        private:
+            Operation m_operation;
+            std::chrono::steady_clock::time_point m_start;
+        };
+
+        inline ScopedTimer::~ScopedTimer()
+        {
+            const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start);
+            const auto ns = static_cast<std::uint64_t>(elapsed.count());
+            const auto i = static_cast<std::size_t>(m_operation);
+
+            g_stats.calls[i].fetch_add(1, std::memory_order_relaxed);
+            g_stats.total_ns[i].fetch_add(ns, std::memory_order_relaxed);
+            std::uint64_t max = g_stats.max_ns[i].load(std::memory_order_relaxed);
+            while (ns > max && !g_stats.max_ns[i].compare_exchange_weak(max, ns, std::memory_order_relaxed))
+            {
+            }
+
+            if (const StatsCallback callback = g_stats.callback.load(std::memory_order_acquire))
+                callback(m_operation, ns, g_stats.user.load(std::memory_order_relaxed));
+        }
+    }
+
+    inline const char *OperationName(Operation operation) noexcept
+    {
+        static constexpr const char *names[] = {"DrawLine", "DrawThickLine", "DrawQuadraticBezierCurve", "DrawCubicBezierCurve", "DrawCircle",
+                                                "DrawCircleLine", "DrawLineAA", "DrawCircleAA", "DrawCircleLineAA", "DrawCircleInverted",
+                                                "DrawRectangle", "DrawRectangleLine", "DrawPolygon", "DrawTriangles", "DrawText", "Composite", "Clear", "Transform", "Resize", "Rotate180",
+                                                "FlipHorizontally", "FlipVertically", "Invert", "FillRandom", "BoxBlur", "GaussianBlur", "Convolve", "Transpose", "Encode"};
+        static_assert(std::size(names) == static_cast<std::size_t>(Operation::Count));
+        const auto i = static_cast<std::size_t>(operation);
+        return i < std::size(names) ? names[i] : "Unknown";
+    }
+
+    inline Stats GetStats() noexcept
+    {
+        const detail::StatsCounters &counters = detail::g_stats;
+        Stats stats;
+        stats.pixels_written = counters.pixels_written.load(std::memory_order_relaxed);
+        stats.set_safe_rejections = counters.set_safe_rejections.load(std::memory_order_relaxed);
+        stats.spans_filled = counters.spans_filled.load(std::memory_order_relaxed);
+        stats.bytes_encoded = counters.bytes_encoded.load(std::memory_order_relaxed);
+        for (std::size_t i = 0; i < std::size(stats.timings); ++i)
+            stats.timings[i] = {counters.calls[i].load(std::memory_order_relaxed), counters.total_ns[i].load(std::memory_order_relaxed),
+                                counters.max_ns[i].load(std::memory_order_relaxed)};
+        return stats;
+    }
+
+    inline void ResetStats() noexcept
+    {
+        detail::StatsCounters &counters = detail::g_stats;
+        for (std::atomic<std::uint64_t> *counter : {&counters.pixels_written, &counters.set_safe_rejections, &counters.spans_filled, &counters.bytes_encoded})
+            counter->store(0, std::memory_order_relaxed);
+        for (std::size_t i = 0; i < static_cast<std::size_t>(Operation::Count); ++i)
+        {
+            counters.calls[i].store(0, std::memory_order_relaxed);
+            counters.total_ns[i].store(0, std::memory_order_relaxed);
+            counters.max_ns[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    inline void SetStatsCallback(StatsCallback callback, void *user) noexcept
+    {
+        detail::g_stats.user.store(user, std::memory_order_relaxed);
+        detail::g_stats.callback.store(callback, std::memory_order_release);
+    }
+#endif
+
+    inline Executor::Executor(std::size_t threads, std::int32_t grain) : m_grain{std::max(grain, 1)}
+    {
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+
+        m_workers.reserve(threads - 1);
+        for (std::size_t i = 1; i < threads; ++i)
+            m_workers.emplace_back([this] { WorkerLoop(); });
+    }
+
+    inline Executor::~Executor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+
+        for (std::thread &worker : m_workers)
+            worker.join();
+    }
+
+    inline std::size_t Executor::Threads() const noexcept { return m_workers.size() + 1; }
+
+    inline std::int32_t Executor::Grain() const noexcept { return m_grain; }
+
+    inline void Executor::SetGrain(std::int32_t grain) noexcept { m_grain = std::max(grain, 1); }
+
+    template <typename Fn>
+    void Executor::ParallelFor(std::int32_t begin, std::int32_t end, Fn &&fn)
+    {
+        ParallelFor(begin, end, m_grain, std::forward<Fn>(fn));
+    }
+
+    template <typename Fn>
+    void Executor::ParallelFor(std::int32_t begin, std::int32_t end, std::int32_t grain, Fn &&fn)
+    {
+        grain = std::max(grain, 1);
+        if (begin >= end)
+            return;
+
+        Job job;
+        job.context = &fn;
+        job.invoke = [](void *context, std::int32_t band_begin, std::int32_t band_end)
+        {
+            (*static_cast<std::remove_reference_t<Fn> *>(context))(band_begin, band_end);
+        };
+        job.begin = begin;
+        job.end = end;
+        job.grain = grain;
+        job.bands = (static_cast<std::size_t>(end - begin) + grain - 1) / grain;
+
+        Run(job);
+    }
+
+    inline Executor &Executor::Serial()
+    {
+        static Executor serial(1);
+        return serial;
+    }
+
+    inline void Executor::Run(const Job &job)
+    {
+        // Nothing to share, or called from one of our own bands
+        if (m_workers.empty() || job.bands == 1 || t_current == this)
+        {
+            job.invoke(job.context, job.begin, job.end);
+            return;
+        }
+
+        std::lock_guard<std::mutex> submit(m_submit);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_job = &job;
+            m_next = 0;
+            m_finished = 0;
+            m_error = nullptr;
+            ++m_generation;
+        }
+        m_wake.notify_all();
+
+        const Executor *previous = t_current;
+        t_current = this;
+        Work(job);
+        t_current = previous;
+
+        std::exception_ptr error;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_done.wait(lock, [&] { return m_finished == job.bands && m_busy == 0; });
+            m_job = nullptr;
+            error = m_error;
+        }
+
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    inline void Executor::Work(const Job &job)
+    {
+        for (;;)
+        {
+            const std::size_t band = m_next.fetch_add(1);
+            if (band >= job.bands)
+                return;
+
+            const std::int32_t band_begin = job.begin + static_cast<std::int32_t>(band) * job.grain;
+            const std::int32_t band_end = static_cast<std::int32_t>(std::min<std::int64_t>(static_cast<std::int64_t>(band_begin) + job.grain, job.end));
+
+            std::exception_ptr error;
+            try
+            {
+                job.invoke(job.context, band_begin, band_end);
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (error && !m_error)
+                m_error = error;
+            if (++m_finished == job.bands)
+                m_done.notify_all();
+        }
+    }
+
+    inline void Executor::WorkerLoop()
+    {
+        t_current = this;
+        std::uint64_t seen = 0;
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;)
+        {
+            m_wake.wait(lock, [&] { return m_stop || (m_job != nullptr && m_generation != seen); });
+            if (m_stop)
+                return;
+
+            seen = m_generation;
+            const Job *job = m_job;
+            ++m_busy;
+
+            lock.unlock();
+            Work(*job);
+            lock.lock();
+
+            if (--m_busy == 0)
+                m_done.notify_all();
+        }
+    }
+
+    inline Affine Affine::Translation(double dx, double dy) noexcept
+    {
+        return {1, 0, dx, 0, 1, dy};
+    }
+
+    inline Affine Affine::Scale(double sx, double sy) noexcept
+    {
+        return {sx, 0, 0, 0, sy, 0};
+    }
+
+    inline Affine Affine::Rotation(double degrees) noexcept
+    {
+        double turn = std::fmod(degrees, 360.0);
+        if (turn < 0)
+            turn += 360.0;
+
+        // Quarter turns are spelled out, so they map pixel centers exactly
+        double c = 1, s = 0;
+        if (turn == 90.0)
+            c = 0, s = 1;
+        else if (turn == 180.0)
+            c = -1, s = 0;
+        else if (turn == 270.0)
+            c = 0, s = -1;
+        else if (turn != 0.0)
+        {
+            const double radians = turn * (3.14159265358979323846 / 180.0);
+            c = std::cos(radians);
+            s = std::sin(radians);
+        }
+        return {c, -s, 0, s, c, 0};
+    }
+
+    inline Affine Affine::Rotation(double degrees, double cx, double cy) noexcept
+    {
+        return Translation(cx, cy) * Rotation(degrees) * Translation(-cx, -cy);
+    }
+
+    inline Affine Affine::operator*(const Affine &other) const noexcept
+    {
+        return {xx * other.xx + xy * other.yx, xx * other.xy + xy * other.yy, xx * other.tx + xy * other.ty + tx,
+                yx * other.xx + yy * other.yx, yx * other.xy + yy * other.yy, yx * other.tx + yy * other.ty + ty};
+    }
+
+    inline std::optional<Affine> Affine::Inverse() const noexcept
+    {
+        const double det = xx * yy - xy * yx;
+        if (det == 0 || !std::isfinite(det) || !std::isfinite(tx) || !std::isfinite(ty))
+            return std::nullopt;
+
+        Affine inverse{yy / det, -xy / det, 0, -yx / det, xx / det, 0};
+        inverse.tx = -(inverse.xx * tx + inverse.xy * ty);
+        inverse.ty = -(inverse.yx * tx + inverse.yy * ty);
+        return inverse;
+    }
+
+    template <typename Derived>
+    Rect ImageBase<Derived>::Area()
+    {
+        detail::ApplyOrientation(self());
+        return self().Bounds();
+    }
+
+    template <typename Derived>
+    Rect ImageBase<Derived>::TouchArea()
+    {
+        const Rect area = Area();
+        detail::MarkDirty(self(), area);
+        if (!area.Empty())
+            BMPR_STAT_ADD(pixels_written, std::int64_t{area.x1 - area.x0} * (area.y1 - area.y0));
+        return area;
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::SetSafe(std::int32_t x, std::int32_t y, const Color &color)
+    {
+        const Rect bounds = Area();
+        if (x >= bounds.x0 && x < bounds.x1 && y >= bounds.y0 && y < bounds.y1)
+            self().Set(x, y, color);
+        else
+            BMPR_STAT_ADD(set_safe_rejections, 1);
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::DrawLine(std::int32_t x1, std::int32_t y1, std::int32_t x2, std::int32_t y2, ColorRGBA color, BlendMode mode)
+    {
+        BMPR_TIME(DrawLine);
+        // Clipped up front, so every visited pixel is inside the image
+        const detail::Paint paint = MakePaint(color, mode);
+        TraceLine(x1, y1, x2, y2, Area(), [&](std::int32_t x, std::int32_t y)
+                  { Plot(x, y, paint); });
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::DrawLine(std::int32_t x1, std::int32_t y1, std::int32_t x2, std::int32_t y2, int thickness, ColorRGBA color, LineCap cap, BlendMode mode)
+    {
+        BMPR_TIME(DrawThickLine);
+        // Check if the line thickness is less than 1
+        if (thickness < 1)
+            thickness = 1;
+
+        // The stroke is the rectangle of points s along the line and u across it with
+        // s in [s_begin;s_end) and u in [-half;half), plus a circle around each end point for round caps.
+        // It is convex, so every row it crosses is covered by a single span.
+        const double half = thickness / 2.0;
+        const double dx = static_cast<double>(x2) - x1;
+        const double dy = static_cast<double>(y2) - y1;
+        const double length = std::hypot(dx, dy);
+        const double dir_x = length > 0.0 ? dx / length : 1.0;
+        const double dir_y = length > 0.0 ? dy / length : 0.0;
+        const double s_begin = cap == LineCap::Square ? -half : 0.0;
+        const double s_end = cap == LineCap::Square ? length + half : length;
+        const detail::Paint paint = MakePaint(color, mode);
+
+        // No cap reaches further than the thickness from the end points
+        const Rect bounds = Area();
+        const std::int32_t row_begin = detail::ClampCoord(std::max<std::int64_t>(std::min(y1, y2) - std::int64_t{thickness}, bounds.y0));
+        const std::int32_t row_end = detail::ClampCoord(std::min<std::int64_t>(std::max(y1, y2) + std::int64_t{thickness} + 1, bounds.y1));
+
+        // Narrows [first;last] to the integers x with lo <= a * x + b < hi
+        const auto constrain = [](double a, double b, double lo, double hi, double &first, double &last)
+        {
+            if (a > 0.0)
+            {
+                first = std::max(first, std::ceil((lo - b) / a));
+                last = std::min(last, std::ceil((hi - b) / a) - 1.0);
+            }
+            else if (a < 0.0)
+            {
+                first = std::max(first, std::floor((hi - b) / a) + 1.0);
+                last = std::min(last, std::floor((lo - b) / a));
+            }
+            else if (b < lo || b >= hi)
+            {
+                first = std::numeric_limits<double>::infinity();
+                last = -std::numeric_limits<double>::infinity();
+            }
+        };
+        // Widens [first;last] by the integers x within half of the end point cx;cy on this row
+        const auto add_circle = [&](double cx, double cy, double y, double &first, double &last)
+        {
+            const double rest = half * half - (y - cy) * (y - cy);
+            if (rest <= 0.0)
+                return;
+            const double reach = std::sqrt(rest);
+            first = std::min(first, std::floor(cx - reach) + 1.0);
+            last = std::max(last, std::ceil(cx + reach) - 1.0);
+        };
+
+        // Everything below is relative to x1;y1
+        const double visible_first = static_cast<double>(bounds.x0) - x1;
+        const double visible_last = static_cast<double>(bounds.x1) - 1.0 - x1;
+
+        for (std::int32_t row = row_begin; row < row_end; row++)
+        {
+            const double y = static_cast<double>(row) - y1;
+            double first = -std::numeric_limits<double>::infinity();
+            double last = std::numeric_limits<double>::infinity();
+
+            // s = x * dir_x + y * dir_y and u = y * dir_x - x * dir_y
+            constrain(dir_x, y * dir_y, s_begin, s_end, first, last);
+            constrain(-dir_y, y * dir_x, -half, half, first, last);
+
+            if (cap == LineCap::Round)
+            {
+                if (first > last)
+                {
+                    first = std::numeric_limits<double>::infinity();
+                    last = -std::numeric_limits<double>::infinity();
+                }
+                add_circle(0.0, 0.0, y, first, last);
+                add_circle(dx, dy, y, first, last);
+            }
+
+            first = std::max(first, visible_first);
+            last = std::min(last, visible_last);
+            if (first <= last)
+                FillSpan(row, static_cast<std::int32_t>(first + x1), static_cast<std::int32_t>(last + x1) + 1, paint);
+        }
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::DrawQuadraticBezierCurve(const Vector2 &start, const Vector2 &control, const Vector2 &end, int num_points, const ColorRGBA &color, BlendMode mode)
+    {
+        BMPR_TIME(DrawQuadraticBezierCurve);
+        // The curve stays inside the triangle of its control points, give float rounding a pixel of slack
+        const bool inside = num_points > 0 && Area().Contains(detail::PointBounds({start.x, control.x, end.x}, {start.y, control.y, end.y}, 1));
+        const detail::Paint paint = MakePaint(color, mode);
+        // Neighbouring points often land on the same pixel, which must not be blended twice
+        std::int64_t last_x = INT64_MIN, last_y = INT64_MIN;
+
+        for (int i = 0; i <= num_points; ++i)
+        {
+            float t = static_cast<float>(i) / static_cast<float>(num_points);
+
+            float x = pow(1 - t, 2) * start.x + 2 * t * (1 - t) * control.x + pow(t, 2) * end.x;
+            float y = pow(1 - t, 2) * start.y + 2 * t * (1 - t) * control.y + pow(t, 2) * end.y;
+
+            const int px = static_cast<int>(x), py = static_cast<int>(y);
+            if (px == last_x && py == last_y)
+                continue;
+            last_x = px;
+            last_y = py;
+
+            // Set the pixel color for the calculated point
+            if (inside)
+                Plot(px, py, paint);
+            else
+                PlotSafe(px, py, paint);
+        }
+    }
+    template <typename Derived>
+    void ImageBase<Derived>::DrawQuadraticBezierCurve(const Vector2 &start, const Vector2 &control, const Vector2 &end, float step_size, const ColorRGBA &color, BlendMode mode)
+    {
+        BMPR_TIME(DrawQuadraticBezierCurve);
+        // Same slack as above, t only stays within [0;1] for a positive step
+        const bool inside = step_size > 0.0f && Area().Contains(detail::PointBounds({start.x, control.x, end.x}, {start.y, control.y, end.y}, 1));
+        const detail::Paint paint = MakePaint(color, mode);
+        std::int64_t last_x = INT64_MIN, last_y = INT64_MIN;
+        float t = 0.0;
+
+        while (t <= 1.0)
+        {
+            float x = pow(1 - t, 2) * start.x + 2 * t * (1 - t) * control.x + pow(t, 2) * end.x;
+            float y = pow(1 - t, 2) * start.y + 2 * t * (1 - t) * control.y + pow(t, 2) * end.y;
+            t += step_size;
+
+            const int px = static_cast<int>(x), py = static_cast<int>(y);
+            if (px == last_x && py == last_y)
+                continue;
+            last_x = px;
+            last_y = py;
+
+            // Set the pixel color for the calculated point
+            if (inside)
+                Plot(px, py, paint);
+            else
+                PlotSafe(px, py, paint);
+        }
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::DrawQuadraticBezierCurve(const Vector2 &start, const Vector2 &control, const Vector2 &end, const ColorRGBA &color, BlendMode mode)
+    {
+        BMPR_TIME(DrawQuadraticBezierCurve);
+        // A chord of 1 / n of the curve strays at most |start - 2 * control + end| / (4 * n * n) from it,
+        // under a quarter pixel once n reaches the square root of the numerator
+        const double ax = static_cast<double>(start.x) - 2.0 * control.x + end.x;
+        const double ay = static_cast<double>(start.y) - 2.0 * control.y + end.y;
+        const auto segments = std::max<std::int64_t>(1, static_cast<std::int64_t>(std::ceil(std::sqrt(std::hypot(ax, ay)))));
+
+        // Forward differences of the curve sampled every h
+        const double h = 1.0 / static_cast<double>(segments);
+        double x = start.x, y = start.y;
+        double dx = 2.0 * h * (static_cast<double>(control.x) - start.x) + h * h * ax;
+        double dy = 2.0 * h * (static_cast<double>(control.y) - start.y) + h * h * ay;
+        const double ddx = 2.0 * h * h * ax, ddy = 2.0 * h * h * ay;
+
+        DrawCurve(start, end, segments, [&]
+                  {
+                      x += dx;
+                      y += dy;
+                      dx += ddx;
+                      dy += ddy;
+                      return std::pair<double, double>{x, y}; }, MakePaint(color, mode));
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::DrawCubicBezierCurve(const Vector2 &start, const Vector2 &control1, const Vector2 &control2, const Vector2 &end, const ColorRGBA &color, BlendMode mode)
+    {
+        BMPR_TIME(DrawCubicBezierCurve);
+        // The second derivative is at most 6 * the largest second difference of the control points,
+        // so a chord of 1 / n strays at most 3 * that / (4 * n * n), under a quarter pixel for n >= sqrt(3 * that)
+        const double flat = std::max(std::hypot(static_cast<double>(start.x) - 2.0 * control1.x + control2.x, static_cast<double>(start.y) - 2.0 * control1.y + control2.y),
+                                     std::hypot(static_cast<double>(control1.x) - 2.0 * control2.x + end.x, static_cast<double>(control1.y) - 2.0 * control2.y + end.y));
+        const auto segments = std::max<std::int64_t>(1, static_cast<std::int64_t>(std::ceil(std::sqrt(3.0 * flat))));
+
+        // Power basis a * t^3 + b * t^2 + c * t + start, then its forward differences every h
+        const double ax = -static_cast<double>(start.x) + 3.0 * control1.x - 3.0 * control2.x + end.x;
+        const double ay = -static_cast<double>(start.y) + 3.0 * control1.y - 3.0 * control2.y + end.y;
+        const double bx = 3.0 * (static_cast<double>(start.x) - 2.0 * control1.x + control2.x);
+        const double by = 3.0 * (static_cast<double>(start.y) - 2.0 * control1.y + control2.y);
+        const double cx = 3.0 * (static_cast<double>(control1.x) - start.x);
+        const double cy = 3.0 * (static_cast<double>(control1.y) - start.y);
+
+        const double h = 1.0 / static_cast<double>(segments);
+        const double h2 = h * h, h3 = h2 * h;
+        double x = start.x, y = start.y;
+        double dx = ax * h3 + bx * h2 + cx * h, dy = ay * h3 + by * h2 + cy * h;
+        double ddx = 6.0 * ax * h3 + 2.0 * bx * h2, ddy = 6.0 * ay * h3 + 2.0 * by * h2;
+        const double dddx = 6.0 * ax * h3, dddy = 6.0 * ay * h3;
+
+        DrawCurve(start, end, segments, [&]
+                  {
+                      x += dx;
+                      y += dy;
+                      dx += ddx;
+                      dy += ddy;
+                      ddx += dddx;
+                      ddy += dddy;
+                      return std::pair<double, double>{x, y}; }, MakePaint(color, mode));
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::DrawCircle(std::int32_t x, std::int32_t y, std::int32_t r, ColorRGBA color, BlendMode mode)
+    {
+        BMPR_TIME(DrawCircle);
+        // Only visit the rows that intersect the image. Limits are worked out in 64 bits, so circles near the ends of
+        // the coordinate range clip instead of overflowing
+        const Rect bounds = Area();
+        const detail::Paint paint = MakePaint(color, mode);
+        const std::int64_t y_begin = std::max<std::int64_t>(-std::int64_t{r}, std::int64_t{bounds.y0} - y);
+        const std::int64_t y_end = std::min<std::int64_t>(r, std::int64_t{bounds.y1} - 1 - y);
+
+        for (std::int64_t y1 = y_begin; y1 <= y_end; y1++)
+        {
+            const std::int64_t half_width = CircleHalfWidth(r, static_cast<std::int32_t>(y1));
+            if (half_width >= 0)
+                FillSpan(static_cast<std::int32_t>(y + y1), detail::ClampCoord(x - half_width), detail::ClampCoord(x + half_width + 1), paint);
+        }
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::DrawCircleLine(std::int32_t x, std::int32_t y, std::int32_t r, ColorRGBA color, BlendMode mode)
+    {
+        BMPR_TIME(DrawCircleLine);
+        // Circles off the image draw nothing, however large, and only those crossing its edge need per-pixel checks.
+        // Offsets and coordinates are 64-bit, so radii and centers anywhere in the 32-bit range don't overflow
+        const Rect box = detail::ClampedRect(std::int64_t{x} - r, std::int64_t{y} - r, std::int64_t{x} + r + 1, std::int64_t{y} + r + 1);
+        if (box.Intersect(Area()).Empty())
+            return;
+        const bool inside = Area().Contains(box);
+        const detail::Paint paint = MakePaint(color, mode);
+        const auto plot = [&](std::int64_t px, std::int64_t py)
+        {
+            if (inside)
+                Plot(static_cast<std::int32_t>(px), static_cast<std::int32_t>(py), paint);
+            else
+                PlotSafe(detail::ClampCoord(px), detail::ClampCoord(py), paint);
+        };
+        // The mirror images of px;py in the four quadrants, pixels on an axis only once
+        const auto plot4 = [&](std::int64_t px, std::int64_t py)
+        {
+            plot(x + px, y + py);
+            if (px != 0)
+                plot(x - px, y + py);
+            if (py != 0)
+            {
+                plot(x + px, y - py);
+                if (px != 0)
+                    plot(x - px, y - py);
+            }
+        };
+
+        // The midpoint loop walks the first octant, its decision variable being 2 (cx + 1)^2 + cy^2 + (cy - 1)^2 - 2 r^2.
+        // Every cy is the largest with cy^2 + (cy - 1)^2 < 2 r^2 - 2 cx^2, so the walk can start at any column: only
+        // the columns that put one of the mirrored pixels on a row or column of the image are visited
+        const std::int64_t radius = r;
+        const auto row_at = [&](std::int64_t cx)
+        {
+            if (cx == 0)
+                return radius;
+            const std::int64_t limit = 2 * (radius - cx) * (radius + cx);
+            const auto below = [&](std::int64_t cy)
+            { return 2 * cy * (cy - 1) + 1 < limit; };
+            auto cy = std::min(radius, static_cast<std::int64_t>((1.0 + std::sqrt(std::max(0.0, 2.0 * static_cast<double>(limit) - 1.0))) / 2.0));
+            while (cy > 0 && !below(cy))
+                cy--;
+            while (cy < radius && below(cy + 1))
+                cy++;
+            return cy;
+        };
+
+        const Rect area = Area();
+        std::pair<std::int64_t, std::int64_t> columns[4] = {{0, radius}, {1, 0}, {1, 0}, {1, 0}};
+        if (!inside)
+        {
+            columns[0] = {std::int64_t{area.x0} - x, std::int64_t{area.x1} - 1 - x};
+            columns[1] = {std::int64_t{x} - (area.x1 - 1), std::int64_t{x} - area.x0};
+            columns[2] = {std::int64_t{area.y0} - y, std::int64_t{area.y1} - 1 - y};
+            columns[3] = {std::int64_t{y} - (area.y1 - 1), std::int64_t{y} - area.y0};
+            std::sort(std::begin(columns), std::end(columns));
+        }
+
+        std::int64_t next = 0;
+        for (const auto &[first, last] : columns)
+        {
+            // Columns already walked are skipped, so overlapping ranges don't plot a pixel twice
+            std::int64_t center_x = std::max(first, next);
+            const std::int64_t end = std::min(last, radius);
+            if (center_x > end)
+                continue;
+            std::int64_t center_y = row_at(center_x);
+            if (center_x > center_y)
+                break;
+            std::int64_t d = (center_y * center_y - radius * radius) + ((center_y - 1) * (center_y - 1) - radius * radius) + 2 * (center_x + 1) * (center_x + 1);
+
+            while (center_x <= end && center_x <= center_y)
+            {
+                // Octants, the diagonal ones meet where both offsets are equal
+                plot4(center_x, center_y);
+                if (center_x != center_y)
+                    plot4(center_y, center_x);
+
+                if (d < 0)
+                    d += 4 * center_x++ + 6;
+                else
+                    d += 4 * (center_x++ - center_y--) + 10;
+            }
+            next = center_x;
+        }
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::DrawLineAA(float x1, float y1, float x2, float y2, ColorRGBA color, BlendMode mode)
+    {
+        BMPR_TIME(DrawLineAA);
+        if (!std::isfinite(x1) || !std::isfinite(y1) || !std::isfinite(x2) || !std::isfinite(y2))
+            return;
+
+        // Xiaolin Wu's lines: every pixel along the major axis is covered by the length of the line inside it,
+        // split across the line between the two pixels nearest to the line's center
+        const bool x_major = std::abs(x2 - x1) >= std::abs(y2 - y1);
+        double a1 = x_major ? x1 : y1, a2 = x_major ? x2 : y2;
+        double b1 = x_major ? y1 : x1, b2 = x_major ? y2 : x2;
+        if (a1 > a2)
+        {
+            std::swap(a1, a2);
+            std::swap(b1, b2);
+        }
+        if (a1 == a2)
+            return;
+
+        const Rect bounds = Area();
+        const detail::Paint paint = MakeCoveragePaint(color, mode);
+        const double gradient = (b2 - b1) / (a2 - a1);
+        const std::int32_t minor_begin = x_major ? bounds.y0 : bounds.x0;
+        const std::int32_t minor_end = x_major ? bounds.y1 : bounds.x1;
+        const std::int64_t first = std::max(detail::RoundCoord(a1), x_major ? bounds.x0 : bounds.y0);
+        const std::int64_t last = std::min(detail::RoundCoord(a2), (x_major ? bounds.x1 : bounds.y1) - 1);
+
+        for (std::int64_t a = first; a <= last; a++)
+        {
+            const double length = std::min(a + 0.5, a2) - std::max(a - 0.5, a1);
+            const double b = b1 + gradient * (a - a1);
+            const double below = std::floor(b);
+            for (const double minor : {below, below + 1.0})
+            {
+                if (minor < minor_begin || minor >= minor_end)
+                    continue;
+                const std::uint8_t coverage = detail::CoverageByte(length * (1.0 - std::abs(b - minor)));
+                const auto m = static_cast<std::int32_t>(minor);
+                if (x_major)
+                    PlotCoverage(static_cast<std::int32_t>(a), m, paint, coverage);
+                else
+                    PlotCoverage(m, static_cast<std::int32_t>(a), paint, coverage);
+            }
+        }
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::DrawCircleAA(float x, float y, float r, ColorRGBA color, BlendMode mode)
+    {
+        BMPR_TIME(DrawCircleAA);
+        if (!std::isfinite(x) || !std::isfinite(y) || !std::isfinite(r) || r <= 0.0f)
+            return;
+
+        // A pixel d away from the center is covered by clamp(r + 0.5 - d) of the disc, the pixels closer than r - 0.5 completely
+        const double outer = r + 0.5;
+        DrawRadial(x, y, r - 0.5, outer, true, MakeCoveragePaint(color, mode), [&](double distance)
+                   { return outer - distance; });
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::DrawCircleLineAA(float x, float y, float r, ColorRGBA color, BlendMode mode)
+    {
+        BMPR_TIME(DrawCircleLineAA);
+        if (!std::isfinite(x) || !std::isfinite(y) || !std::isfinite(r) || r < 0.0f)
+            return;
+
+        // The disc of radius r + 0.5 minus the one of radius r - 0.5, covering a pixel d away by 1 - |d - r|
+        DrawRadial(x, y, r - 1.0, r + 1.0, false, MakeCoveragePaint(color, mode), [&](double distance)
+                   { return 1.0 - std::abs(distance - r); });
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::DrawCircleInverted(std::int32_t x, std::int32_t y, std::int32_t r, ColorRGBA color, BlendMode mode)
+    {
+        BMPR_TIME(DrawCircleInverted);
+        // Limits in 64 bits as in DrawCircle
+        const Rect bounds = Area();
+        const detail::Paint paint = MakePaint(color, mode);
+        const std::int64_t y_begin = std::max<std::int64_t>(-std::int64_t{r}, std::int64_t{bounds.y0} - y);
+        const std::int64_t y_end = std::min<std::int64_t>(r, std::int64_t{bounds.y1} - 1 - y);
+        const std::int32_t left = detail::ClampCoord(std::int64_t{x} - r), right = detail::ClampCoord(std::int64_t{x} + r + 1);
+
+        for (std::int64_t y1 = y_begin; y1 <= y_end; y1++)
+        {
+            // Everything in the bounding box left and right of the circle's span
+            const auto row = static_cast<std::int32_t>(y + y1);
+            const std::int64_t half_width = CircleHalfWidth(r, static_cast<std::int32_t>(y1));
+            if (half_width < 0)
+            {
+                FillSpan(row, left, right, paint);
+                continue;
+            }
+            FillSpan(row, left, detail::ClampCoord(x - half_width), paint);
+            FillSpan(row, detail::ClampCoord(x + half_width + 1), right, paint);
+        }
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::DrawRectangle(std::int32_t x, std::int32_t y, std::int32_t w, std::int32_t h, ColorRGBA color, BlendMode mode)
+    {
+        BMPR_TIME(DrawRectangle);
+        // Clip once, then every row is a contiguous run of pixels
+        const Rect area = detail::ClampedRect(x, y, std::int64_t{x} + w, std::int64_t{y} + h).Intersect(Area());
+        if (area.Empty())
+            return;
+
+        const detail::Paint paint = MakePaint(color, mode);
+        detail::MarkDirty(self(), area);
+        BMPR_STAT_ADD(spans_filled, area.y1 - area.y0);
+        BMPR_STAT_ADD(pixels_written, std::int64_t{area.x1 - area.x0} * (area.y1 - area.y0));
+        for (std::int32_t row = area.y0; row < area.y1; row++)
+            detail::PaintRow(self().RowPtr(row), area.x0, area.x1, paint);
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::DrawRectangleLine(std::int32_t x, std::int32_t y, std::int32_t w, std::int32_t h, ColorRGBA color, BlendMode mode)
+    {
+        BMPR_TIME(DrawRectangleLine);
+        // Clip once: the top and bottom edges are row spans, the sides column runs.
+        // Edges that meet or coincide share their pixels instead of drawing them twice
+        const Rect bounds = Area();
+        const detail::Paint paint = MakePaint(color, mode);
+        const std::int64_t right = std::int64_t{x} + w;
+        const std::int64_t bottom = std::int64_t{y} + h;
+
+        if (w > 0)
+        {
+            FillSpan(y, x, detail::ClampCoord(right), paint);
+            if (h != 0)
+                FillSpan(detail::ClampCoord(bottom), x, detail::ClampCoord(right), paint);
+        }
+        if (h > 0)
+        {
+            const std::int32_t row_end = detail::ClampCoord(std::min<std::int64_t>(bottom, bounds.y1));
+            const std::int64_t columns[2] = {x, right};
+
+            for (int i = 0; i < (w == 0 ? 1 : 2); i++)
+            {
+                if (columns[i] < bounds.x0 || columns[i] >= bounds.x1)
+                    continue;
+                // The top edge already covers x;y
+                const std::int64_t first = i == 0 && w > 0 ? std::int64_t{y} + 1 : y;
+                for (std::int32_t row = detail::ClampCoord(std::max<std::int64_t>(first, bounds.y0)); row < row_end; row++)
+                    Plot(static_cast<std::int32_t>(columns[i]), row, paint);
+            }
+        }
+        PlotSafe(detail::ClampCoord(right), detail::ClampCoord(bottom), paint);
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::DrawPolygon(std::span<const Vector2> points, ColorRGBA color, FillRule rule, BlendMode mode)
+    {
+        BMPR_TIME(DrawPolygon);
+        const Rect bounds = Area();
+        if (points.size() < 3 || bounds.Empty())
+            return;
+
+        // Edge table: the edges crossing row centers inside the image, by the first row they cross
+        detail::PolygonScratch &scratch = detail::PolygonScratch::Get();
+        std::vector<detail::PolygonEdge> &edges = scratch.edges;
+        edges.clear();
+        for (std::size_t i = 0; i < points.size(); ++i)
+        {
+            detail::PolygonEdge edge;
+            if (detail::PolygonEdge::Make(points[i], points[(i + 1) % points.size()], bounds.y0, bounds.y1, edge))
+                edges.push_back(edge);
+        }
+        if (edges.empty())
+            return;
+        std::sort(edges.begin(), edges.end(), [](const detail::PolygonEdge &a, const detail::PolygonEdge &b)
+                  { return a.first < b.first; });
+
+        const detail::Paint paint = MakePaint(color, mode);
+        std::vector<std::uint32_t> &active = scratch.active;
+        auto &crossings = scratch.crossings;
+        active.clear();
+        std::size_t next = 0;
+        for (std::int32_t row = edges.front().first; next < edges.size() || !active.empty(); ++row)
+        {
+            // Skip the rows between disjoint parts of the outline
+            if (active.empty())
+                row = std::max(row, edges[next].first);
+            std::erase_if(active, [&](std::uint32_t i)
+                          { return edges[i].last <= row; });
+            for (; next < edges.size() && edges[next].first <= row; ++next)
+                active.push_back(static_cast<std::uint32_t>(next));
+
+            crossings.clear();
+            for (const std::uint32_t i : active)
+                crossings.emplace_back(edges[i].X(row), edges[i].winding);
+            std::sort(crossings.begin(), crossings.end());
+
+            // Spans run between the crossings where the rule switches from outside to inside and back, so none overlap
+            if (rule == FillRule::EvenOdd)
+                for (std::size_t i = 0; i + 1 < crossings.size(); i += 2)
+                    FillSpan(row, detail::CenterCoord(crossings[i].first), detail::CenterCoord(crossings[i + 1].first), paint);
+            else
+            {
+                std::int32_t winding = 0;
+                double start = 0.0;
+                for (const auto &[x, direction] : crossings)
+                {
+                    if (winding == 0)
+                        start = x;
+                    winding += direction;
+                    if (winding == 0)
+                        FillSpan(row, detail::CenterCoord(start), detail::CenterCoord(x), paint);
+                }
+            }
+        }
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::DrawTriangles(std::span<const Vector2> vertices, ColorRGBA color, BlendMode mode)
+    {
+        BMPR_TIME(DrawTriangles);
+        const Rect bounds = Area();
+        const detail::Paint paint = MakePaint(color, mode);
+        for (std::size_t i = 0; i + 3 <= vertices.size(); i += 3)
+            FillTriangle(vertices[i], vertices[i + 1], vertices[i + 2], bounds, paint);
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::DrawTriangles(std::span<const Vector2> vertices, std::span<const std::uint32_t> indices, ColorRGBA color, BlendMode mode)
+    {
+        BMPR_TIME(DrawTriangles);
+        const Rect bounds = Area();
+        const detail::Paint paint = MakePaint(color, mode);
+        for (std::size_t i = 0; i + 3 <= indices.size(); i += 3)
+            if (indices[i] < vertices.size() && indices[i + 1] < vertices.size() && indices[i + 2] < vertices.size())
+                FillTriangle(vertices[indices[i]], vertices[indices[i + 1]], vertices[indices[i + 2]], bounds, paint);
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::FillTriangle(const Vector2 &a, const Vector2 &b, const Vector2 &c, const Rect &bounds, const detail::Paint &paint)
+    {
+        // The same edges DrawPolygon builds, without the edge table: every row center inside crosses exactly two of them
+        detail::PolygonEdge edges[3];
+        std::size_t count = 0;
+        count += detail::PolygonEdge::Make(a, b, bounds.y0, bounds.y1, edges[count]);
+        count += detail::PolygonEdge::Make(b, c, bounds.y0, bounds.y1, edges[count]);
+        count += detail::PolygonEdge::Make(c, a, bounds.y0, bounds.y1, edges[count]);
+        if (count < 2)
+            return;
+
+        std::int32_t first = INT32_MAX, last = INT32_MIN;
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            first = std::min(first, edges[i].first);
+            last = std::max(last, edges[i].last);
+        }
+        for (std::int32_t row = first; row < last; ++row)
+        {
+            double x0 = 0.0, x1 = 0.0;
+            std::size_t crossed = 0;
+            for (std::size_t i = 0; i < count; ++i)
+                if (edges[i].first <= row && row < edges[i].last)
+                    (crossed++ == 0 ? x0 : x1) = edges[i].X(row);
+            if (crossed == 2)
+                FillSpan(row, detail::CenterCoord(std::min(x0, x1)), detail::CenterCoord(std::max(x0, x1)), paint);
+        }
+    }
+
+    template <typename Derived>
+    template <typename Source>
+    void ImageBase<Derived>::Composite(ImageBase<Source> &source, std::int32_t x, std::int32_t y, BlendMode mode, std::uint8_t opacity)
+    {
+        BMPR_TIME(Composite);
+        Source &from = static_cast<Source &>(source);
+        detail::ApplyOrientation(from);
+        const Rect from_area = from.Bounds();
+        const Rect area = detail::ClampedRect(x, y, std::int64_t{x} + (from_area.x1 - from_area.x0), std::int64_t{y} + (from_area.y1 - from_area.y0)).Intersect(Area());
+        if (from_area.Empty() || area.Empty())
+            return;
+
+        // Offset from image to source coordinates
+        const std::int32_t dx = static_cast<std::int32_t>(std::int64_t{from_area.x0} - x);
+        const std::int32_t dy = static_cast<std::int32_t>(std::int64_t{from_area.y0} - y);
+        const auto n = static_cast<std::size_t>(area.x1 - area.x0);
+        detail::MarkDirty(self(), area);
+        BMPR_STAT_ADD(pixels_written, n * static_cast<std::size_t>(area.y1 - area.y0));
+
+        using Row = decltype(self().RowPtr(0));
+        using SourceRow = decltype(from.RowPtr(0));
+        if constexpr (std::is_same_v<Row, SourceRow> && detail::RowTraits<Row>::kAlpha)
+        {
+            for (std::int32_t row = area.y0; row < area.y1; row++)
+                detail::CompositeRowAlpha(detail::Bytes(detail::Offset(self().RowPtr(row), area.x0)), detail::Bytes(detail::Offset(from.RowPtr(row + dy), area.x0 + dx)), n, opacity, mode);
+        }
+        else if constexpr (std::is_same_v<Row, SourceRow>)
+        {
+            for (std::int32_t row = area.y0; row < area.y1; row++)
+                detail::CompositeRow(detail::Offset(self().RowPtr(row), area.x0), detail::Offset(from.RowPtr(row + dy), area.x0 + dx), n, opacity, mode);
+        }
+        else
+        {
+            // Different layouts meet as BGRA, which every row type converts to and from, opaque sources with alpha 255
+            std::vector<std::uint8_t> pixels(n * 4), blended(n * 4);
+            for (std::int32_t row = area.y0; row < area.y1; row++)
+            {
+                const auto dst = detail::Offset(self().RowPtr(row), area.x0);
+                detail::EncodeRowBGRA(detail::Offset(from.RowPtr(row + dy), area.x0 + dx), n, pixels.data());
+                detail::EncodeRowBGRX(dst, n, blended.data());
+                if constexpr (detail::RowTraits<SourceRow>::kAlpha || detail::RowTraits<Row>::kAlpha)
+                    detail::CompositeRowAlpha(blended.data(), pixels.data(), n, opacity, mode);
+                else
+                    kernels::Blend(blended.data(), pixels.data(), n * 4, opacity, mode);
+                detail::DecodeRowBGRX(dst, n, blended.data());
+            }
+        }
+    }
+
+    template <typename Derived>
+    template <typename Source>
+    void ImageBase<Derived>::Composite(ImageBase<Source> &&source, std::int32_t x, std::int32_t y, BlendMode mode, std::uint8_t opacity)
+    {
+        Composite(source, x, y, mode, opacity);
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::DrawText(std::int32_t x, std::int32_t y, std::string_view text, std::int32_t size, ColorRGBA color, BlendMode mode)
+    {
+        BMPR_TIME(DrawText);
+        if (size < 1 || text.empty())
+            return;
+
+        const detail::GlyphAtlas &atlas = detail::GlyphAtlasFor(std::min(size, kMaxTextSize));
+        const Rect bounds = Area();
+        const detail::Paint paint = MakeCoveragePaint(color, mode);
+        // Runs of partly covered pixels blend as one span, with the alpha of the paint scaled by their coverage
+        detail::Paint edge = paint;
+        edge.store = false;
+        std::int64_t pen_x = x, pen_y = y;
+        for (const char c : text)
+        {
+            if (c == '\n')
+            {
+                pen_x = x;
+                pen_y += std::min(size, kMaxTextSize);
+                continue;
+            }
+
+            // Glyphs are clipped as a whole first, their rows run by run
+            const std::size_t glyph = detail::GlyphIndex(c);
+            const std::int64_t row_begin = std::max<std::int64_t>(pen_y, bounds.y0), row_end = std::min<std::int64_t>(pen_y + atlas.height, bounds.y1);
+            if (pen_x < bounds.x1 && pen_x + atlas.width > bounds.x0)
+                for (std::int64_t row = row_begin; row < row_end; ++row)
+                {
+                    const std::size_t index = glyph * static_cast<std::size_t>(atlas.height) + static_cast<std::size_t>(row - pen_y);
+                    for (std::uint32_t i = atlas.rows[index]; i < atlas.rows[index + 1]; ++i)
+                    {
+                        const detail::GlyphRun &run = atlas.runs[i];
+                        const auto x0 = static_cast<std::int32_t>(std::max<std::int64_t>(pen_x + run.x0, bounds.x0));
+                        const auto x1 = static_cast<std::int32_t>(std::min<std::int64_t>(pen_x + run.x1, bounds.x1));
+                        if (run.coverage == 255)
+                            FillSpan(static_cast<std::int32_t>(row), x0, x1, paint);
+                        else
+                        {
+                            edge.alpha = static_cast<std::uint8_t>(kernels::scalar::Div255(std::uint32_t{paint.alpha} * run.coverage));
+                            if (edge.alpha > 0)
+                                FillSpan(static_cast<std::int32_t>(row), x0, x1, edge);
+                        }
+                    }
+                }
+            pen_x += atlas.advance;
+        }
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::FillSpan(std::int32_t y, std::int32_t x0, std::int32_t x1, const detail::Paint &paint)
+    {
+        const Rect bounds = Area();
+        if (y < bounds.y0 || y >= bounds.y1)
+            return;
+
+        x0 = std::max(x0, bounds.x0);
+        x1 = std::min(x1, bounds.x1);
+
+        if (x0 < x1)
+        {
+            detail::MarkDirty(self(), {x0, y, x1, y + 1});
+            BMPR_STAT_ADD(spans_filled, 1);
+            BMPR_STAT_ADD(pixels_written, x1 - x0);
+            detail::PaintRow(self().RowPtr(y), x0, x1, paint);
+        }
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::Plot(std::int32_t x, std::int32_t y, const detail::Paint &paint)
+    {
+        detail::MarkDirty(self(), {x, y, x + 1, y + 1});
+        BMPR_STAT_ADD(pixels_written, 1);
+        if (paint.store)
+            detail::StorePixel(self().RowPtr(y), x, paint.color);
+        else
+            detail::BlendRow(self().RowPtr(y), x, x + 1, paint);
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::PlotSafe(std::int32_t x, std::int32_t y, const detail::Paint &paint)
+    {
+        const Rect bounds = Area();
+        if (x >= bounds.x0 && x < bounds.x1 && y >= bounds.y0 && y < bounds.y1)
+            Plot(x, y, paint);
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::PlotCoverage(std::int32_t x, std::int32_t y, const detail::Paint &paint, std::uint8_t coverage)
+    {
+        if (coverage == 255)
+        {
+            Plot(x, y, paint);
+            return;
+        }
+
+        const auto alpha = static_cast<std::uint8_t>(kernels::scalar::Div255(std::uint32_t{paint.alpha} * coverage));
+        if (alpha > 0)
+        {
+            detail::MarkDirty(self(), {x, y, x + 1, y + 1});
+            BMPR_STAT_ADD(pixels_written, 1);
+            detail::BlendPixel(self().RowPtr(y), x, paint, alpha);
+        }
+    }
+
+    template <typename Derived>
+    detail::Paint ImageBase<Derived>::MakePaint(const ColorRGBA &color, BlendMode mode)
+    {
+        return detail::MakePaint<decltype(self().RowPtr(0))>(color, mode);
+    }
+
+    template <typename Derived>
+    detail::Paint ImageBase<Derived>::MakeCoveragePaint(const ColorRGBA &color, BlendMode mode)
+    {
+        if (mode == BlendMode::Replace)
+            return MakePaint({color.r, color.g, color.b, 255}, BlendMode::Over);
+        return MakePaint(color, mode);
+    }
+
+    template <typename Derived>
+    template <typename Coverage>
+    void ImageBase<Derived>::DrawRadial(double x, double y, double inner, double outer, bool fill_inner, const detail::Paint &paint, Coverage &&coverage)
+    {
+        const Rect bounds = Area();
+        const std::int32_t row_begin = std::max(bounds.y0, detail::RoundCoord(std::ceil(y - outer)));
+        const auto row_end = static_cast<std::int32_t>(std::min<std::int64_t>(bounds.y1, std::int64_t{detail::RoundCoord(std::floor(y + outer))} + 1));
+
+        for (std::int32_t row = row_begin; row < row_end; row++)
+        {
+            const double dy = row - y;
+            if (outer * outer - dy * dy <= 0.0)
+                continue;
+            const double reach = std::sqrt(outer * outer - dy * dy);
+
+            // The columns closer than inner, empty when first > last
+            std::int64_t first = 1, last = 0;
+            if (inner > 0.0 && inner * inner - dy * dy >= 0.0)
+            {
+                const double inside = std::sqrt(inner * inner - dy * dy);
+                first = detail::RoundCoord(std::ceil(x - inside));
+                last = detail::RoundCoord(std::floor(x + inside));
+                if (fill_inner)
+                    FillSpan(row, static_cast<std::int32_t>(first), detail::ClampCoord(last + 1), paint);
+            }
+
+            const std::int64_t column_begin = std::max<std::int64_t>(bounds.x0, detail::RoundCoord(std::ceil(x - reach)));
+            const std::int64_t column_end = std::min<std::int64_t>(bounds.x1, std::int64_t{detail::RoundCoord(std::floor(x + reach))} + 1);
+            for (std::int64_t column = column_begin; column < column_end; column++)
+            {
+                if (column >= first && column <= last)
+                {
+                    column = last;
+                    continue;
+                }
+                const double distance = std::hypot(column - x, dy);
+                PlotCoverage(static_cast<std::int32_t>(column), row, paint, detail::CoverageByte(coverage(distance)));
+            }
+        }
+    }
+
+    template <typename Derived>
+    std::int32_t ImageBase<Derived>::CircleHalfWidth(std::int32_t r, std::int32_t dy)
+    {
+        // A pixel x1;dy is inside the circle when x1 * x1 + dy * dy < r * r + r
+        const std::int64_t limit = static_cast<std::int64_t>(r) * r + r - static_cast<std::int64_t>(dy) * dy;
+        if (limit <= 0)
+            return -1;
+
+        // Largest half_width with half_width * half_width < limit
+        std::int64_t half_width = static_cast<std::int64_t>(std::sqrt(static_cast<double>(limit - 1)));
+        while (half_width * half_width >= limit)
+            half_width--;
+        while ((half_width + 1) * (half_width + 1) < limit)
+            half_width++;
+
+        return static_cast<std::int32_t>(half_width);
+    }
+
+    template <typename Derived>
+    template <typename Fn>
+    void ImageBase<Derived>::TraceLine(std::int32_t x1, std::int32_t y1, std::int32_t x2, std::int32_t y2, const Rect &clip, Fn &&fn)
+    {
+        // Bresenham moves along the major axis every step, and after k steps has moved
+        // m(k) = (2 * minor * k + major - 1) / (2 * major) times along the minor one,
+        // so the first and last visible steps can be computed instead of searched for
+        const bool x_major = std::abs(std::int64_t{x2} - x1) >= std::abs(std::int64_t{y2} - y1);
+        const std::int64_t a1 = x_major ? x1 : y1, a2 = x_major ? x2 : y2;
+        const std::int64_t b1 = x_major ? y1 : x1, b2 = x_major ? y2 : x2;
+        const std::int64_t major = std::abs(a2 - a1), minor = std::abs(b2 - b1);
+        const std::int64_t sign_a = a1 < a2 ? 1 : -1, sign_b = b1 < b2 ? 1 : -1;
+
+        // Nothing to draw, or too long for the 64-bit step arithmetic below
+        if (major == 0 || major > INT32_MAX || clip.Empty())
+            return;
+
+        // Steps along one axis that keep start + sign * step within [lo;hi], limited to [0;limit]
+        const auto visible = [](std::int64_t lo, std::int64_t hi, std::int64_t start, std::int64_t sign, std::int64_t limit)
+        {
+            const std::int64_t first = sign > 0 ? lo - start : start - hi;
+            const std::int64_t last = sign > 0 ? hi - start : start - lo;
+            return std::pair<std::int64_t, std::int64_t>{std::max<std::int64_t>(first, 0), std::min(last, limit)};
+        };
+        auto [k_begin, k_end] = visible(x_major ? clip.x0 : clip.y0, (x_major ? clip.x1 : clip.y1) - 1, a1, sign_a, major - 1);
+        const auto [m_begin, m_end] = visible(x_major ? clip.y0 : clip.x0, (x_major ? clip.y1 : clip.x1) - 1, b1, sign_b, minor);
+        if (m_begin > m_end)
+            return;
+        if (minor > 0)
+        {
+            k_begin = std::max(k_begin, detail::CeilDiv(2 * major * m_begin - major + 1, 2 * minor));
+            k_end = std::min(k_end, detail::FloorDiv(2 * major * m_end + major, 2 * minor));
+        }
+
+        const std::int64_t start = 2 * minor * k_begin + major - 1;
+        std::int64_t m = start / (2 * major);
+        std::int64_t error = start % (2 * major);
+
+        for (std::int64_t k = k_begin; k <= k_end; k++)
+        {
+            const auto a = static_cast<std::int32_t>(a1 + sign_a * k);
+            const auto b = static_cast<std::int32_t>(b1 + sign_b * m);
+            if (x_major)
+                fn(a, b);
+            else
+                fn(b, a);
+
+            error += 2 * minor;
+            if (error >= 2 * major)
+            {
+                error -= 2 * major;
+                m++;
+            }
+        }
+    }
+
+    template <typename Derived>
+    template <typename Next>
+    void ImageBase<Derived>::DrawCurve(const Vector2 &start, const Vector2 &end, std::int64_t segments, Next &&next, const detail::Paint &paint)
+    {
+        const Rect bounds = Area();
+        const auto plot = [&](std::int32_t x, std::int32_t y)
+        { Plot(x, y, paint); };
+
+        // Every segment leaves out its last pixel, which the next one starts with
+        std::int32_t x = start.x, y = start.y;
+        for (std::int64_t i = 1; i <= segments; i++)
+        {
+            std::int32_t next_x = end.x, next_y = end.y;
+            if (i < segments)
+            {
+                const auto [fx, fy] = next();
+                next_x = detail::RoundCoord(fx);
+                next_y = detail::RoundCoord(fy);
+            }
+            TraceLine(x, y, next_x, next_y, bounds, plot);
+            x = next_x;
+            y = next_y;
+        }
+        PlotSafe(end.x, end.y, paint);
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::Clear(const Color &color)
+    {
+        Clear(color, Executor::Serial());
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::Clear(const Color &color, Executor &executor)
+    {
+        BMPR_TIME(Clear);
+        const Rect area = TouchArea();
+
+        executor.ParallelFor(area.y0, area.y1, [&](std::int32_t y0, std::int32_t y1)
+                             {
+                                 for (std::int32_t y = y0; y < y1; ++y)
+                                     detail::FillRow(self().RowPtr(y), area.x0, area.x1, color);
+                             });
+    }
+
+    template <typename Derived>
+    constexpr Encoding ImageBase<Derived>::NativeEncoding()
+    {
+        return detail::RowTraits<decltype(std::declval<Derived &>().RowPtr(0))>::kEncoding;
+    }
+
+    template <typename Derived>
+    std::size_t ImageBase<Derived>::EncodedSize() const
+    {
+        return EncodedSize(NativeEncoding());
+    }
+
+    template <typename Derived>
+    std::size_t ImageBase<Derived>::EncodedSize(Encoding encoding) const
+    {
+        const std::uint16_t bit_depth = detail::BitDepth(encoding);
+        if (bit_depth == 0)
+            return 0;
+        const std::size_t table_size = bit_depth == 8 ? 256 * 4 : 0;
+        const Rect area = self().Bounds();
+        if (area.Empty())
+            return sizeof(Header) + table_size;
+        return sizeof(Header) + table_size + detail::IndexedRowSize(area.x1 - area.x0, bit_depth) * static_cast<std::size_t>(area.y1 - area.y0);
+    }
+
+    template <typename Derived>
+    std::size_t ImageBase<Derived>::SaveTo(std::span<std::uint8_t> out)
+    {
+        return SaveTo(out, NativeEncoding(), Executor::Serial());
+    }
+
+    template <typename Derived>
+    std::size_t ImageBase<Derived>::SaveTo(std::span<std::uint8_t> out, Executor &executor)
+    {
+        return SaveTo(out, NativeEncoding(), executor);
+    }
+
+    template <typename Derived>
+    std::size_t ImageBase<Derived>::SaveTo(std::span<std::uint8_t> out, Encoding encoding)
+    {
+        return SaveTo(out, encoding, Executor::Serial());
+    }
+
+    template <typename Derived>
+    std::size_t ImageBase<Derived>::SaveTo(std::span<std::uint8_t> out, Encoding encoding, Executor &executor)
+    {
+        BMPR_TIME(Encode);
+        const Rect area = self().Bounds();
+        const std::int32_t width = area.Empty() ? 0 : area.x1 - area.x0;
+        const std::int32_t height = area.Empty() ? 0 : area.y1 - area.y0;
+        const std::uint16_t bit_depth = detail::BitDepth(encoding);
+        const std::size_t bytes_per_pixel = bit_depth / 8;
+        const std::size_t row_size = detail::IndexedRowSize(width, bit_depth);
+        const std::size_t size = EncodedSize(encoding);
+
+        if (size == 0 || out.size() < size)
+            return 0;
+        BMPR_STAT_ADD(bytes_encoded, size);
+
+        const Header header = detail::MakeHeader(width, height, encoding);
+        std::memcpy(out.data(), &header, sizeof(header));
+        // 8-bit pixels index a ramp of grays, so they hold the gray level itself
+        for (std::size_t i = 0; i < header.colors_used; ++i)
+        {
+            std::uint8_t *entry = out.data() + sizeof(Header) + i * 4;
+            entry[0] = entry[1] = entry[2] = static_cast<std::uint8_t>(i);
+            entry[3] = 0;
+        }
+
+        // Rows are stored bottom-up, each padded to a multiple of 4 bytes.
+        // Flips deferred with lazy orientation only change the order the pixels are written in
+        const Orientation orientation = detail::PendingOrientation(self());
+        std::uint8_t *pixels = out.data() + header.data_offset;
+        executor.ParallelFor(0, height, [&](std::int32_t y0, std::int32_t y1)
+                             {
+                                 for (std::int32_t y = y0; y < y1; ++y)
+                                 {
+                                     std::uint8_t *line = pixels + static_cast<std::size_t>(height - 1 - y) * row_size;
+                                     const std::int32_t source = orientation.flip_y ? area.y1 - 1 - y : area.y0 + y;
+                                     detail::EncodeRow(detail::Offset(self().RowPtr(source), area.x0), width, encoding, line);
+                                     if (orientation.flip_x)
+                                         detail::ReversePixels(line, width, bytes_per_pixel);
+                                     std::memset(line + width * bytes_per_pixel, 0, row_size - width * bytes_per_pixel);
+                                 }
+                             });
+
+        return size;
+    }
+
+    template <typename Derived>
+    bool ImageBase<Derived>::SaveToBuffer(std::vector<std::uint8_t> &buffer)
+    {
+        return SaveToBuffer(buffer, Executor::Serial());
+    }
+
+    template <typename Derived>
+    bool ImageBase<Derived>::SaveToBuffer(std::vector<std::uint8_t> &buffer, Executor &executor)
+    {
+        buffer.resize(EncodedSize());
+        return SaveTo(buffer, executor) == buffer.size();
+    }
+
+    template <typename Derived>
+    bool ImageBase<Derived>::SaveToBuffer(std::vector<std::uint8_t> &buffer, Encoding encoding)
+    {
+        return SaveToBuffer(buffer, encoding, Executor::Serial());
+    }
+
+    template <typename Derived>
+    bool ImageBase<Derived>::SaveToBuffer(std::vector<std::uint8_t> &buffer, Encoding encoding, Executor &executor)
+    {
+        if (encoding == NativeEncoding())
+            return SaveToBuffer(buffer, executor);
+        if (detail::BitDepth(encoding) != 0)
+        {
+            buffer.resize(EncodedSize(encoding));
+            return SaveTo(buffer, encoding, executor) == buffer.size();
+        }
+        if (self().Bounds().Empty())
+            return SaveToBuffer(buffer, executor);
+        // Palettes drop alpha, so it is never the smallest encoding that keeps the image
+        if (encoding == Encoding::Smallest && NativeEncoding() == Encoding::BGRA32)
+            return SaveToBuffer(buffer, executor);
+
+        detail::Palette palette;
+        const bool indexed = ScanPalette(palette, executor);
+        const std::size_t colors = palette.Size();
+        switch (encoding)
+        {
+        case Encoding::Palette1:
+            return indexed && colors <= 2 && (EncodeIndexed(buffer, palette, 1, 0, executor), true);
+        case Encoding::Palette4:
+            return indexed && colors <= 16 && (EncodeIndexed(buffer, palette, 4, 0, executor), true);
+        case Encoding::Palette8:
+            return indexed && (EncodeIndexed(buffer, palette, 8, 0, executor), true);
+        case Encoding::RLE4:
+            return indexed && colors <= 16 && (EncodeIndexed(buffer, palette, 4, 2, executor), true);
+        case Encoding::RLE8:
+            return indexed && (EncodeIndexed(buffer, palette, 8, 1, executor), true);
+        default:
+            break;
+        }
+
+        // Smallest: the uncompressed sizes are known up front, RLE has to be tried
+        if (!indexed)
+            return SaveToBuffer(buffer, executor);
+        const Rect area = self().Bounds();
+        const std::uint16_t bits_per_pixel = colors <= 2 ? 1 : colors <= 16 ? 4 : 8;
+        const std::size_t packed = sizeof(Header) + colors * 4 + detail::IndexedRowSize(area.x1 - area.x0, bits_per_pixel) * static_cast<std::size_t>(area.y1 - area.y0);
+
+        EncodeIndexed(buffer, palette, colors <= 16 ? 4 : 8, colors <= 16 ? 2 : 1, executor);
+        if (packed < buffer.size())
+            EncodeIndexed(buffer, palette, bits_per_pixel, 0, executor);
+        if (EncodedSize() < buffer.size())
+            return SaveToBuffer(buffer, executor);
+        return true;
+    }
+
+    template <typename Derived>
+    bool ImageBase<Derived>::Save(const std::string &path, Encoding encoding)
+    {
+        return Save(path, encoding, Executor::Serial());
+    }
+
+    template <typename Derived>
+    bool ImageBase<Derived>::Save(const std::string &path, Encoding encoding, Executor &executor)
+    {
+        if (detail::BitDepth(encoding) != 0)
+            return SaveUncompressed(path, encoding, executor);
+
+        std::vector<std::uint8_t> buffer;
+        return SaveToBuffer(buffer, encoding, executor) && detail::WriteFile(path, buffer.data(), buffer.size());
+    }
+
+    template <typename Derived>
+    bool ImageBase<Derived>::ScanPalette(detail::Palette &palette, Executor &executor)
+    {
+        const Rect area = self().Bounds();
+        const auto width = static_cast<std::size_t>(area.x1 - area.x0);
+        const std::int32_t grain = executor.Grain();
+
+        // Every band collects its own colors, merged in band order once all are done
+        std::vector<detail::Palette> bands(static_cast<std::size_t>((area.y1 - area.y0 - 1) / grain + 1));
+        std::atomic<bool> overflow{false};
+        executor.ParallelFor(area.y0, area.y1, [&](std::int32_t y0, std::int32_t y1)
+                             {
+                                 detail::Palette &band = bands[static_cast<std::size_t>((y0 - area.y0) / grain)];
+                                 std::vector<std::uint32_t> row(width);
+                                 for (std::int32_t y = y0; y < y1 && !overflow.load(std::memory_order_relaxed); ++y)
+                                 {
+                                     detail::EncodeRowColors(detail::Offset(self().RowPtr(y), area.x0), width, reinterpret_cast<std::uint8_t *>(row.data()));
+                                     for (const std::uint32_t color : row)
+                                         if (!band.Insert(color))
+                                         {
+                                             overflow = true;
+                                             return;
+                                         }
+                                 } });
+        if (overflow)
+            return false;
+
+        for (const detail::Palette &band : bands)
+            for (std::size_t i = 0; i < band.Size(); ++i)
+                if (!palette.Insert(band.Colors()[i]))
+                    return false;
+        palette.Sort();
+        return true;
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::EncodeIndexed(std::vector<std::uint8_t> &buffer, const detail::Palette &palette, std::uint16_t bits_per_pixel, std::uint32_t compression, Executor &executor)
+    {
+        BMPR_TIME(Encode);
+        const Rect area = self().Bounds();
+        const std::int32_t width = area.x1 - area.x0, height = area.y1 - area.y0;
+        const std::size_t row_size = detail::IndexedRowSize(width, bits_per_pixel);
+        const std::size_t table_size = palette.Size() * 4;
+        const Orientation orientation = detail::PendingOrientation(self());
+        const std::int32_t grain = executor.Grain();
+
+        // Fills indices with row y of the saved image, counted from the top
+        const auto index_row = [&](std::int32_t y, std::vector<std::uint32_t> &colors, std::vector<std::uint8_t> &indices)
+        {
+            const std::int32_t source = orientation.flip_y ? area.y1 - 1 - y : area.y0 + y;
+            detail::EncodeRowColors(detail::Offset(self().RowPtr(source), area.x0), static_cast<std::size_t>(width), reinterpret_cast<std::uint8_t *>(colors.data()));
+            for (std::size_t x = 0; x < colors.size(); ++x)
+                indices[x] = palette.Find(colors[x]);
+            if (orientation.flip_x)
+                std::reverse(indices.begin(), indices.end());
+        };
+
+        // Bottom-up rows of fixed size are encoded in place, RLE rows into one buffer per band, joined afterwards
+        std::vector<std::vector<std::uint8_t>> bands(compression != 0 ? static_cast<std::size_t>((height - 1) / grain + 1) : 0);
+        buffer.resize(sizeof(Header) + table_size + (compression != 0 ? 0 : row_size * static_cast<std::size_t>(height)));
+        executor.ParallelFor(0, height, [&](std::int32_t y0, std::int32_t y1)
+                             {
+                                 std::vector<std::uint32_t> colors(static_cast<std::size_t>(width));
+                                 std::vector<std::uint8_t> indices(static_cast<std::size_t>(width));
+                                 std::uint8_t *pixels = buffer.data() + sizeof(Header) + table_size;
+                                 for (std::int32_t y = y1 - 1; y >= y0; --y)
+                                 {
+                                     index_row(y, colors, indices);
+                                     if (compression != 0)
+                                         detail::EncodeRowRLE(indices.data(), indices.size(), bits_per_pixel, y == 0, bands[static_cast<std::size_t>(y0 / grain)]);
+                                     else
+                                     {
+                                         std::uint8_t *line = pixels + static_cast<std::size_t>(height - 1 - y) * row_size;
+                                         std::memset(line, 0, row_size);
+                                         if (bits_per_pixel == 8)
+                                             std::memcpy(line, indices.data(), indices.size());
+                                         else
+                                             detail::PackIndices(indices.data(), indices.size(), bits_per_pixel, line);
+                                     }
+                                 } });
+        for (auto band = bands.rbegin(); band != bands.rend(); ++band)
+            buffer.insert(buffer.end(), band->begin(), band->end());
+
+        const Header header = detail::MakeHeader(width, height, bits_per_pixel, compression, static_cast<std::uint32_t>(palette.Size()),
+                                                 buffer.size() - sizeof(Header) - table_size);
+        std::memcpy(buffer.data(), &header, sizeof(header));
+        std::memcpy(buffer.data() + sizeof(Header), palette.Colors(), table_size);
+        BMPR_STAT_ADD(bytes_encoded, buffer.size());
+    }
+
+    template <typename Derived>
+    bool ImageBase<Derived>::Save(const std::string &path)
+    {
+        return Save(path, Executor::Serial());
+    }
+
+    template <typename Derived>
+    bool ImageBase<Derived>::Save(const std::string &path, Executor &executor)
+    {
+        return SaveUncompressed(path, NativeEncoding(), executor);
+    }
+
+    template <typename Derived>
+    bool ImageBase<Derived>::SaveUncompressed(const std::string &path, Encoding encoding, Executor &executor)
+    {
+#if defined(BMPR_POSIX)
+        // Allocate the file up front and encode straight into its pages. Without the space allocated, writing through the
+        // mapping could raise SIGBUS on a full disk, so the bytes are written instead and a full disk fails the write
+        const std::size_t size = EncodedSize(encoding);
+        const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+
+        bool ok = false;
+        void *map = MAP_FAILED;
+        if (detail::AllocateFile(fd, size))
+            map = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            ok = SaveTo({static_cast<std::uint8_t *>(map), size}, encoding, executor) == size;
+            ok = ::munmap(map, size) == 0 && ok;
+        }
+        else
+        {
+            // The file may have been partly allocated, the write starts over from an empty one
+            std::vector<std::uint8_t> buffer;
+            ok = ::ftruncate(fd, 0) == 0 && SaveToBuffer(buffer, encoding, executor) && detail::WriteAll(fd, buffer.data(), buffer.size());
+        }
+
+        return ::close(fd) == 0 && ok;
+#else
+        std::vector<std::uint8_t> buffer;
+        return SaveToBuffer(buffer, encoding, executor) && detail::WriteFile(path, buffer.data(), buffer.size());
+#endif
+    }
+
+    template <typename Derived>
+    std::optional<Derived> ImageBase<Derived>::Load(const std::string &path)
+    {
+        const detail::MappedFile file(path);
+        if (!file.IsOpen())
+            return std::nullopt;
+
+        return FromMemory(file.Data(), file.Size());
+    }
+
+    template <typename Derived>
+    std::optional<Derived> ImageBase<Derived>::FromMemory(const std::uint8_t *data, std::size_t size)
+    {
+        const std::optional<detail::BmpLayout> layout = detail::ParseHeader(data, size);
+        if (!layout)
+            return std::nullopt;
+
+        // Every pixel is decoded below
+        std::optional<Derived> image{std::in_place, layout->width, layout->height, Uninitialized};
+        image->DecodeRows(*layout, data);
+        return image;
+    }
+
+    template <typename Derived>
+    bool ImageBase<Derived>::Decode(const std::uint8_t *data, std::size_t size)
+    {
+        const std::optional<detail::BmpLayout> layout = detail::ParseHeader(data, size);
+        if (!layout)
+            return false;
+
+        self().Reset(static_cast<std::size_t>(layout->width), static_cast<std::size_t>(layout->height), Uninitialized);
+        DecodeRows(*layout, data);
+        return true;
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::DecodeRows(const detail::BmpLayout &layout, const std::uint8_t *data)
+    {
+        // Indexed pixels are looked up in the color table as opaque BGRX, unless the table is the gray ramp Save writes and
+        // the image is gray, which takes them as they are. 1 and 4-bit and run-length encoded rows are unpacked to 8-bit
+        // indices first
+        std::uint8_t table[256 * 4] = {};
+        std::vector<std::uint8_t> colors, indices;
+        bool ramp = false;
+        if (layout.bit_depth <= 8)
+        {
+            std::memcpy(table, data + layout.palette_offset, layout.palette_size * 4);
+            ramp = std::is_same_v<decltype(self().RowPtr(0)), Gray *>;
+            for (std::size_t i = 0; i < 256; ++i)
+            {
+                ramp = ramp && table[i * 4] == i && table[i * 4 + 1] == i && table[i * 4 + 2] == i;
+                table[i * 4 + 3] = 255;
+            }
+            colors.resize(static_cast<std::size_t>(layout.width) * 4);
+            if (layout.bit_depth < 8 || layout.rle)
+                indices.resize(static_cast<std::size_t>(layout.width));
+        }
+        detail::RleReader runs(data + layout.data_offset, layout.data_size, layout.bit_depth);
+
+        // Decode every stored row straight into its destination row
+        const std::uint8_t *line = data + layout.data_offset;
+        for (std::int32_t i = 0; i < layout.height; ++i, line += layout.row_size)
+        {
+            const std::int32_t y = layout.top_down ? i : layout.height - 1 - i;
+            if (layout.bit_depth == 32)
+                detail::DecodeRowBGRX(self().RowPtr(y), layout.width, line);
+            else if (layout.bit_depth == 24)
+                detail::DecodeRowBGR(self().RowPtr(y), layout.width, line);
+            else
+            {
+                const std::uint8_t *row = indices.empty() ? line : indices.data();
+                if (layout.rle)
+                    runs.Row(indices.data(), indices.size());
+                else if (layout.bit_depth < 8)
+                    detail::UnpackIndices(line, indices.size(), layout.bit_depth, indices.data());
+                if constexpr (std::is_same_v<decltype(self().RowPtr(0)), Gray *>)
+                {
+                    if (ramp)
+                    {
+                        std::memcpy(detail::Bytes(self().RowPtr(y)), row, static_cast<std::size_t>(layout.width));
+                        continue;
+                    }
+                }
+                for (std::int32_t x = 0; x < layout.width; ++x)
+                    std::memcpy(colors.data() + x * 4, table + row[x] * 4, 4);
+                detail::DecodeRowBGRX(self().RowPtr(y), layout.width, colors.data());
+            }
+        }
+    }
+
+    template <typename Derived>
+    bool ImageBase<Derived>::Transform(const Affine &transform, Filter filter)
+    {
+        return Transform(transform, filter, Executor::Serial());
+    }
+
+    template <typename Derived>
+    bool ImageBase<Derived>::Transform(const Affine &transform, Filter filter, Executor &executor)
+    {
+        BMPR_TIME(Transform);
+        const std::optional<Affine> inverse = transform.Inverse();
+        if (!inverse)
+            return false;
+
+        const Rect area = TouchArea();
+        if (area.Empty())
+            return true;
+        const std::int32_t width = area.x1 - area.x0;
+        const std::int32_t height = area.y1 - area.y0;
+
+        // Sample from a BGRX copy, so the rows can be overwritten in any order
+        const std::size_t stride = static_cast<std::size_t>(width) * 4;
+        std::vector<std::uint8_t, AlignedAllocator<std::uint8_t>> source(stride * height);
+        executor.ParallelFor(area.y0, area.y1, [&](std::int32_t y0, std::int32_t y1)
+                             {
+                                 for (std::int32_t y = y0; y < y1; ++y)
+                                     detail::EncodeRowBGRX(detail::Offset(self().RowPtr(y), area.x0), width, source.data() + (y - area.y0) * stride);
+                             });
+
+        // Source positions in 16.16 fixed point, clamped so stepping across a tile can't overflow.
+        // Bilinear positions are moved half a pixel back, to the top-left pixel center of their 2x2 block
+        const auto fixed = [](double v, double limit)
+        { return static_cast<std::int64_t>(std::llround(std::clamp(v * 65536.0, -limit, limit))); };
+        filter = filter == Filter::Lanczos ? Filter::Bilinear : filter == Filter::Box ? Filter::Nearest : filter;
+        const double half = filter == Filter::Bilinear ? 0.5 : 0.0;
+        const std::int64_t du = fixed(inverse->xx, 0x1p31), dv = fixed(inverse->yx, 0x1p31);
+
+        // Destination tiles small enough that the source pixels they read stay in cache.
+        // Every row of a tile starts from an exact position and steps from there
+        constexpr std::int32_t tile = 64;
+        executor.ParallelFor(0, (height - 1) / tile + 1, 1, [&](std::int32_t t0, std::int32_t t1)
+                             {
+                                 alignas(16) std::uint8_t line[tile * 4];
+                                 for (std::int32_t ty = t0 * tile; ty < std::min(t1 * tile, height); ty += tile)
+                                     for (std::int32_t tx = 0; tx < width; tx += tile)
+                                     {
+                                         const std::int32_t n = std::min(tile, width - tx);
+                                         for (std::int32_t y = ty; y < std::min(ty + tile, height); ++y)
+                                         {
+                                             const double cx = tx + 0.5, cy = y + 0.5;
+                                             const std::int64_t u = fixed(inverse->xx * cx + inverse->xy * cy + inverse->tx - half, 0x1p46);
+                                             const std::int64_t v = fixed(inverse->yx * cx + inverse->yy * cy + inverse->ty - half, 0x1p46);
+                                             detail::SampleRow(source.data(), width, height, filter, u, v, du, dv, n, line);
+                                             detail::DecodeRowBGRX(detail::Offset(self().RowPtr(area.y0 + y), area.x0 + tx), n, line);
+                                         }
+                                     }
+                             });
+        return true;
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::Rotate(float degrees, Filter filter)
+    {
+        Rotate(degrees, filter, Executor::Serial());
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::Rotate(float degrees, Filter filter, Executor &executor)
+    {
+        const Rect area = Area();
+        Transform(Affine::Rotation(degrees, (area.x1 - area.x0) / 2.0, (area.y1 - area.y0) / 2.0), filter, executor);
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::Resize(std::size_t width, std::size_t height, Filter filter)
+    {
+        Resize(width, height, filter, Executor::Serial());
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::Resize(std::size_t width, std::size_t height, Filter filter, Executor &executor)
+    {
+        BMPR_TIME(Resize);
+        const Rect area = Area();
+        const std::int32_t src_width = area.x1 - area.x0, src_height = area.y1 - area.y0;
+        const auto dst_width = static_cast<std::int32_t>(width), dst_height = static_cast<std::int32_t>(height);
+        if (dst_width == src_width && dst_height == src_height)
+            return;
+        if (area.Empty() || width == 0 || height == 0)
+        {
+            self().Reset(width, height);
+            return;
+        }
+
+        const detail::ResampleWeights columns = detail::MakeResampleWeights(src_width, dst_width, filter);
+        const detail::ResampleWeights rows = detail::MakeResampleWeights(src_height, dst_height, filter);
+
+        // Horizontal pass into a BGRX copy of the source rows the vertical pass reads, already at the new width. Pixels
+        // with alpha are filtered premultiplied
+        using Row = decltype(self().RowPtr(0));
+        const std::int32_t row0 = rows.starts.front(), row1 = rows.starts.back() + static_cast<std::int32_t>(rows.taps);
+        const std::size_t stride = static_cast<std::size_t>(dst_width) * 4;
+        std::vector<std::uint8_t, AlignedAllocator<std::uint8_t>> copy(stride * static_cast<std::size_t>(row1 - row0));
+        executor.ParallelFor(row0, row1, [&](std::int32_t y0, std::int32_t y1)
+                             {
+                                 std::vector<std::uint8_t> line(static_cast<std::size_t>(src_width) * 4);
+                                 for (std::int32_t y = y0; y < y1; ++y)
+                                 {
+                                     detail::EncodeRowBGRX(detail::Offset(self().RowPtr(area.y0 + y), area.x0), src_width, line.data());
+                                     if constexpr (detail::RowTraits<Row>::kAlpha)
+                                         detail::PremultiplyBGRA(line.data(), static_cast<std::size_t>(src_width));
+                                     kernels::Resample(copy.data() + static_cast<std::size_t>(y - row0) * stride, line.data(), columns.starts.data(),
+                                                       columns.weights.data(), columns.taps, width);
+                                 }
+                             });
+
+        // Vertical pass into the resized image, a strip of the rows at a time so the rows under the filter stay in cache
+        self().Reset(width, height, Uninitialized);
+        executor.ParallelFor(0, dst_height, [&](std::int32_t y0, std::int32_t y1)
+                             {
+                                 constexpr std::size_t strip = 1024;
+                                 std::vector<const std::uint8_t *> taps(rows.taps);
+                                 alignas(32) std::uint8_t out[strip];
+                                 for (std::size_t sx = 0; sx < stride; sx += strip)
+                                 {
+                                     const std::size_t n = std::min(strip, stride - sx);
+                                     for (std::int32_t y = y0; y < y1; ++y)
+                                     {
+                                         const std::uint8_t *first = copy.data() + static_cast<std::size_t>(rows.starts[y] - row0) * stride + sx;
+                                         for (std::size_t k = 0; k < rows.taps; ++k)
+                                             taps[k] = first + k * stride;
+                                         kernels::Convolve(out, taps.data(), rows.weights.data() + static_cast<std::size_t>(y) * rows.taps, rows.taps, n);
+                                         const auto row = detail::Offset(self().RowPtr(y), static_cast<std::int32_t>(sx / 4));
+                                         if constexpr (detail::RowTraits<Row>::kAlpha)
+                                             detail::DecodeRowPremultiplied(row, n / 4, out);
+                                         else
+                                             detail::DecodeRowBGRX(row, n / 4, out);
+                                     }
+                                 }
+                             });
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::Rotate180()
+    {
+        Rotate180(Executor::Serial());
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::Rotate180(Executor &executor)
+    {
+        BMPR_TIME(Rotate180);
+        const Rect area = TouchArea();
+        if (area.Empty())
+            return;
+        const std::int32_t width = area.x1 - area.x0;
+        const std::int32_t height = area.y1 - area.y0;
+
+        // Row y trades places with row height - 1 - y, both reversed. An odd middle row is only reversed
+        executor.ParallelFor(0, (height + 1) / 2, [&](std::int32_t y0, std::int32_t y1)
+                             {
+                                 for (std::int32_t y = y0; y < y1; ++y)
+                                 {
+                                     auto top = detail::Offset(self().RowPtr(area.y0 + y), area.x0);
+                                     auto bottom = detail::Offset(self().RowPtr(area.y1 - 1 - y), area.x0);
+                                     if (y != height - 1 - y)
+                                     {
+                                         detail::SwapRows(top, bottom, width);
+                                         detail::ReverseRow(bottom, width);
+                                     }
+                                     detail::ReverseRow(top, width);
+                                 }
+                             });
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::FlipHorizontally()
+    {
+        FlipHorizontally(Executor::Serial());
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::FlipHorizontally(Executor &executor)
+    {
+        BMPR_TIME(FlipHorizontally);
+        const Rect area = TouchArea();
+        if (area.Empty())
+            return;
+
+        executor.ParallelFor(area.y0, area.y1, [&](std::int32_t y0, std::int32_t y1)
+                             {
+                                 for (std::int32_t y = y0; y < y1; ++y)
+                                     detail::ReverseRow(detail::Offset(self().RowPtr(y), area.x0), area.x1 - area.x0);
+                             });
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::FlipVertically()
+    {
+        FlipVertically(Executor::Serial());
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::FlipVertically(Executor &executor)
+    {
+        BMPR_TIME(FlipVertically);
+        const Rect area = TouchArea();
+        if (area.Empty())
+            return;
+
+        executor.ParallelFor(0, (area.y1 - area.y0) / 2, [&](std::int32_t y0, std::int32_t y1)
+                             {
+                                 for (std::int32_t y = y0; y < y1; ++y)
+                                     detail::SwapRows(detail::Offset(self().RowPtr(area.y0 + y), area.x0),
+                                                      detail::Offset(self().RowPtr(area.y1 - 1 - y), area.x0), area.x1 - area.x0);
+                             });
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::Invert()
+    {
+        Invert(Executor::Serial());
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::Invert(Executor &executor)
+    {
+        BMPR_TIME(Invert);
+        const Rect area = TouchArea();
+        if (area.Empty())
+            return;
+
+        executor.ParallelFor(area.y0, area.y1, [&](std::int32_t y0, std::int32_t y1)
+                             {
+                                 for (std::int32_t y = y0; y < y1; ++y)
+                                     detail::InvertRow(detail::Offset(self().RowPtr(y), area.x0), area.x1 - area.x0);
+                             });
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::FillRandom(std::uint64_t seed)
+    {
+        FillRandom(seed, Executor::Serial());
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::FillRandom(std::uint64_t seed, Executor &executor)
+    {
+        BMPR_TIME(FillRandom);
+        const Rect area = TouchArea();
+        if (area.Empty())
+            return;
+
+        // Every row is a stream of BGR bytes of its own, keyed by seed and the row, so bands can fill rows in any order.
+        // The bytes are made a chunk at a time and converted to the pixel layout while still in cache
+        constexpr std::int32_t chunk = 1024;
+        executor.ParallelFor(area.y0, area.y1, [&](std::int32_t y0, std::int32_t y1)
+                             {
+                                 alignas(32) std::uint8_t line[chunk * 3];
+                                 for (std::int32_t y = y0; y < y1; ++y)
+                                 {
+                                     std::uint64_t state = seed + static_cast<std::uint64_t>(y - area.y0) * 0x9e3779b97f4a7c15;
+                                     const std::uint64_t key = Rng::SplitMix64(state);
+                                     for (std::int32_t x = area.x0; x < area.x1; x += chunk)
+                                     {
+                                         const std::int32_t n = std::min(chunk, area.x1 - x);
+                                         const auto counter = static_cast<std::uint32_t>((x - area.x0) / 4 * 3);
+                                         kernels::Random(line, static_cast<std::size_t>(n) * 3, key, counter);
+                                         detail::DecodeRowBGR(detail::Offset(self().RowPtr(y), x), n, line);
+                                     }
+                                 }
+                             });
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::BoxBlur(std::int32_t radius)
+    {
+        BoxBlur(radius, Executor::Serial());
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::BoxBlur(std::int32_t radius, Executor &executor)
+    {
+        BMPR_TIME(BoxBlur);
+        if (radius <= 0)
+            return;
+        radius = std::min(radius, 32767);
+
+        const std::uint32_t scale = detail::BoxScale(radius);
+        FilterSeparable(radius, [&](const std::uint8_t *line, std::uint8_t *out, std::int32_t width)
+                        { kernels::BoxRow(line, out, static_cast<std::size_t>(width), static_cast<std::size_t>(radius), scale); },
+                        [&](const std::uint8_t *copy, std::size_t stride, std::int32_t height, std::int32_t y0, std::int32_t y1, auto &&emit)
+                        {
+                            // Running column sums over a strip of the rows at a time, small enough to stay in the L1 cache
+                            constexpr std::size_t strip = 1024;
+                            std::uint32_t sum[strip];
+                            alignas(32) std::uint8_t out[strip];
+                            for (std::size_t sx = 0; sx < stride; sx += strip)
+                            {
+                                const std::size_t n = std::min(strip, stride - sx);
+                                const auto row = [&](std::int64_t y)
+                                { return copy + static_cast<std::size_t>(std::clamp<std::int64_t>(y, 0, height - 1)) * stride + sx; };
+                                const auto add = [&](const std::uint8_t *pixels, std::uint32_t times)
+                                {
+                                    for (std::size_t i = 0; i < n; i++)
+                                        sum[i] += pixels[i] * times;
+                                };
+
+                                // The window of row y0 without its last row, rows beyond the edges added as multiples of the edge rows
+                                const std::int64_t top = std::int64_t{y0} - radius, bottom = std::int64_t{y0} + radius;
+                                std::fill_n(sum, n, 0);
+                                add(row(0), static_cast<std::uint32_t>(std::max<std::int64_t>(0, std::min<std::int64_t>(bottom, 0) - top)));
+                                for (std::int64_t y = std::max<std::int64_t>(top, 0); y < std::min<std::int64_t>(bottom, height); ++y)
+                                    add(row(y), 1);
+                                add(row(height - 1), static_cast<std::uint32_t>(std::max<std::int64_t>(0, bottom - std::max<std::int64_t>(top, height))));
+
+                                for (std::int32_t y = y0; y < y1; ++y)
+                                {
+                                    kernels::BoxColumns(sum, row(std::int64_t{y} + radius), row(std::int64_t{y} - radius), scale, out, n);
+                                    emit(y, static_cast<std::int32_t>(sx / 4), static_cast<std::int32_t>(n / 4), out);
+                                }
+                            }
+                        },
+                        executor);
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::GaussianBlur(float sigma)
+    {
+        GaussianBlur(sigma, Executor::Serial());
+    }
+
+    template <typename Derived>
+    void ImageBase<Derived>::GaussianBlur(float sigma, Executor &executor)
+    {
+        BMPR_TIME(GaussianBlur);
+        if (!(sigma > 0.0f) || !std::isfinite(sigma))
+            return;
+
+        if (sigma <= 5.0f)
+        {
+            // Sampled kernel out to 3 sigma, at most 31 weights
+            float kernel[31];
+            const auto radius = static_cast<std::int32_t>(std::ceil(3.0f * sigma));
+            float sum = 0.0f;
+            for (std::int32_t i = -radius; i <= radius; ++i)
+                sum += kernel[i + radius] = std::exp(-0.5f * static_cast<float>(i * i) / (sigma * sigma));
+            for (std::int32_t i = 0; i <= 2 * radius; ++i)
+                kernel[i] /= sum;
+            const std::span<const float> weights(kernel, static_cast<std::size_t>(2 * radius + 1));
+            Convolve(weights, weights, executor);
+            return;
+        }
+
+        // Three box blurs of sizes around sqrt(4 sigma^2 + 1), the first m a size smaller so the variances add up to sigma^2
+        // Sizes stay at most 65535, the largest BoxBlur takes, larger sigmas blurring as the largest one that fits
+        constexpr double kMaxLower = 65533.0;
+        const double variance = std::min(static_cast<double>(sigma) * sigma, (kMaxLower * kMaxLower - 1.0) / 4.0);
+        std::int32_t lower = static_cast<std::int32_t>(std::sqrt(4.0 * variance + 1.0));
+        if (lower % 2 == 0)
+            --lower;
+        const double m = (12.0 * variance - 3.0 * lower * lower - 12.0 * lower - 9.0) / (-4.0 * lower - 4.0);
+        const auto smaller = static_cast<std::int32_t>(std::lround(m));
+        for (std::int32_t pass = 0; pass < 3; ++pass)
+            BoxBlur(((pass < smaller ? lower : lower + 2) - 1) / 2, executor);
+    }
+
+    template <typename Derived>
+    bool ImageBase<Derived>::Convolve(std::span<const float> horizontal, std::span<const float> vertical)
+    {
+        return Convolve(horizontal, vertical, Executor::Serial());
+    }
+
+    template <typename Derived>
+    bool ImageBase<Derived>::Convolve(std::span<const float> horizontal, std::span<const float> vertical, Executor &executor)
+    {
+        BMPR_TIME(Convolve);
+        // An empty kernel is the identity, which the rounding leaves exact
+        static constexpr float identity[] = {1.0f};
+        std::vector<std::int16_t> x_weights, y_weights;
+        if (!detail::QuantizeKernel(horizontal.empty() ? identity : horizontal, x_weights) ||
+            !detail::QuantizeKernel(vertical.empty() ? identity : vertical, y_weights))
+            return false;
+
+        const auto x_radius = static_cast<std::int32_t>(x_weights.size() / 2), y_radius = static_cast<std::int32_t>(y_weights.size() / 2);
+        FilterSeparable(x_radius, [&](const std::uint8_t *line, std::uint8_t *out, std::int32_t width)
+                        {
+                            // Tap k of every pixel is the pixel k - radius away, so the rows are the line shifted by k pixels
+                            const std::uint8_t *rows[255];
+                            for (std::size_t k = 0; k < x_weights.size(); ++k)
+                                rows[k] = line + k * 4;
+                            kernels::Convolve(out, rows, x_weights.data(), x_weights.size(), static_cast<std::size_t>(width) * 4);
+                        },
+                        [&](const std::uint8_t *copy, std::size_t stride, std::int32_t height, std::int32_t y0, std::int32_t y1, auto &&emit)
+                        {
+                            // A strip of the rows at a time, so the rows under the kernel stay in cache
+                            constexpr std::size_t strip = 1024;
+                            const std::uint8_t *rows[255];
+                            alignas(32) std::uint8_t out[strip];
+                            for (std::size_t sx = 0; sx < stride; sx += strip)
+                            {
+                                const std::size_t n = std::min(strip, stride - sx);
+                                for (std::int32_t y = y0; y < y1; ++y)
+                                {
+                                    for (std::int32_t k = 0; k <= 2 * y_radius; ++k)
+                                        rows[k] = copy + static_cast<std::size_t>(std::clamp(y + k - y_radius, 0, height - 1)) * stride + sx;
+                                    kernels::Convolve(out, rows, y_weights.data(), y_weights.size(), n);
+                                    emit(y, static_cast<std::int32_t>(sx / 4), static_cast<std::int32_t>(n / 4), out);
+                                }
+                            }
+                        },
+                        executor);
+        return true;
+    }
+
+    template <typename Derived>
+    template <typename Horizontal, typename Vertical>
+    void ImageBase<Derived>::FilterSeparable(std::int32_t pad, Horizontal &&horizontal, Vertical &&vertical, Executor &executor)
+    {
+        const Rect area = TouchArea();
+        if (area.Empty())
+            return;
+        const std::int32_t width = area.x1 - area.x0, height = area.y1 - area.y0;
+        const std::size_t stride = static_cast<std::size_t>(width) * 4;
+        std::vector<std::uint8_t, AlignedAllocator<std::uint8_t>> copy(stride * height);
+
+        // Horizontal pass into the copy, every row through a line padded with copies of its edge pixels. Pixels with alpha
+        // are filtered premultiplied
+        using Row = decltype(self().RowPtr(0));
+        executor.ParallelFor(area.y0, area.y1, [&](std::int32_t y0, std::int32_t y1)
+                             {
+                                 std::vector<std::uint8_t> line(stride + static_cast<std::size_t>(pad) * 8);
+                                 std::uint8_t *pixels = line.data() + static_cast<std::size_t>(pad) * 4;
+                                 for (std::int32_t y = y0; y < y1; ++y)
+                                 {
+                                     detail::EncodeRowBGRX(detail::Offset(self().RowPtr(y), area.x0), width, pixels);
+                                     if constexpr (detail::RowTraits<Row>::kAlpha)
+                                         detail::PremultiplyBGRA(pixels, static_cast<std::size_t>(width));
+                                     for (std::int32_t i = 1; i <= pad; ++i)
+                                     {
+                                         std::memcpy(pixels - i * 4, pixels, 4);
+                                         std::memcpy(pixels + stride + (i - 1) * 4, pixels + stride - 4, 4);
+                                     }
+                                     horizontal(line.data(), copy.data() + (y - area.y0) * stride, width);
+                                 }
+                             });
+
+        // Vertical pass back into the image, every band reading the rows it needs from the finished copy
+        executor.ParallelFor(0, height, [&](std::int32_t y0, std::int32_t y1)
+                             {
+                                 vertical(copy.data(), stride, height, y0, y1, [&](std::int32_t y, std::int32_t x, std::int32_t n, const std::uint8_t *pixels)
+                                          {
+                                              const auto row = detail::Offset(self().RowPtr(area.y0 + y), area.x0 + x);
+                                              if constexpr (detail::RowTraits<Row>::kAlpha)
+                                                  detail::DecodeRowPremultiplied(row, static_cast<std::size_t>(n), pixels);
+                                              else
+                                                  detail::DecodeRowBGRX(row, static_cast<std::size_t>(n), pixels);
+                                          });
+                             });
+    }
+
+    template <typename PixelT>
+    BasicImage<PixelT>::BasicImage(std::size_t width, std::size_t height, std::pmr::memory_resource *resource)
+        : m_data(width * height, PixelT(), resource), m_width{static_cast<std::int32_t>(width)}, m_height{static_cast<std::int32_t>(height)} {}
+
+    template <typename PixelT>
+    BasicImage<PixelT>::BasicImage(std::size_t width, std::size_t height, UninitializedTag, std::pmr::memory_resource *resource)
+        : m_data(width * height, resource), m_width{static_cast<std::int32_t>(width)}, m_height{static_cast<std::int32_t>(height)} {}
+
+    template <typename PixelT>
+    BasicImage<PixelT>::BasicImage(Buffer &&pixels, std::size_t width, std::size_t height)
+        : m_data(std::move(pixels)), m_width{static_cast<std::int32_t>(width)}, m_height{static_cast<std::int32_t>(height)}
+    {
+        m_data.resize(width * height, PixelT());
+    }
+
+    template <typename PixelT>
+    typename BasicImage<PixelT>::Buffer BasicImage<PixelT>::Release()
+    {
+        ApplyOrientation();
+        Buffer pixels = std::move(m_data);
+        Reset(0, 0);
+        return pixels;
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::Reset(std::size_t width, std::size_t height)
+    {
+        m_data.assign(width * height, PixelT());
+        m_width = static_cast<std::int32_t>(width);
+        m_height = static_cast<std::int32_t>(height);
+        m_pending = {};
+        ResetDirty();
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::Reset(std::size_t width, std::size_t height, UninitializedTag)
+    {
+        m_data.resize(width * height);
+        m_width = static_cast<std::int32_t>(width);
+        m_height = static_cast<std::int32_t>(height);
+        m_pending = {};
+        ResetDirty();
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::Reserve(std::size_t width, std::size_t height)
+    {
+        m_data.reserve(width * height);
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::Set(std::int32_t x, std::int32_t y, const Color &color)
+    {
+        if (m_pending.flip_x || m_pending.flip_y)
+            ApplyOrientation();
+        MarkDirty({x, y, x + 1, y + 1});
+        BMPR_STAT_ADD(pixels_written, 1);
+        m_data[static_cast<std::size_t>(y) * m_width + x] = PixelT(color);
+    }
+
+    template <typename PixelT>
+    PixelT BasicImage<PixelT>::Get(std::int32_t x, std::int32_t y) const
+    {
+        // Recorded flips only change where the pixel is stored
+        const std::int32_t sx = m_pending.flip_x ? m_width - 1 - x : x;
+        const std::int32_t sy = m_pending.flip_y ? m_height - 1 - y : y;
+        return m_data[static_cast<std::size_t>(sy) * m_width + sx];
+    }
+
+    template <typename PixelT>
+    std::span<PixelT> BasicImage<PixelT>::Row(std::int32_t y)
+    {
+        if (m_pending.flip_x || m_pending.flip_y)
+            ApplyOrientation();
+        MarkDirty({0, y, m_width, y + 1});
+        return {RowPtr(y), static_cast<std::size_t>(m_width)};
+    }
+
+    template <typename PixelT>
+    std::span<const PixelT> BasicImage<PixelT>::Row(std::int32_t y) const
+    {
+        if (m_pending.flip_x || m_pending.flip_y)
+            ApplyOrientationRows();
+        return {m_data.data() + static_cast<std::size_t>(y) * m_width, static_cast<std::size_t>(m_width)};
+    }
+
+    template <typename PixelT>
+    PixelT *BasicImage<PixelT>::Data()
+    {
+        if (m_pending.flip_x || m_pending.flip_y)
+            ApplyOrientation();
+        MarkDirty(Bounds());
+        return m_data.data();
+    }
+
+    template <typename PixelT>
+    const PixelT *BasicImage<PixelT>::Data() const
+    {
+        if (m_pending.flip_x || m_pending.flip_y)
+            ApplyOrientationRows();
+        return m_data.data();
+    }
+
+    template <typename PixelT>
+    std::size_t BasicImage<PixelT>::Stride() const noexcept { return static_cast<std::size_t>(m_width); }
+
+    template <typename PixelT>
+    std::int32_t BasicImage<PixelT>::Width() const noexcept { return m_width; }
+
+    template <typename PixelT>
+    std::int32_t BasicImage<PixelT>::Height() const noexcept { return m_height; }
+
+    template <typename PixelT>
+    PixelT *BasicImage<PixelT>::RowPtr(std::int32_t y)
+    {
+        return m_data.data() + static_cast<std::size_t>(y) * m_width;
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::ApplyOrientationRows() const
+    {
+        const Orientation pending = std::exchange(m_pending, {});
+        const auto width = static_cast<std::size_t>(m_width);
+        const auto row = [&](std::int32_t y)
+        { return m_data.data() + static_cast<std::size_t>(y) * width; };
+        if (pending.flip_y)
+            for (std::int32_t y = 0; y < m_height / 2; ++y)
+                detail::SwapRows(row(y), row(m_height - 1 - y), width);
+        if (pending.flip_x)
+            for (std::int32_t y = 0; y < m_height; ++y)
+                detail::ReverseRow(row(y), width);
+    }
+
+    template <typename PixelT>
+    Rect BasicImage<PixelT>::Bounds() const noexcept { return {0, 0, m_width, m_height}; }
+
+    template <typename PixelT>
+    BasicImageView<PixelT> BasicImage<PixelT>::View()
+    {
+        return View(Bounds());
+    }
+
+    template <typename PixelT>
+    BasicImageView<PixelT> BasicImage<PixelT>::View(const Rect &area)
+    {
+        ApplyOrientation();
+        // Drawing through the view can't be seen, so it counts as changed up front
+        MarkDirty(area);
+        const BasicImageView<PixelT> whole{m_data.data(), static_cast<std::size_t>(m_width), static_cast<std::size_t>(m_height), static_cast<std::size_t>(m_width)};
+        return whole.View(area);
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::Transpose()
+    {
+        Transpose(Executor::Serial());
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::Transpose(Executor &executor)
+    {
+        BMPR_TIME(Transpose);
+        ApplyOrientation(executor);
+        const std::size_t width = static_cast<std::size_t>(m_width), height = static_cast<std::size_t>(m_height);
+        BMPR_STAT_ADD(pixels_written, width * height);
+        if (width == height)
+            detail::TransposeSquare(m_data.data(), width, width, executor);
+        else
+        {
+            // Every pixel is written by the transpose
+            std::vector<PixelT, AlignedAllocator<PixelT>> transposed(m_data.size(), m_data.get_allocator());
+            detail::Transpose(m_data.data(), width, transposed.data(), height, height, width, executor);
+            m_data.swap(transposed);
+        }
+        std::swap(m_width, m_height);
+        ResetDirty();
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::Rotate90()
+    {
+        Rotate90(Executor::Serial());
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::Rotate90(Executor &executor)
+    {
+        Transpose(executor);
+        FlipHorizontally(executor);
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::Rotate270()
+    {
+        Rotate270(Executor::Serial());
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::Rotate270(Executor &executor)
+    {
+        Transpose(executor);
+        FlipVertically(executor);
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::SetLazyOrientation(bool lazy)
+    {
+        m_lazy = lazy;
+        if (!lazy)
+            ApplyOrientation();
+    }
+
+    template <typename PixelT>
+    Orientation BasicImage<PixelT>::PendingOrientation() const noexcept { return m_pending; }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::ApplyOrientation()
+    {
+        ApplyOrientation(Executor::Serial());
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::ApplyOrientation(Executor &executor)
+    {
+        // Cleared first, the flips below apply any pending orientation themselves
+        const Orientation pending = std::exchange(m_pending, {});
+        if (pending.flip_x && pending.flip_y)
+            ImageBase<BasicImage>::Rotate180(executor);
+        else if (pending.flip_x)
+            ImageBase<BasicImage>::FlipHorizontally(executor);
+        else if (pending.flip_y)
+            ImageBase<BasicImage>::FlipVertically(executor);
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::Rotate180()
+    {
+        Rotate180(Executor::Serial());
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::Rotate180(Executor &executor)
+    {
+        if (m_lazy)
+        {
+            m_pending.flip_x = !m_pending.flip_x;
+            m_pending.flip_y = !m_pending.flip_y;
+            MarkDirty(Bounds());
+        }
+        else
+            ImageBase<BasicImage>::Rotate180(executor);
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::FlipHorizontally()
+    {
+        FlipHorizontally(Executor::Serial());
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::FlipHorizontally(Executor &executor)
+    {
+        if (m_lazy)
+        {
+            m_pending.flip_x = !m_pending.flip_x;
+            MarkDirty(Bounds());
+        }
+        else
+            ImageBase<BasicImage>::FlipHorizontally(executor);
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::FlipVertically()
+    {
+        FlipVertically(Executor::Serial());
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::FlipVertically(Executor &executor)
+    {
+        if (m_lazy)
+        {
+            m_pending.flip_y = !m_pending.flip_y;
+            MarkDirty(Bounds());
+        }
+        else
+            ImageBase<BasicImage>::FlipVertically(executor);
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::SetDirtyTracking(bool tracking)
+    {
+        m_tracking = tracking;
+        m_dirty.clear();
+        if (tracking)
+            m_dirty.resize(detail::TileCount(m_width) * detail::TileCount(m_height));
+    }
+
+    template <typename PixelT>
+    bool BasicImage<PixelT>::IsDirty() const noexcept
+    {
+        return std::find(m_dirty.begin(), m_dirty.end(), 1) != m_dirty.end();
+    }
+
+    template <typename PixelT>
+    Rect BasicImage<PixelT>::DirtyBounds() const noexcept
+    {
+        const auto tiles_x = static_cast<std::int32_t>(detail::TileCount(m_width));
+        Rect tiles{INT32_MAX, INT32_MAX, 0, 0};
+        for (std::size_t i = 0; i < m_dirty.size(); ++i)
+            if (m_dirty[i])
+            {
+                const std::int32_t tx = static_cast<std::int32_t>(i) % tiles_x, ty = static_cast<std::int32_t>(i) / tiles_x;
+                tiles = {std::min(tiles.x0, tx), std::min(tiles.y0, ty), std::max(tiles.x1, tx + 1), std::max(tiles.y1, ty + 1)};
+            }
+        if (tiles.Empty())
+            return {};
+
+        const std::int32_t t = detail::kDirtyTile;
+        return Rect{tiles.x0 * t, tiles.y0 * t, tiles.x1 * t, tiles.y1 * t}.Intersect(Bounds());
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::MarkDirty(const Rect &area) noexcept
+    {
+        if (!m_tracking)
+            return;
+        const Rect visible = area.Intersect(Bounds());
+        if (visible.Empty())
+            return;
+
+        const std::size_t tiles_x = detail::TileCount(m_width);
+        const std::int32_t t = detail::kDirtyTile;
+        for (std::int32_t ty = visible.y0 / t; ty <= (visible.y1 - 1) / t; ++ty)
+        {
+            std::uint8_t *row = m_dirty.data() + static_cast<std::size_t>(ty) * tiles_x;
+            std::fill(row + visible.x0 / t, row + (visible.x1 - 1) / t + 1, std::uint8_t{1});
+        }
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::ClearDirty() noexcept
+    {
+        std::fill(m_dirty.begin(), m_dirty.end(), std::uint8_t{0});
+    }
+
+    template <typename PixelT>
+    void BasicImage<PixelT>::ResetDirty()
+    {
+        if (m_tracking)
+            m_dirty.assign(detail::TileCount(m_width) * detail::TileCount(m_height), 1);
+    }
+
+    template <typename PixelT>
+    template <typename Emit>
+    bool BasicImage<PixelT>::WriteDirty(const detail::BmpLayout &layout, Emit &&emit)
+    {
+        BMPR_TIME(Encode);
+        constexpr std::size_t bytes_per_pixel = detail::BitDepth(PixelTraits<PixelT>::kEncoding) / 8;
+        if (layout.width != m_width || layout.height != m_height || layout.bit_depth != bytes_per_pixel * 8 || layout.rle)
+            return false;
+        // The file holds the pixels in stored order
+        ApplyOrientation();
+
+        const std::size_t tiles_x = detail::TileCount(m_width), tiles_y = detail::TileCount(m_height);
+        const std::int32_t t = detail::kDirtyTile;
+        for (std::size_t ty = 0; ty < tiles_y; ++ty)
+            for (std::size_t tx = 0; tx < tiles_x;)
+            {
+                const auto dirty = [&](std::size_t x)
+                { return !m_tracking || m_dirty[ty * tiles_x + x] != 0; };
+                if (!dirty(tx))
+                {
+                    ++tx;
+                    continue;
+                }
+                // Neighbouring changed tiles are written as one run per row
+                std::size_t end = tx + 1;
+                while (end < tiles_x && dirty(end))
+                    ++end;
+
+                const auto x0 = static_cast<std::int32_t>(tx) * t;
+                const std::int32_t x1 = std::min(static_cast<std::int32_t>(end) * t, m_width);
+                const std::int32_t y1 = std::min(static_cast<std::int32_t>(ty + 1) * t, m_height);
+                for (auto y = static_cast<std::int32_t>(ty) * t; y < y1; ++y)
+                {
+                    const std::size_t line = static_cast<std::size_t>(layout.top_down ? y : m_height - 1 - y);
+                    BMPR_STAT_ADD(bytes_encoded, (x1 - x0) * bytes_per_pixel);
+                    if (!emit(layout.data_offset + line * layout.row_size + static_cast<std::size_t>(x0) * bytes_per_pixel, RowPtr(y) + x0, static_cast<std::size_t>(x1 - x0)))
+                        return false;
+                }
+                tx = end;
+            }
+
+        ClearDirty();
+        return true;
+    }
+
+    template <typename PixelT>
+    bool BasicImage<PixelT>::SaveDirty(std::span<std::uint8_t> out)
+    {
+        const std::optional<detail::BmpLayout> layout = detail::ParseHeader(out.data(), out.size());
+        return layout && WriteDirty(*layout, [&](std::size_t offset, const PixelT *pixels, std::size_t n)
+                                    {
+                                        detail::EncodeRow(pixels, n, PixelTraits<PixelT>::kEncoding, out.data() + offset);
+                                        return true; });
+    }
+
+    template <typename PixelT>
+    bool BasicImage<PixelT>::SaveDirty(const std::string &path)
+    {
+        // Only the header is read, every run is encoded into scratch and written in place
+        std::uint8_t header[sizeof(Header) + 12];
+        std::vector<std::uint8_t> scratch;
+#if defined(BMPR_POSIX)
+        const int fd = ::open(path.c_str(), O_RDWR);
+        if (fd < 0)
+            return false;
+
+        struct stat info;
+        const ssize_t got = ::fstat(fd, &info) == 0 ? ::pread(fd, header, sizeof(header), 0) : -1;
+        const std::optional<detail::BmpLayout> layout = got > 0 ? detail::ParseHeader(header, static_cast<std::size_t>(got), static_cast<std::size_t>(info.st_size)) : std::nullopt;
+        const bool ok = layout && WriteDirty(*layout, [&](std::size_t offset, const PixelT *pixels, std::size_t n)
+                                             {
+                                                 scratch.resize(n * detail::BitDepth(PixelTraits<PixelT>::kEncoding) / 8);
+                                                 detail::EncodeRow(pixels, n, PixelTraits<PixelT>::kEncoding, scratch.data());
+                                                 return detail::WriteAllAt(fd, offset, scratch.data(), scratch.size()); });
+
+        return ::close(fd) == 0 && ok;
+#else
+        std::fstream file{path, std::ios_base::binary | std::ios_base::in | std::ios_base::out | std::ios_base::ate};
+        if (!file)
+            return false;
+
+        const auto size = static_cast<std::size_t>(file.tellg());
+        file.seekg(0);
+        file.read(reinterpret_cast<char *>(header), static_cast<std::streamsize>(std::min(size, sizeof(header))));
+        const std::optional<detail::BmpLayout> layout = file ? detail::ParseHeader(header, static_cast<std::size_t>(file.gcount()), size) : std::nullopt;
+        return layout && WriteDirty(*layout, [&](std::size_t offset, const PixelT *pixels, std::size_t n)
+                                    {
+                                        scratch.resize(n * detail::BitDepth(PixelTraits<PixelT>::kEncoding) / 8);
+                                        detail::EncodeRow(pixels, n, PixelTraits<PixelT>::kEncoding, scratch.data());
+                                        file.seekp(static_cast<std::streamoff>(offset));
+                                        file.write(reinterpret_cast<const char *>(scratch.data()), static_cast<std::streamsize>(scratch.size()));
+                                        return static_cast<bool>(file); }) &&
+               static_cast<bool>(file.flush());
+#endif
+    }
+
+    inline ImagePlanar::ImagePlanar(std::size_t width, std::size_t height, std::pmr::memory_resource *resource)
+        : m_r(resource), m_g(resource), m_b(resource)
+    {
+        Reset(width, height);
+    }
+
+    inline ImagePlanar::ImagePlanar(std::size_t width, std::size_t height, UninitializedTag, std::pmr::memory_resource *resource)
+        : m_r(resource), m_g(resource), m_b(resource)
+    {
+        Reset(width, height, Uninitialized);
+    }
+
+    inline void ImagePlanar::Reset(std::size_t width, std::size_t height)
+    {
+        Reset(width, height, Uninitialized);
+        std::fill(m_r.begin(), m_r.end(), 0);
+        std::fill(m_g.begin(), m_g.end(), 0);
+        std::fill(m_b.begin(), m_b.end(), 0);
+    }
+
+    inline void ImagePlanar::Reset(std::size_t width, std::size_t height, UninitializedTag)
+    {
+        m_stride = (width + 63) / 64 * 64;
+        m_width = static_cast<std::int32_t>(width);
+        m_height = static_cast<std::int32_t>(height);
+        m_r.resize(m_stride * height);
+        m_g.resize(m_stride * height);
+        m_b.resize(m_stride * height);
+    }
+
+    inline void ImagePlanar::Reserve(std::size_t width, std::size_t height)
+    {
+        const std::size_t size = (width + 63) / 64 * 64 * height;
+        m_r.reserve(size);
+        m_g.reserve(size);
+        m_b.reserve(size);
+    }
+
+    inline void ImagePlanar::Set(std::int32_t x, std::int32_t y, const Color &color)
+    {
+        BMPR_STAT_ADD(pixels_written, 1);
+        detail::StorePixel(RowPtr(y), x, color);
+    }
+
+    inline Color ImagePlanar::Get(std::int32_t x, std::int32_t y) const
+    {
+        const std::size_t i = static_cast<std::size_t>(y) * m_stride + x;
+        return {m_r[i], m_g[i], m_b[i]};
+    }
+
+    inline std::int32_t ImagePlanar::Width() const noexcept { return m_width; }
+
+    inline std::int32_t ImagePlanar::Height() const noexcept { return m_height; }
+
+    inline PlanarRow ImagePlanar::RowPtr(std::int32_t y)
+    {
+        const std::size_t offset = static_cast<std::size_t>(y) * m_stride;
+        return {m_r.data() + offset, m_g.data() + offset, m_b.data() + offset};
+    }
+
+    inline Rect ImagePlanar::Bounds() const noexcept { return {0, 0, m_width, m_height}; }
+
+    inline ImagePlanarView ImagePlanar::View()
+    {
+        return {RowPtr(0), static_cast<std::size_t>(m_width), static_cast<std::size_t>(m_height), m_stride};
+    }
+
+    inline ImagePlanarView ImagePlanar::View(const Rect &area)
+    {
+        return View().View(area);
+    }
+
+    inline void ImagePlanar::Transpose()
+    {
+        Transpose(Executor::Serial());
+    }
+
+    inline void ImagePlanar::Transpose(Executor &executor)
+    {
+        BMPR_TIME(Transpose);
+        const std::size_t width = static_cast<std::size_t>(m_width), height = static_cast<std::size_t>(m_height);
+        BMPR_STAT_ADD(pixels_written, width * height);
+        if (width == height)
+        {
+            for (auto *plane : {&m_r, &m_g, &m_b})
+                detail::TransposeSquare(plane->data(), m_stride, width, executor);
+        }
+        else
+        {
+            const std::size_t stride = (height + 63) / 64 * 64;
+            for (auto *plane : {&m_r, &m_g, &m_b})
+            {
+                // Every pixel is written by the transpose, the row padding is never read
+                std::vector<std::uint8_t, AlignedAllocator<std::uint8_t>> transposed(stride * width, plane->get_allocator());
+                detail::Transpose(plane->data(), m_stride, transposed.data(), stride, height, width, executor);
+                plane->swap(transposed);
+            }
+            m_stride = stride;
+        }
+        std::swap(m_width, m_height);
+    }
+
+    inline void ImagePlanar::Rotate90()
+    {
+        Rotate90(Executor::Serial());
+    }
+
+    inline void ImagePlanar::Rotate90(Executor &executor)
+    {
+        Transpose(executor);
+        FlipHorizontally(executor);
+    }
+
+    inline void ImagePlanar::Rotate270()
+    {
+        Rotate270(Executor::Serial());
+    }
+
+    inline void ImagePlanar::Rotate270(Executor &executor)
+    {
+        Transpose(executor);
+        FlipVertically(executor);
+    }
+
+    template <typename PixelT>
+    BasicImageView<PixelT>::BasicImageView(PixelT *data, std::size_t width, std::size_t height, std::size_t stride)
+        : m_data{data}, m_stride{stride}, m_width{static_cast<std::int32_t>(width)}, m_height{static_cast<std::int32_t>(height)} {}
+
+    template <typename PixelT>
+    void BasicImageView<PixelT>::Set(std::int32_t x, std::int32_t y, const Color &color)
+    {
+        BMPR_STAT_ADD(pixels_written, 1);
+        RowPtr(y)[x] = PixelT(color);
+    }
+
+    template <typename PixelT>
+    PixelT BasicImageView<PixelT>::Get(std::int32_t x, std::int32_t y) const
+    {
+        return RowPtr(y)[x];
+    }
+
+    template <typename PixelT>
+    std::span<PixelT> BasicImageView<PixelT>::Row(std::int32_t y) const
+    {
+        return {RowPtr(y), static_cast<std::size_t>(m_width)};
+    }
+
+    template <typename PixelT>
+    PixelT *BasicImageView<PixelT>::Data() const noexcept { return m_data; }
+
+    template <typename PixelT>
+    std::int32_t BasicImageView<PixelT>::Width() const noexcept { return m_width; }
+
+    template <typename PixelT>
+    std::int32_t BasicImageView<PixelT>::Height() const noexcept { return m_height; }
+
+    template <typename PixelT>
+    std::size_t BasicImageView<PixelT>::Stride() const noexcept { return m_stride; }
+
+    template <typename PixelT>
+    BasicImageView<PixelT> BasicImageView<PixelT>::View(const Rect &area) const
+    {
+        const Rect visible = area.Intersect(Bounds());
+        if (visible.Empty())
+            return {m_data, 0, 0, m_stride};
+        return {RowPtr(visible.y0) + visible.x0, static_cast<std::size_t>(visible.x1 - visible.x0), static_cast<std::size_t>(visible.y1 - visible.y0), m_stride};
+    }
+
+    template <typename PixelT>
+    PixelT *BasicImageView<PixelT>::RowPtr(std::int32_t y) const
+    {
+        return m_data + static_cast<std::size_t>(y) * m_stride;
+    }
+
+    template <typename PixelT>
+    Rect BasicImageView<PixelT>::Bounds() const noexcept { return {0, 0, m_width, m_height}; }
+
+    inline ImagePlanarView::ImagePlanarView(PlanarRow origin, std::size_t width, std::size_t height, std::size_t stride)
+        : m_origin{origin}, m_stride{stride}, m_width{static_cast<std::int32_t>(width)}, m_height{static_cast<std::int32_t>(height)} {}
+
+    inline void ImagePlanarView::Set(std::int32_t x, std::int32_t y, const Color &color)
+    {
+        BMPR_STAT_ADD(pixels_written, 1);
+        detail::StorePixel(RowPtr(y), x, color);
+    }
+
+    inline Color ImagePlanarView::Get(std::int32_t x, std::int32_t y) const
+    {
+        const std::size_t i = static_cast<std::size_t>(y) * m_stride + x;
+        return {m_origin.r[i], m_origin.g[i], m_origin.b[i]};
+    }
+
+    inline std::int32_t ImagePlanarView::Width() const noexcept { return m_width; }
+
+    inline std::int32_t ImagePlanarView::Height() const noexcept { return m_height; }
+
+    inline std::size_t ImagePlanarView::Stride() const noexcept { return m_stride; }
+
+    inline ImagePlanarView ImagePlanarView::View(const Rect &area) const
+    {
+        const Rect visible = area.Intersect(Bounds());
+        if (visible.Empty())
+            return {m_origin, 0, 0, m_stride};
+
+        const PlanarRow row = RowPtr(visible.y0);
+        return {{row.r + visible.x0, row.g + visible.x0, row.b + visible.x0},
+                static_cast<std::size_t>(visible.x1 - visible.x0),
+                static_cast<std::size_t>(visible.y1 - visible.y0),
+                m_stride};
+    }
+
+    inline PlanarRow ImagePlanarView::RowPtr(std::int32_t y) const
+    {
+        const std::size_t offset = static_cast<std::size_t>(y) * m_stride;
+        return {m_origin.r + offset, m_origin.g + offset, m_origin.b + offset};
+    }
+
+    inline Rect ImagePlanarView::Bounds() const noexcept { return {0, 0, m_width, m_height}; }
+
+    template <typename PixelT>
+    BasicImageBand<PixelT>::BasicImageBand(std::size_t width, std::size_t height, std::size_t rows, std::pmr::memory_resource *resource)
+        : m_data(width * rows, PixelT(), resource), m_width{static_cast<std::int32_t>(width)}, m_height{static_cast<std::int32_t>(height)}, m_rows{static_cast<std::int32_t>(rows)} {}
+
+    template <typename PixelT>
+    void BasicImageBand<PixelT>::MoveTo(std::int32_t top) { m_top = top; }
+
+    template <typename PixelT>
+    void BasicImageBand<PixelT>::Set(std::int32_t x, std::int32_t y, const Color &color)
+    {
+        BMPR_STAT_ADD(pixels_written, 1);
+        RowPtr(y)[x] = PixelT(color);
+    }
+
+    template <typename PixelT>
+    std::int32_t BasicImageBand<PixelT>::Width() const noexcept { return m_width; }
+
+    template <typename PixelT>
+    std::int32_t BasicImageBand<PixelT>::Height() const noexcept { return m_height; }
+
+    template <typename PixelT>
+    std::int32_t BasicImageBand<PixelT>::Top() const noexcept { return m_top; }
+
+    template <typename PixelT>
+    Rect BasicImageBand<PixelT>::Bounds() const noexcept
+    {
+        return {0, std::max(m_top, 0), m_width, detail::ClampCoord(std::min<std::int64_t>(std::int64_t{m_top} + m_rows, m_height))};
+    }
+
+    template <typename PixelT>
+    PixelT *BasicImageBand<PixelT>::RowPtr(std::int32_t y)
+    {
+        return m_data.data() + static_cast<std::size_t>(y - m_top) * m_width;
+    }
+
+    inline StreamWriter::StreamWriter(const std::string &path, std::size_t width, std::size_t height)
+        : m_width{static_cast<std::int32_t>(width)}, m_height{static_cast<std::int32_t>(height)}
+    {
+        const Header header = detail::MakeHeader(m_width, m_height);
+        const std::size_t size = sizeof(Header) + detail::RowSize(m_width) * height;
+
+        // Sizing the file up front leaves unwritten rows black, and sparse where the file system allows it
+#if defined(BMPR_POSIX)
+        m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (m_fd < 0)
+            return;
+        m_ok = ::ftruncate(m_fd, static_cast<off_t>(size)) == 0;
+#else
+        m_file.open(path, std::ios_base::binary);
+        m_ok = m_file && m_file.seekp(static_cast<std::streamoff>(size - 1)) && m_file.put(0);
+#endif
+        m_ok = m_ok && WriteAt(0, reinterpret_cast<const std::uint8_t *>(&header), sizeof(header));
+    }
+
+    inline StreamWriter::~StreamWriter()
+    {
+        Close();
+    }
+
+    inline bool StreamWriter::IsOpen() const noexcept { return m_ok; }
+
+    template <typename Derived>
+    bool StreamWriter::Write(ImageBase<Derived> &image)
+    {
+        return Write(image, Executor::Serial());
+    }
+
+    template <typename Derived>
+    bool StreamWriter::Write(ImageBase<Derived> &image, Executor &executor)
+    {
+        return Write(image, static_cast<Derived &>(image).Bounds().y0, executor);
+    }
+
+    template <typename Derived>
+    bool StreamWriter::Write(ImageBase<Derived> &image, std::int32_t y)
+    {
+        return Write(image, y, Executor::Serial());
+    }
+
+    template <typename Derived>
+    bool StreamWriter::Write(ImageBase<Derived> &image, std::int32_t y, Executor &executor)
+    {
+        const Rect area = static_cast<Derived &>(image).Bounds();
+        if (!m_ok)
+            return false;
+        if (area.Empty())
+            return true;
+
+        // Only whole rows that fit in the file
+        const std::int32_t rows = area.y1 - area.y0;
+        if (area.x1 - area.x0 != m_width || y < 0 || y > m_height - rows)
+            return false;
+
+        m_buffer.resize(image.EncodedSize(Encoding::BGR24));
+        if (image.SaveTo(m_buffer, Encoding::BGR24, executor) != m_buffer.size())
+            return false;
+
+        // The file is bottom-up, so the encoded rows land in one run ending where row y starts
+        const std::size_t row_size = detail::RowSize(m_width);
+        const std::size_t offset = sizeof(Header) + static_cast<std::size_t>(m_height - y - rows) * row_size;
+        m_ok = WriteAt(offset, m_buffer.data() + sizeof(Header), static_cast<std::size_t>(rows) * row_size);
+        return m_ok;
+    }
+
+    inline bool StreamWriter::Close()
+    {
+#if defined(BMPR_POSIX)
+        if (m_fd >= 0)
+        {
+            m_ok = ::close(m_fd) == 0 && m_ok;
+            m_fd = -1;
+        }
+#else
+        if (m_file.is_open())
+        {
+            m_file.close();
+            m_ok = m_ok && !m_file.fail();
+        }
+#endif
+        return m_ok;
+    }
+
+    inline bool StreamWriter::WriteAt(std::size_t offset, const std::uint8_t *data, std::size_t size)
+    {
+#if defined(BMPR_POSIX)
+        return detail::WriteAllAt(m_fd, offset, data, size);
+#else
+        m_file.seekp(static_cast<std::streamoff>(offset));
+        m_file.write(reinterpret_cast<const char *>(data), static_cast<std::streamsize>(size));
+        return static_cast<bool>(m_file);
+#endif
+    }
+
+    inline void CommandBuffer::Record(DrawCommand::Type type, const ColorRGBA &color, BlendMode mode, const Rect &bounds, std::initializer_list<std::int32_t> args, float step)
+    {
+        DrawCommand command{};
+        command.type = type;
+        command.mode = mode;
+        command.color = color;
+        std::copy(args.begin(), args.end(), command.args);
+        command.step = step;
+        command.bounds = bounds;
+        m_commands.push_back(command);
+    }
+
+    inline void CommandBuffer::SetSafe(std::int32_t x, std::int32_t y, const Color &color)
+    {
+        Record(DrawCommand::Type::Pixel, color, BlendMode::Replace, detail::PointBounds({x}, {y}), {x, y});
+    }
+
+    inline void CommandBuffer::DrawLine(std::int32_t x1, std::int32_t y1, std::int32_t x2, std::int32_t y2, ColorRGBA color, BlendMode mode)
+    {
+        Record(DrawCommand::Type::Line, color, mode, detail::PointBounds({x1, x2}, {y1, y2}), {x1, y1, x2, y2});
+    }
+
+    inline void CommandBuffer::DrawLine(std::int32_t x1, std::int32_t y1, std::int32_t x2, std::int32_t y2, int thickness, ColorRGBA color, LineCap cap, BlendMode mode)
+    {
+        // No cap reaches further than the thickness from the end points
+        Record(DrawCommand::Type::ThickLine, color, mode, detail::PointBounds({x1, x2}, {y1, y2}, std::max(thickness, 1)),
+               {x1, y1, x2, y2, thickness, static_cast<std::int32_t>(cap)});
+    }
+
+    inline void CommandBuffer::DrawQuadraticBezierCurve(const Vector2 &start, const Vector2 &control, const Vector2 &end, float step_size, const ColorRGBA &color, BlendMode mode)
+    {
+        // The curve never leaves the triangle of its control points, give float rounding a pixel of slack
+        Record(DrawCommand::Type::BezierStep, color, mode, detail::PointBounds({start.x, control.x, end.x}, {start.y, control.y, end.y}, 1),
+               {start.x, start.y, control.x, control.y, end.x, end.y}, step_size);
+    }
+
+    inline void CommandBuffer::DrawQuadraticBezierCurve(const Vector2 &start, const Vector2 &control, const Vector2 &end, int num_points, const ColorRGBA &color, BlendMode mode)
+    {
+        Record(DrawCommand::Type::BezierPoints, color, mode, detail::PointBounds({start.x, control.x, end.x}, {start.y, control.y, end.y}, 1),
+               {start.x, start.y, control.x, control.y, end.x, end.y, num_points});
+    }
+
+    inline void CommandBuffer::DrawQuadraticBezierCurve(const Vector2 &start, const Vector2 &control, const Vector2 &end, const ColorRGBA &color, BlendMode mode)
+    {
+        Record(DrawCommand::Type::Bezier, color, mode, detail::PointBounds({start.x, control.x, end.x}, {start.y, control.y, end.y}, 1),
+               {start.x, start.y, control.x, control.y, end.x, end.y});
+    }
+
+    inline void CommandBuffer::DrawCubicBezierCurve(const Vector2 &start, const Vector2 &control1, const Vector2 &control2, const Vector2 &end, const ColorRGBA &color, BlendMode mode)
+    {
+        Record(DrawCommand::Type::CubicBezier, color, mode, detail::PointBounds({start.x, control1.x, control2.x, end.x}, {start.y, control1.y, control2.y, end.y}, 1),
+               {start.x, start.y, control1.x, control1.y, control2.x, control2.y, end.x, end.y});
+    }
+
+    inline void CommandBuffer::DrawCircle(std::int32_t x, std::int32_t y, std::int32_t r, ColorRGBA color, BlendMode mode)
+    {
+        Record(DrawCommand::Type::Circle, color, mode, detail::ClampedRect(std::int64_t{x} - r, std::int64_t{y} - r, std::int64_t{x} + r + 1, std::int64_t{y} + r + 1), {x, y, r});
+    }
+
+    inline void CommandBuffer::DrawCircleLine(std::int32_t x, std::int32_t y, std::int32_t r, ColorRGBA color, BlendMode mode)
+    {
+        Record(DrawCommand::Type::CircleLine, color, mode, detail::ClampedRect(std::int64_t{x} - r, std::int64_t{y} - r, std::int64_t{x} + r + 1, std::int64_t{y} + r + 1), {x, y, r});
+    }
+
+    inline void CommandBuffer::DrawLineAA(float x1, float y1, float x2, float y2, ColorRGBA color, BlendMode mode)
+    {
+        // Coordinates are stored bit for bit. The two pixels across the line can reach past the end points rounded
+        Record(DrawCommand::Type::LineAA, color, mode,
+               detail::PointBounds({detail::RoundCoord(x1), detail::RoundCoord(x2)}, {detail::RoundCoord(y1), detail::RoundCoord(y2)}, 2),
+               {std::bit_cast<std::int32_t>(x1), std::bit_cast<std::int32_t>(y1), std::bit_cast<std::int32_t>(x2), std::bit_cast<std::int32_t>(y2)});
+    }
+
+    inline void CommandBuffer::DrawCircleAA(float x, float y, float r, ColorRGBA color, BlendMode mode)
+    {
+        Record(DrawCommand::Type::CircleAA, color, mode,
+               detail::PointBounds({detail::RoundCoord(x - r), detail::RoundCoord(x + r)}, {detail::RoundCoord(y - r), detail::RoundCoord(y + r)}, 2),
+               {std::bit_cast<std::int32_t>(x), std::bit_cast<std::int32_t>(y), std::bit_cast<std::int32_t>(r)});
+    }
+
+    inline void CommandBuffer::DrawCircleLineAA(float x, float y, float r, ColorRGBA color, BlendMode mode)
+    {
+        Record(DrawCommand::Type::CircleLineAA, color, mode,
+               detail::PointBounds({detail::RoundCoord(x - r), detail::RoundCoord(x + r)}, {detail::RoundCoord(y - r), detail::RoundCoord(y + r)}, 2),
+               {std::bit_cast<std::int32_t>(x), std::bit_cast<std::int32_t>(y), std::bit_cast<std::int32_t>(r)});
+    }
+
+    inline void CommandBuffer::DrawCircleInverted(std::int32_t x, std::int32_t y, std::int32_t r, ColorRGBA color, BlendMode mode)
+    {
+        Record(DrawCommand::Type::CircleInverted, color, mode, detail::ClampedRect(std::int64_t{x} - r, std::int64_t{y} - r, std::int64_t{x} + r + 1, std::int64_t{y} + r + 1), {x, y, r});
+    }
+
+    inline void CommandBuffer::DrawRectangle(std::int32_t x, std::int32_t y, std::int32_t w, std::int32_t h, ColorRGBA color, BlendMode mode)
+    {
+        Record(DrawCommand::Type::Rectangle, color, mode, detail::ClampedRect(x, y, std::int64_t{x} + w, std::int64_t{y} + h), {x, y, w, h});
+    }
+
+    inline void CommandBuffer::DrawRectangleLine(std::int32_t x, std::int32_t y, std::int32_t w, std::int32_t h, ColorRGBA color, BlendMode mode)
+    {
+        // The far corner is drawn even for negative sizes
+        Record(DrawCommand::Type::RectangleLine, color, mode, detail::PointBounds({x, std::int64_t{x} + w}, {y, std::int64_t{y} + h}), {x, y, w, h});
+    }
+
+    inline void CommandBuffer::DrawPolygon(std::span<const Vector2> points, ColorRGBA color, FillRule rule, BlendMode mode)
+    {
+        if (points.size() < 3)
+            return;
+        const Rect bounds = detail::PolygonBounds(points);
+        const auto offset = static_cast<std::int32_t>(m_points.size());
+        m_points.insert(m_points.end(), points.begin(), points.end());
+        Record(DrawCommand::Type::Polygon, color, mode, bounds, {offset, static_cast<std::int32_t>(points.size()), static_cast<std::int32_t>(rule)});
+    }
+
+    inline void CommandBuffer::DrawTriangles(std::span<const Vector2> vertices, ColorRGBA color, BlendMode mode)
+    {
+        for (std::size_t i = 0; i + 3 <= vertices.size(); i += 3)
+        {
+            const Vector2 &a = vertices[i], &b = vertices[i + 1], &c = vertices[i + 2];
+            Record(DrawCommand::Type::Triangle, color, mode, detail::PolygonBounds(vertices.subspan(i, 3)), {a.x, a.y, b.x, b.y, c.x, c.y});
+        }
+    }
+
+    inline void CommandBuffer::DrawTriangles(std::span<const Vector2> vertices, std::span<const std::uint32_t> indices, ColorRGBA color, BlendMode mode)
+    {
+        for (std::size_t i = 0; i + 3 <= indices.size(); i += 3)
+            if (indices[i] < vertices.size() && indices[i + 1] < vertices.size() && indices[i + 2] < vertices.size())
+            {
+                const Vector2 corners[3] = {vertices[indices[i]], vertices[indices[i + 1]], vertices[indices[i + 2]]};
+                DrawTriangles(corners, color, mode);
+            }
+    }
+
+    inline Rect TextBounds(std::int32_t x, std::int32_t y, std::string_view text, std::int32_t size)
+    {
+        if (size < 1)
+            return {};
+        const detail::GlyphAtlas &atlas = detail::GlyphAtlasFor(std::min(size, kMaxTextSize));
+
+        // The widest line, from the pen positions of its first and last glyph
+        std::int64_t columns = 0, widest = 0, lines = 0;
+        for (const char c : text)
+        {
+            if (c == '\n')
+            {
+                columns = 0;
+                ++lines;
+            }
+            else
+                widest = std::max(widest, ++columns);
+        }
+        if (widest == 0)
+            return {};
+        return detail::ClampedRect(x, y, x + (widest - 1) * atlas.advance + atlas.width, y + lines * std::min(size, kMaxTextSize) + atlas.height);
+    }
+
+    inline void CommandBuffer::DrawText(std::int32_t x, std::int32_t y, std::string_view text, std::int32_t size, ColorRGBA color, BlendMode mode)
+    {
+        const Rect bounds = TextBounds(x, y, text, size);
+        if (bounds.Empty())
+            return;
+        const auto offset = static_cast<std::int32_t>(m_text.size());
+        m_text.append(text);
+        Record(DrawCommand::Type::Text, color, mode, bounds, {x, y, offset, static_cast<std::int32_t>(text.size()), size});
+    }
+
+    inline void CommandBuffer::Reset() noexcept
+    {
+        m_commands.clear();
+        m_points.clear();
+        m_text.clear();
+    }
+
+    inline void CommandBuffer::Reserve(std::size_t count) { m_commands.reserve(count); }
+
+    inline std::size_t CommandBuffer::Size() const noexcept { return m_commands.size(); }
+
+    inline void CommandBuffer::SetTileSize(std::int32_t tile_size) noexcept { m_tile_size = std::max(tile_size, 1); }
+
+    template <typename Derived>
+    void CommandBuffer::Submit(ImageBase<Derived> &image) const
+    {
+        for (const DrawCommand &command : m_commands)
+            Replay(command, image);
+    }
+
+    template <typename Derived>
+    void CommandBuffer::Submit(ImageBase<Derived> &image, Executor &executor)
+    {
+        Derived &target = static_cast<Derived &>(image);
+        // The tiles draw through RowPtr, which doesn't apply deferred flips or mark changed pixels
+        detail::ApplyOrientation(target);
+        const Rect area = target.Bounds();
+        if (area.Empty() || m_commands.empty())
+            return;
+        for (const DrawCommand &command : m_commands)
+            detail::MarkDirty(target, command.bounds.Intersect(area));
+
+        // Tiles are laid out from the top-left corner of the drawable area
+        const std::int32_t tiles_x = (area.x1 - area.x0 - 1) / m_tile_size + 1;
+        const std::int32_t tiles_y = (area.y1 - area.y0 - 1) / m_tile_size + 1;
+        const std::size_t tile_count = static_cast<std::size_t>(tiles_x) * tiles_y;
+
+        // Visits the tiles a command overlaps
+        const auto for_each_tile = [&](const DrawCommand &command, auto &&fn)
+        {
+            const Rect visible = command.bounds.Intersect(area);
+            if (visible.Empty())
+                return;
+            for (std::int32_t ty = (visible.y0 - area.y0) / m_tile_size; ty <= (visible.y1 - 1 - area.y0) / m_tile_size; ++ty)
+                for (std::int32_t tx = (visible.x0 - area.x0) / m_tile_size; tx <= (visible.x1 - 1 - area.x0) / m_tile_size; ++tx)
+                    fn(static_cast<std::size_t>(ty) * tiles_x + tx);
+        };
+
+        // Counting sort of command indices by tile, keeping recording order inside every tile
+        m_tile_offsets.assign(tile_count + 1, 0);
+        for (const DrawCommand &command : m_commands)
+            for_each_tile(command, [&](std::size_t tile)
+                          { m_tile_offsets[tile + 1]++; });
+        for (std::size_t tile = 0; tile < tile_count; ++tile)
+            m_tile_offsets[tile + 1] += m_tile_offsets[tile];
+
+        m_tile_commands.resize(m_tile_offsets[tile_count]);
+        for (std::size_t i = 0; i < m_commands.size(); ++i)
+            for_each_tile(m_commands[i], [&](std::size_t tile)
+                          { m_tile_commands[m_tile_offsets[tile]++] = static_cast<std::uint32_t>(i); });
+        // The fill pass moved every offset to the start of the next tile
+        for (std::size_t tile = tile_count; tile > 0; --tile)
+            m_tile_offsets[tile] = m_tile_offsets[tile - 1];
+        m_tile_offsets[0] = 0;
+
+        executor.ParallelFor(0, static_cast<std::int32_t>(tile_count), 1, [&](std::int32_t t0, std::int32_t t1)
+                             {
+                                 for (std::int32_t tile = t0; tile < t1; ++tile)
+                                 {
+                                     const std::int32_t tx = area.x0 + tile % tiles_x * m_tile_size;
+                                     const std::int32_t ty = area.y0 + tile / tiles_x * m_tile_size;
+                                     detail::ClipTarget<Derived> clip(target, {tx, ty, tx + m_tile_size, ty + m_tile_size});
+
+                                     for (std::uint32_t i = m_tile_offsets[tile]; i < m_tile_offsets[tile + 1]; ++i)
+                                         Replay(m_commands[m_tile_commands[i]], clip);
+                                 }
+                             });
+    }
+
+    template <typename Derived>
+    void CommandBuffer::Replay(const DrawCommand &command, ImageBase<Derived> &target) const
+    {
+        const std::int32_t *a = command.args;
+        switch (command.type)
+        {
+        case DrawCommand::Type::Pixel:
+            target.SetSafe(a[0], a[1], command.color);
+            break;
+        case DrawCommand::Type::Line:
+            target.DrawLine(a[0], a[1], a[2], a[3], command.color, command.mode);
+            break;
+        case DrawCommand::Type::ThickLine:
+            target.DrawLine(a[0], a[1], a[2], a[3], a[4], command.color, static_cast<LineCap>(a[5]), command.mode);
+            break;
+        case DrawCommand::Type::BezierPoints:
+            target.DrawQuadraticBezierCurve({a[0], a[1]}, {a[2], a[3]}, {a[4], a[5]}, a[6], command.color, command.mode);
+            break;
+        case DrawCommand::Type::BezierStep:
+            target.DrawQuadraticBezierCurve({a[0], a[1]}, {a[2], a[3]}, {a[4], a[5]}, command.step, command.color, command.mode);
+            break;
+        case DrawCommand::Type::Bezier:
+            target.DrawQuadraticBezierCurve({a[0], a[1]}, {a[2], a[3]}, {a[4], a[5]}, command.color, command.mode);
+            break;
+        case DrawCommand::Type::CubicBezier:
+            target.DrawCubicBezierCurve({a[0], a[1]}, {a[2], a[3]}, {a[4], a[5]}, {a[6], a[7]}, command.color, command.mode);
+            break;
+        case DrawCommand::Type::Circle:
+            target.DrawCircle(a[0], a[1], a[2], command.color, command.mode);
+            break;
+        case DrawCommand::Type::CircleLine:
+            target.DrawCircleLine(a[0], a[1], a[2], command.color, command.mode);
+            break;
+        case DrawCommand::Type::LineAA:
+            target.DrawLineAA(std::bit_cast<float>(a[0]), std::bit_cast<float>(a[1]), std::bit_cast<float>(a[2]), std::bit_cast<float>(a[3]), command.color, command.mode);
+            break;
+        case DrawCommand::Type::CircleAA:
+            target.DrawCircleAA(std::bit_cast<float>(a[0]), std::bit_cast<float>(a[1]), std::bit_cast<float>(a[2]), command.color, command.mode);
+            break;
+        case DrawCommand::Type::CircleLineAA:
+            target.DrawCircleLineAA(std::bit_cast<float>(a[0]), std::bit_cast<float>(a[1]), std::bit_cast<float>(a[2]), command.color, command.mode);
+            break;
+        case DrawCommand::Type::CircleInverted:
+            target.DrawCircleInverted(a[0], a[1], a[2], command.color, command.mode);
+            break;
+        case DrawCommand::Type::Rectangle:
+            target.DrawRectangle(a[0], a[1], a[2], a[3], command.color, command.mode);
+            break;
+        case DrawCommand::Type::RectangleLine:
+            target.DrawRectangleLine(a[0], a[1], a[2], a[3], command.color, command.mode);
+            break;
+        case DrawCommand::Type::Polygon:
+            target.DrawPolygon(std::span<const Vector2>(m_points).subspan(static_cast<std::size_t>(a[0]), static_cast<std::size_t>(a[1])), command.color,
+                               static_cast<FillRule>(a[2]), command.mode);
+            break;
+        case DrawCommand::Type::Triangle:
+        {
+            const Vector2 corners[3] = {{a[0], a[1]}, {a[2], a[3]}, {a[4], a[5]}};
+            target.DrawTriangles(corners, command.color, command.mode);
+            break;
+        }
+        case DrawCommand::Type::Text:
+            target.DrawText(a[0], a[1], std::string_view(m_text).substr(static_cast<std::size_t>(a[2]), static_cast<std::size_t>(a[3])), a[4], command.color, command.mode);
+            break;
+        }
+    }
+}
+
+namespace bmpr
+{
+    inline Batch::Batch(Executor &executor) : m_executor{executor} {}
+
+    inline Batch &Batch::FlipHorizontally()
+    {
+        return Then([](Image &image, void *)
+                    { image.FlipHorizontally(); });
+    }
+
+    inline Batch &Batch::FlipVertically()
+    {
+        return Then([](Image &image, void *)
+                    { image.FlipVertically(); });
+    }
+
+    inline Batch &Batch::Rotate90()
+    {
+        return Then([](Image &image, void *)
+                    { image.Rotate90(); });
+    }
+
+    inline Batch &Batch::Rotate180()
+    {
+        return Then([](Image &image, void *)
+                    { image.Rotate180(); });
+    }
+
+    inline Batch &Batch::Rotate270()
+    {
+        return Then([](Image &image, void *)
+                    { image.Rotate270(); });
+    }
+
+    inline Batch &Batch::Transpose()
+    {
+        return Then([](Image &image, void *)
+                    { image.Transpose(); });
+    }
+
+    inline Batch &Batch::Invert()
+    {
+        return Then([](Image &image, void *)
+                    { image.Invert(); });
+    }
+
+    inline Batch &Batch::Then(Step step, void *user)
+    {
+        m_steps.emplace_back(step, user);
+        return *this;
+    }
+
+    inline Batch &Batch::SetEncoding(Encoding encoding) noexcept
+    {
+        m_encoding = encoding;
+        return *this;
+    }
+
+    inline void Batch::Clear() noexcept
+    {
+        m_steps.clear();
+    }
+
+    inline std::size_t Batch::Run(std::span<const std::string> inputs, std::span<const std::string> outputs)
+    {
+        const std::size_t count = std::min(inputs.size(), outputs.size());
+        return Process([&](Worker &worker, auto &claim, auto &done)
+                       {
+                           // Two files per thread: the one being converted and the next one, read while the first is converted
+                           std::optional<detail::MappedFile> files[2];
+                           std::size_t current = 0;
+                           std::size_t i = claim();
+                           if (i < count)
+                               files[current].emplace(inputs[i]);
+                           while (i < count)
+                           {
+                               const std::size_t next = claim();
+                               if (next < count)
+                                   files[current ^ 1].emplace(inputs[next]).Prefetch();
+
+                               bool ok = files[current]->IsOpen() && Apply(worker, files[current]->Data(), files[current]->Size());
+                               // Unmapped before saving, in case the output replaces the input
+                               files[current].reset();
+                               ok = ok && worker.image.SaveToBuffer(worker.buffer, m_encoding) &&
+                                    detail::WriteFile(outputs[i], worker.buffer.data(), worker.buffer.size());
+                               done(i, ok);
+
+                               i = next;
+                               current ^= 1;
+                           } });
+    }
+
+    inline std::size_t Batch::Run(std::span<const std::span<const std::uint8_t>> inputs, std::span<std::vector<std::uint8_t>> outputs)
+    {
+        const std::size_t count = std::min(inputs.size(), outputs.size());
+        return Process([&](Worker &worker, auto &claim, auto &done)
+                       {
+                           for (std::size_t i = claim(); i < count; i = claim())
+                           {
+                               const bool ok = Apply(worker, inputs[i].data(), inputs[i].size()) && worker.image.SaveToBuffer(outputs[i], m_encoding);
+                               if (!ok)
+                                   outputs[i].clear();
+                               done(i, ok);
+                           } });
+    }
+
+    inline std::span<const std::size_t> Batch::Failed() const noexcept
+    {
+        return m_failed;
+    }
+
+    template <typename Convert>
+    std::size_t Batch::Process(Convert &&convert)
+    {
+        m_failed.clear();
+        // Workers are kept between runs, so their images and buffers are too
+        if (m_workers.size() < m_executor.Threads())
+            m_workers.resize(m_executor.Threads());
+
+        std::atomic<std::size_t> next{0}, converted{0};
+        auto claim = [&]
+        { return next.fetch_add(1, std::memory_order_relaxed); };
+        auto done = [&](std::size_t i, bool ok)
+        {
+            if (ok)
+                converted.fetch_add(1, std::memory_order_relaxed);
+            else
+            {
+                const std::lock_guard lock{m_failed_mutex};
+                m_failed.push_back(i);
+            }
+        };
+
+        // One band per worker; a nested call on the executor gets a single band and converts everything on worker 0
+        m_executor.ParallelFor(0, static_cast<std::int32_t>(m_workers.size()), 1, [&](std::int32_t w, std::int32_t)
+                               { convert(m_workers[static_cast<std::size_t>(w)], claim, done); });
+
+        std::sort(m_failed.begin(), m_failed.end());
+        return converted.load(std::memory_order_relaxed);
+    }
+
+    inline bool Batch::Apply(Worker &worker, const std::uint8_t *data, std::size_t size) const
+    {
+        if (!worker.image.Decode(data, size))
+            return false;
+        for (const auto &[step, user] : m_steps)
+            step(worker.image, user);
+        return true;
+    }
+}